@@ -6,6 +6,19 @@
 IMAGE=$1
 : ${STATUS:=0}
 
+if [ "${IMAGE}" = "-" ] ; then
+    #
+    #   Streamed update. The image is supplied on stdin. Write it to your device here as it
+    #   arrives, then read the verdict to commit or roll back.
+    #
+    cat >/dev/null
+    read VERDICT SUM <&${UPDATE_STATUS_FD}
+    if [ "${VERDICT}" != "OK" ] ; then
+        # Roll back the partially applied update here
+        exit 1
+    fi
+fi
+
 # Apply update ${IAMGE} here and set STATUS
 
 exit $STATUS
\ No newline at end of file
@@ -0,0 +1,671 @@
+/*
+    bench.c -- Benchmark harness for the updater fetch client and update flow
+
+    A local TLS test server is run in a child process. It serves an image of configurable size
+    with emulated latency, bandwidth and loss. The harness measures checksum throughput, TLS
+    handshake cost, and the download throughput and CPU cost of complete updates against it.
+    With --client, the updates are run by another client program, such as updater.js, for comparison.
+
+    bench [--size MB] [--iterations count] [--delay msec] [--digest engine] [--rate KB] \
+        [--loss percent] [--parallel count] [--pipeline count] [--chunked] [--client command] [--serve]
+ */
+
+/********************************** Includes **********************************/
+/*
+    The harness is built around the internal fetch and update functions
+ */
+#include "updater.c"
+
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+/********************************** Locals ************************************/
+
+#define BENCH_IMAGE      "/tmp/bench.bin"  //  Downloaded image path
+#define BENCH_CHUNK      (16 * 1024)       //  Server response write size
+#define BENCH_HANDSHAKES 20                //  Handshakes to time
+#define BENCH_HASH_SIZE  (64 * 1024 * 1024) //  Bytes to hash for the checksum throughput
+
+static int     chunked;       //  Send responses with chunked transfer encoding
+static cchar   *client;        //  Client command to run the updates instead of update()
+static cchar   *digest;        //  Checksum engine
+static int     delay;          //  Server delay before each response in msec
+static int     iterations = 5; //  Updates to run
+static int     loss;           //  Percentage of image responses cut short
+static int     parallel;       //  Parallel download connections
+static int     pipeline;       //  Download pipeline buffers
+static int     rate;           //  Server bandwidth in KB/sec. Zero for unlimited.
+static int     serve;          //  Run the server only
+static size_t  size = 32;      //  Image size in MB
+
+static uchar   *image;         //  Image served
+static size_t  imageSize;      //  Image size in bytes
+static char    imageSum[EVP_MAX_MD_SIZE * 2 + 1];
+static SSL_CTX *serverCtx;
+
+/********************************** Forwards **********************************/
+
+static int benchChecksum(void);
+static int benchHandshake(void);
+static int benchUpdate(void);
+static int clientUpdate(void);
+static int compareDouble(const void *a, const void *b);
+static int parseArgs(int argc, char **argv);
+static void quiet(int on);
+static void *serverConn(void *arg);
+static int serverContext(void);
+static int serverImage(SSL *ssl, cchar *range);
+static int serverListen(void);
+static void serverRun(int listenFd);
+static int serverWrite(SSL *ssl, cchar *buf, size_t len);
+
+/************************************ Code ************************************/
+
+static int usage(void)
+{
+    fprintf(stderr, "usage: bench [options]\n"
+            "--chunked           # Send responses with chunked transfer encoding\n"
+            "--client command    # Run the updates with a client command, e.g. \"node updater.js\"\n"
+            "--delay msec        # Server delay before each response\n"
+            "--digest engine     # Checksum engine: openssl, openssl:provider, kernel or blake3\n"
+            "--iterations count  # Updates to run (default 5)\n"
+            "--loss percent      # Percentage of image responses cut short\n"
+            "--parallel count    # Download using parallel connections\n"
+            "--pipeline count    # Hash and write on separate threads using count buffers\n"
+            "--rate KB           # Server bandwidth in KB/sec\n"
+            "--serve             # Run the test server only, for other clients\n"
+            "--size MB           # Image size (default 32 MB)\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    UpdateOptions opts;
+    struct rusage ru;
+    pid_t         pid;
+    int           listenFd, rc;
+
+    if (parseArgs(argc, argv) < 0) {
+        return 2;
+    }
+    memset(&opts, 0, sizeof(opts));
+    opts.digest = digest;
+    opts.parallel = parallel;
+    opts.pipeline = pipeline;
+    if (updateSetOptions(&opts) < 0) {
+        return 2;
+    }
+    if (serverContext() < 0 || (listenFd = serverListen()) < 0) {
+        return 1;
+    }
+    if (serve) {
+        printf("Serving %d MB image at https://localhost:%d\n", (int) size, SERVER_PORT);
+        serverRun(listenFd);
+        return 0;
+    }
+    if ((pid = fork()) < 0) {
+        perror("Cannot start server");
+        return 1;
+    }
+    if (pid == 0) {
+        serverRun(listenFd);
+        _exit(0);
+    }
+    close(listenFd);
+
+    printf("Image %d MB, delay %d msec, rate %d KB/sec (0 for unlimited), loss %d%%, %d connection(s), "
+           "%d pipeline buffers\n", (int) size, delay, rate, loss, parallel > 1 ? parallel : 1, pipeline);
+    rc = 0;
+    //  The handshake is measured for the updater fetch client only
+    if (benchChecksum() < 0 || (!client && benchHandshake() < 0) || benchUpdate() < 0) {
+        rc = 1;
+    }
+    getrusage(client ? RUSAGE_CHILDREN : RUSAGE_SELF, &ru);
+#if __APPLE__
+    printf("Peak RSS      %ld KB\n", (long) ru.ru_maxrss / 1024);
+#else
+    printf("Peak RSS      %ld KB\n", (long) ru.ru_maxrss);
+#endif
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(BENCH_IMAGE);
+    return rc;
+}
+
+/*
+    Measure the rate the image checksum is computed in download buffer sized blocks
+ */
+static int benchChecksum(void)
+{
+    Digest    dg;
+    char      sum[EVP_MAX_MD_SIZE * 2 + 1];
+    uchar     *buf;
+    long long start, elapsed;
+    size_t    len;
+    int       alg, rc;
+
+    if ((buf = malloc(BENCH_HASH_SIZE)) == NULL) {
+        return -1;
+    }
+    memset(buf, 0x5A, BENCH_HASH_SIZE);
+    alg = digest && strcmp(digest, "blake3") == 0 ? DIGEST_BLAKE3 : DIGEST_SHA256;
+    start = uticks();
+    if ((rc = digestInit(&dg, alg)) == 0) {
+        for (len = 0; rc == 0 && len < BENCH_HASH_SIZE; len += DOWNLOAD_BUFSIZE) {
+            rc = digestUpdate(&dg, &buf[len], DOWNLOAD_BUFSIZE);
+        }
+        if (rc == 0) {
+            rc = digestFinal(&dg, sum);
+        } else {
+            digestFree(&dg);
+        }
+    }
+    elapsed = uticks() - start;
+    free(buf);
+    if (rc < 0) {
+        return -1;
+    }
+    printf("Checksum      %.1f MB/sec (%s)\n", BENCH_HASH_SIZE / (elapsed / 1e6) / (1024 * 1024),
+           digest ? digest : "openssl");
+    return 0;
+}
+
+/*
+    Measure the cost of full and resumed TLS handshakes. Each request is made on a new connection.
+    The full handshakes discard the cached session first.
+ */
+static int benchHandshake(void)
+{
+    Fetch     *fp;
+    char      url[256];
+    double    full, resumed;
+    long long tls;
+    int       i, j, pass;
+
+    snprintf(url, sizeof(url), "https://localhost/tok/provision/updateReport");
+    full = resumed = 0;
+    for (pass = 0; pass < 2; pass++) {
+        tls = 0;
+        for (i = 0; i < BENCH_HANDSHAKES; i++) {
+            if (pass == 0) {
+                for (j = 0; j < FETCH_POOL; j++) {
+                    if (updater->pool[j].session) {
+                        updater->pool[j].transport->freeSession(updater->pool[j].session);
+                        updater->pool[j].session = NULL;
+                    }
+                }
+            }
+            metricsReset();
+            if ((fp = fetch("POST", url, "Content-Type: application/json\r\n", "{}")) == NULL) {
+                fprintf(stderr, "Cannot connect to the test server\n");
+                return -1;
+            }
+            ufree(fetchString(fp));
+            //  Retain the session but not the connection
+            fp->keepAlive = 0;
+            fetchFree(fp);
+            tls += updater->metrics.tls;
+        }
+        if (pass == 0) {
+            full = tls / 1000.0 / BENCH_HANDSHAKES;
+        } else {
+            resumed = tls / 1000.0 / BENCH_HANDSHAKES;
+        }
+    }
+    printf("Handshake     full %.2f msec, resumed %.2f msec\n", full, resumed);
+    return 0;
+}
+
+/*
+    Run complete updates and measure the download throughput and the CPU cost per MB. A client
+    command is measured by its elapsed time and child CPU time. Its retries are not known.
+ */
+static int benchUpdate(void)
+{
+    UpdateMetrics m;
+    struct rusage before, after;
+    double        cpu, mb, *rates, total;
+    char          path[UBSIZE];
+    long long     retries;
+    long long     start;
+    int           i, rc, who;
+
+    if ((rates = calloc(iterations, sizeof(double))) == NULL) {
+        return -1;
+    }
+    who = client ? RUSAGE_CHILDREN : RUSAGE_SELF;
+    cpu = mb = 0;
+    retries = 0;
+    for (i = 0; i < iterations; i++) {
+        unlink(BENCH_IMAGE);
+        unlink(resumePath(BENCH_IMAGE, path, sizeof(path)));
+        getrusage(who, &before);
+        quiet(1);
+        if (client) {
+            start = uticks();
+            rc = clientUpdate();
+            memset(&m, 0, sizeof(m));
+            m.bytes = (long long) imageSize;
+            m.transfer = uticks() - start;
+        } else {
+            rc = update("https://localhost", "bench", "token", "device", "1.0.0", NULL, BENCH_IMAGE, NULL, 0);
+            updateGetMetrics(&m);
+        }
+        quiet(0);
+        getrusage(who, &after);
+        if (rc < 0) {
+            fprintf(stderr, "Update %d failed\n", i);
+            free(rates);
+            return -1;
+        }
+        rates[i] = m.transfer ? m.bytes / (m.transfer / 1e6) / (1024 * 1024) : 0;
+        mb += m.bytes / (1024.0 * 1024.0);
+        cpu += (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1000.0 +
+               (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1000.0 +
+               (after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1000.0 +
+               (after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1000.0;
+        retries += m.retries;
+    }
+    qsort(rates, iterations, sizeof(double), compareDouble);
+    for (total = 0, i = 0; i < iterations; i++) {
+        total += rates[i];
+    }
+    printf("Download      min %.1f, median %.1f, mean %.1f, max %.1f MB/sec\n", rates[0],
+           rates[iterations / 2], total / iterations, rates[iterations - 1]);
+    printf("CPU           %.2f msec/MB\n", mb > 0 ? cpu / mb : 0);
+    if (!client) {
+        printf("Retries       %lld\n", retries);
+    }
+    free(rates);
+    return 0;
+}
+
+/*
+    Run an update with the client command. The command is given the update arguments and must exit
+    with zero status once the image is downloaded and verified.
+ */
+static int clientUpdate(void)
+{
+    char command[UBSIZE];
+
+    //  The test server certificate is self-signed, so NodeJS clients must not verify it
+    setenv("NODE_TLS_REJECT_UNAUTHORIZED", "0", 1);
+    setenv("NODE_NO_WARNINGS", "1", 1);
+    snprintf(command, sizeof(command), "%s --host https://localhost:%d --product bench --token token "
+             "--device device --version 1.0.0 --file %s", client, SERVER_PORT, BENCH_IMAGE);
+    return system(command) == 0 ? 0 : -1;
+}
+
+static int compareDouble(const void *a, const void *b)
+{
+    double da, db;
+
+    da = *(const double*) a;
+    db = *(const double*) b;
+    return da < db ? -1 : da > db;
+}
+
+/*
+    Discard the updater trace output while measuring
+ */
+static void quiet(int on)
+{
+    static int saved = -1;
+    int        fd;
+
+    fflush(stdout);
+    if (on && saved < 0) {
+        saved = dup(1);
+        if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+            dup2(fd, 1);
+            close(fd);
+        }
+    } else if (!on && saved >= 0) {
+        dup2(saved, 1);
+        close(saved);
+        saved = -1;
+    }
+}
+
+/*
+    Create the server TLS context with a self-signed certificate generated for the run. The updater
+    fetch client does not verify the server certificate.
+ */
+static int serverContext(void)
+{
+    EVP_PKEY  *key;
+    X509      *cert;
+    X509_NAME *name;
+
+    if ((key = EVP_EC_gen("P-256")) == NULL || (cert = X509_new()) == NULL) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_set_pubkey(cert, key);
+    name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (uchar*) "localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    if (X509_sign(cert, key, EVP_sha256()) == 0) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    if ((serverCtx = SSL_CTX_new(TLS_server_method())) == NULL ||
+        SSL_CTX_use_certificate(serverCtx, cert) != 1 || SSL_CTX_use_PrivateKey(serverCtx, key) != 1) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return 0;
+}
+
+/*
+    Create the image and listen for connections on the updater port
+ */
+static int serverListen(void)
+{
+    struct sockaddr_in addr;
+    unsigned char      hash[EVP_MAX_MD_SIZE];
+    unsigned int       hashLen, i;
+    size_t             pos;
+    uint               seed;
+    int                fd, on;
+
+    imageSize = size * 1024 * 1024;
+    if ((image = malloc(imageSize)) == NULL) {
+        fprintf(stderr, "Cannot allocate image\n");
+        return -1;
+    }
+    //  Incompressible, so the download is not shortened by compression
+    for (seed = 1, pos = 0; pos < imageSize; pos++) {
+        seed = seed * 1103515245 + 12345;
+        image[pos] = (uchar) (seed >> 16);
+    }
+    if (EVP_Digest(image, imageSize, hash, &hashLen, EVP_sha256(), NULL) != 1) {
+        return -1;
+    }
+    for (i = 0; i < hashLen; i++) {
+        sprintf(&imageSum[i * 2], "%02x", hash[i]);
+    }
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("Cannot create socket");
+        return -1;
+    }
+    on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(SERVER_PORT);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        fprintf(stderr, "Cannot listen on port %d: %s\n", SERVER_PORT, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+    Accept connections. Each connection is served by its own thread.
+ */
+static void serverRun(int listenFd)
+{
+    pthread_t thread;
+    long      fd;
+
+    signal(SIGPIPE, SIG_IGN);
+    srandom((uint) getpid());
+    while (1) {
+        if ((fd = accept(listenFd, NULL, NULL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pthread_create(&thread, NULL, serverConn, (void*) fd) != 0) {
+            close((int) fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+/*
+    Serve requests on a connection until the client closes it. The update check offers the image,
+    the image supports range requests, and reports are accepted.
+ */
+static void *serverConn(void *arg)
+{
+    SSL     *ssl;
+    char    buf[UBSIZE * 2], response[UBSIZE], body[UBSIZE], host[256], *end, *hp, *range;
+    ssize_t bytes;
+    size_t  len, used, contentLength;
+    int     fd, on;
+
+    fd = (int) (long) arg;
+    on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if ((ssl = SSL_new(serverCtx)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    SSL_set_fd(ssl, fd);
+    if (SSL_accept(ssl) != 1) {
+        SSL_free(ssl);
+        close(fd);
+        return NULL;
+    }
+    len = 0;
+    while (1) {
+        buf[len] = '\0';
+        while ((end = strstr(buf, "\r\n\r\n")) == NULL) {
+            if (len >= sizeof(buf) - 1 || (bytes = SSL_read(ssl, &buf[len], (int) (sizeof(buf) - 1 - len))) <= 0) {
+                goto done;
+            }
+            len += bytes;
+            buf[len] = '\0';
+        }
+        *end = '\0';
+        contentLength = (hp = strcasestr(buf, "\r\nContent-Length:")) ? (size_t) atoi(&hp[17]) : 0;
+        snprintf(host, sizeof(host), "localhost");
+        if ((hp = strcasestr(buf, "\r\nHost:")) != NULL) {
+            hp += 7;
+            while (*hp == ' ') hp++;
+            snprintf(host, sizeof(host), "%.*s", (int) strcspn(hp, "\r\n"), hp);
+        }
+        range = strcasestr(buf, "\r\nRange: bytes=");
+
+        //  Consume the request body
+        used = (end + 4 - buf);
+        while (len < used + contentLength) {
+            if ((bytes = SSL_read(ssl, &buf[len], (int) min(sizeof(buf) - 1 - len, used + contentLength - len))) <= 0) {
+                goto done;
+            }
+            len += bytes;
+        }
+        if (delay) {
+            usleep(delay * 1000);
+        }
+        if (strncmp(buf, "GET /image", 10) == 0) {
+            if (serverImage(ssl, range ? &range[15] : NULL) < 0) {
+                goto done;
+            }
+        } else {
+            if (strncmp(buf, "POST /tok/provision/update ", 27) == 0) {
+                //  The image URL uses the Host of the request, so clients that need the port get it
+                snprintf(body, sizeof(body),
+                         "{\"url\":\"https://%s/image\",\"checksum\":\"%s\",\"update\":\"bench\",\"version\":\"2.0.0\"}",
+                         host, imageSum);
+            } else {
+                snprintf(body, sizeof(body), "{}");
+            }
+            if (chunked) {
+                snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                         "Transfer-Encoding: chunked\r\n\r\n%x\r\n%s\r\n0\r\n\r\n", (int) strlen(body), body);
+            } else {
+                snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                         "Content-Length: %d\r\n\r\n%s", (int) strlen(body), body);
+            }
+            if (serverWrite(ssl, response, strlen(response)) < 0) {
+                goto done;
+            }
+        }
+        memmove(buf, &buf[used + contentLength], len - used - contentLength);
+        len -= used + contentLength;
+    }
+done:
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+    return NULL;
+}
+
+/*
+    Send the image or a range of it. Writes are paced to the emulated bandwidth. With emulated
+    loss, the response may be cut short and the connection closed, so the client must resume.
+    With chunked encoding, each write is sent as a chunk.
+ */
+static int serverImage(SSL *ssl, cchar *range)
+{
+    char      headers[UBSIZE], framing[80], chunk[16];
+    size_t    start, end, pos, cut, n;
+    long long began, due;
+
+    start = 0;
+    end = imageSize;
+    if (range) {
+        start = (size_t) strtoll(range, NULL, 10);
+        if (range[strcspn(range, "-")] == '-' && isdigit((uchar) range[strcspn(range, "-") + 1])) {
+            end = (size_t) strtoll(&range[strcspn(range, "-") + 1], NULL, 10) + 1;
+        }
+        end = min(end, imageSize);
+        if (start >= end) {
+            start = 0;
+            end = imageSize;
+            range = NULL;
+        }
+    }
+    if (chunked) {
+        snprintf(framing, sizeof(framing), "Transfer-Encoding: chunked\r\n");
+    } else {
+        snprintf(framing, sizeof(framing), "Content-Length: %lld\r\n", (long long) (end - start));
+    }
+    if (range) {
+        snprintf(headers, sizeof(headers), "HTTP/1.1 206 Partial Content\r\nContent-Type: application/octet-stream\r\n"
+                 "%sContent-Range: bytes %lld-%lld/%lld\r\nETag: \"bench\"\r\n\r\n",
+                 framing, (long long) start, (long long) end - 1, (long long) imageSize);
+    } else {
+        snprintf(headers, sizeof(headers), "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                 "%sETag: \"bench\"\r\n\r\n", framing);
+    }
+    if (serverWrite(ssl, headers, strlen(headers)) < 0) {
+        return -1;
+    }
+    cut = end;
+    if (loss && (random() % 100) < loss) {
+        cut = start + (size_t) random() % (end - start);
+    }
+    began = ticks();
+    for (pos = start; pos < end; pos += n) {
+        n = min(BENCH_CHUNK, end - pos);
+        if (pos + n > cut) {
+            //  Emulated loss: drop the connection part way through the response
+            return -1;
+        }
+        if (rate) {
+            due = began + (long long) ((pos - start) * 1000.0 / (rate * 1024.0));
+            if (due > ticks()) {
+                usleep((useconds_t) ((due - ticks()) * 1000));
+            }
+        }
+        if (chunked) {
+            snprintf(chunk, sizeof(chunk), "%s%x\r\n", pos > start ? "\r\n" : "", (int) n);
+            if (serverWrite(ssl, chunk, strlen(chunk)) < 0) {
+                return -1;
+            }
+        }
+        if (serverWrite(ssl, (char*) &image[pos], n) < 0) {
+            return -1;
+        }
+    }
+    if (chunked && serverWrite(ssl, "\r\n0\r\n\r\n", 7) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int serverWrite(SSL *ssl, cchar *buf, size_t len)
+{
+    int bytes;
+
+    while (len > 0) {
+        if ((bytes = SSL_write(ssl, buf, (int) len)) <= 0) {
+            return -1;
+        }
+        buf += bytes;
+        len -= bytes;
+    }
+    return 0;
+}
+
+static int parseArgs(int argc, char **argv)
+{
+    char *argp;
+    int  nextArg;
+
+    for (nextArg = 1; nextArg < argc; nextArg++) {
+        argp = argv[nextArg];
+        if (strcmp(argp, "--chunked") == 0) {
+            chunked = 1;
+            continue;
+        }
+        if (strcmp(argp, "--serve") == 0) {
+            serve = 1;
+            continue;
+        }
+        if (nextArg + 1 >= argc) {
+            usage();
+        }
+        if (strcmp(argp, "--client") == 0) {
+            client = argv[++nextArg];
+
+        } else if (strcmp(argp, "--delay") == 0) {
+            delay = atoi(argv[++nextArg]);
+
+        } else if (strcmp(argp, "--digest") == 0) {
+            digest = argv[++nextArg];
+
+        } else if (strcmp(argp, "--iterations") == 0) {
+            iterations = atoi(argv[++nextArg]);
+
+        } else if (strcmp(argp, "--loss") == 0) {
+            loss = atoi(argv[++nextArg]);
+
+        } else if (strcmp(argp, "--parallel") == 0) {
+            parallel = atoi(argv[++nextArg]);
+
+        } else if (strcmp(argp, "--pipeline") == 0) {
+            pipeline = atoi(argv[++nextArg]);
+
+        } else if (strcmp(argp, "--rate") == 0) {
+            rate = atoi(argv[++nextArg]);
+
+        } else if (strcmp(argp, "--size") == 0) {
+            size = (size_t) atoi(argv[++nextArg]);
+
+        } else {
+            usage();
+        }
+    }
+    if (iterations <= 0 || size == 0 || delay < 0 || rate < 0 || loss < 0 || loss >= 100) {
+        usage();
+    }
+    return 0;
+}
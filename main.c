@@ -7,9 +7,11 @@
 
 /********************************** Includes **********************************/
 
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "updater.h"
@@ -20,27 +22,66 @@
 #define SERVER_PORT 443
 #define BUFFER_SIZE 4096
 
+#define CHECK_INTERVAL 3600         //  Default daemon check interval in seconds
+#define CHECK_JITTER   20           //  Randomize daemon check times by this percentage
+#define MAX_BACKOFF    (7 * 24 * 3600) //  Maximum daemon check delay after failures
+
 static cchar *cmd, *device, *file, *host, *product, *token, *version;
 static char  *properties;
 static int   verbose = 0;
+static int   daemonMode = 0;
+static int   interval = CHECK_INTERVAL;
+
+static UpdateOptions options;
 
 /********************************** Forwards **********************************/
 
+static unsigned jitter(unsigned delay);
+static void onSignal(int sig);
+static void printMetrics(void);
 static int parseArgs(int argc, char **argv);
+static int runDaemon(void);
 
 /************************************ Code ************************************/
 
 static int usage(void)
 {
     fprintf(stderr, "usage: update [options] [key=value,...]\n"
+            "--adaptive          # Slow the download to yield to other network traffic\n"
+            "--arena KB          # Run the updater within a fixed memory arena\n"
+            "--base image/path   # Current image to apply delta updates against\n"
+            "--buffer-size bytes # Download buffer and write block size\n"
+            "--cache dir         # Directory to cache verified update images\n"
+            "--cache-size MB     # Maximum size of the image cache (default 256 MB)\n"
             "--cmd script        # Script to invoke to apply the update\n"
+            "--compact           # Send a hash of the device properties on repeated checks\n"
+            "--connect-timeout s # Seconds to wait for a connection and TLS handshake (default 10)\n"
+            "--daemon            # Run continuously and check for updates periodically\n"
             "--device ID         # Unique device ID\n"
+            "--digest engine     # Checksum engine: openssl, openssl:provider, kernel or blake3\n"
+            "--direct            # Write the image using direct I/O\n"
+            "--drop-cache        # Release the written image from the page cache\n"
             "--file image/path   # Path to save the downloaded update\n"
             "--host host.domain  # Device cloud endpoint from the Builder cloud edit panel\n"
+            "--interval secs     # Daemon check interval (default 1 hour)\n"
+            "--key key.pem       # Public key to verify update signatures\n"
+            "--ktls              # Use kernel TLS to receive the image directly into the file\n"
+            "--metrics           # Print update metrics and include them in the update report\n"
+            "--mirrors host,...  # Fallback hosts for the image download, tried in order\n"
+            "--parallel count    # Download large images using parallel connections\n"
+            "--peer-port port    # Port for LAN peer discovery and image service (default 7447)\n"
+            "--peers             # Share cached images with LAN peers and download from them first\n"
+            "--pipeline count    # Hash and write the image on separate threads using count buffers\n"
             "--product ProductID # ProductID from the Buidler token list\n"
+            "--rate KB           # Limit the download rate to KB/sec\n"
+            "--reports file      # Queue update reports in file and retry them until posted\n"
+            "--retries count     # Retries of a failing check or download with backoff (default 3)\n"
+            "--stream            # Stream the image to the --cmd script without saving\n"
+            "--timeout secs      # Seconds to wait for a response or for more data (default 30)\n"
             "--token TokenID     # CloudAPI access token from the Builder token list\n"
             "--version SemVer    # Current device firmware version\n"
             "--verbose           # Trace execution\n"
+            "--window start-end  # Daily download window of the form HH:MM-HH:MM\n"
             "key:value,...       # Device-specific properties for the distribution policy\n");
     exit(2);
 }
@@ -53,12 +94,104 @@ int main(int argc, char **argv)
     if (!host || !product || !token || !device || !version) {
         usage();
     }
+    //  The arena is allocated once. Updates then make no heap allocations of their own.
+    if (options.arenaSize > 0 && (options.arena = malloc(options.arenaSize)) == NULL) {
+        fprintf(stderr, "Cannot allocate %d byte arena\n", options.arenaSize);
+        return -1;
+    }
+    if (updateSetOptions(&options) < 0) {
+        usage();
+    }
+    //  The application can pause downloads with SIGUSR1 and resume with SIGUSR2
+    signal(SIGUSR1, onSignal);
+    signal(SIGUSR2, onSignal);
+    if (daemonMode) {
+        return runDaemon();
+    }
     if (update(host, product, token, device, version, properties, file, cmd, verbose) < 0) {
+        printMetrics();
         return -1;
     }
+    printMetrics();
     return 0;
 }
 
+/*
+    Check for updates periodically. Check times are randomized so a fleet of devices started
+    together does not check together. After failures, the delay is doubled up to MAX_BACKOFF.
+    The connection to the device cloud is kept open between checks while the server permits.
+ */
+static int runDaemon(void)
+{
+    unsigned delay;
+    int      failures, i;
+
+    srandom((unsigned) time(NULL) ^ (unsigned) getpid());
+    sleep(random() % ((unsigned) interval / 100 * CHECK_JITTER + 1));
+
+    failures = 0;
+    while (1) {
+        if (update(host, product, token, device, version, properties, file, cmd, verbose) < 0) {
+            failures++;
+        } else {
+            failures = 0;
+        }
+        printMetrics();
+        for (delay = interval, i = 0; i < failures && delay * 2 <= MAX_BACKOFF; i++) {
+            delay *= 2;
+        }
+        delay = jitter(delay);
+        if (verbose) {
+            printf("Next update check in %u seconds\n", delay);
+        }
+        fflush(stdout);
+        sleep(delay);
+    }
+    return 0;
+}
+
+/*
+    Randomize a delay by +/- CHECK_JITTER percent
+ */
+static unsigned jitter(unsigned delay)
+{
+    unsigned span;
+
+    span = delay / 100 * CHECK_JITTER;
+    if (span == 0) {
+        return delay;
+    }
+    return delay - span + (unsigned) (random() % (2 * span + 1));
+}
+
+/*
+    Print the metrics of the last update if requested
+ */
+static void printMetrics(void)
+{
+    UpdateMetrics m;
+
+    if (!options.metrics) {
+        return;
+    }
+    updateGetMetrics(&m);
+    printf("Update metrics (msec): dns %.1f, connect %.1f, tls %.1f, first byte %.1f, transfer %.1f, "
+           "checksum %.1f, apply %.1f, total %.1f\n",
+           m.dns / 1000.0, m.connect / 1000.0, m.tls / 1000.0, m.firstByte / 1000.0, m.transfer / 1000.0,
+           m.checksum / 1000.0, m.apply / 1000.0, m.total / 1000.0);
+    printf("Update metrics: %lld bytes at %.1f MB/sec, %lld requests, %lld connections, %lld retries, "
+           "%lld reads, %lld writes\n",
+           m.bytes, m.throughput / (1024.0 * 1024.0), m.requests, m.connections, m.retries, m.reads, m.writes);
+    if (options.arena) {
+        printf("Update metrics: %lld bytes peak arena memory\n", m.memory);
+    }
+}
+
+static void onSignal(int sig)
+{
+    updatePause(sig == SIGUSR1);
+}
+
 static int parseArgs(int argc, char **argv)
 {
     char *argp, *key, *value, pbuf[BUFFER_SIZE];
@@ -70,12 +203,63 @@ static int parseArgs(int argc, char **argv)
         if (*argp != '-') {
             break;
         }
-        if (strcmp(argp, "--cmd") == 0) {
+        if (strcmp(argp, "--adaptive") == 0) {
+            options.adaptive = 1;
+
+        } else if (strcmp(argp, "--arena") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.arenaSize = atoi(argv[++nextArg]) * 1024;
+
+        } else if (strcmp(argp, "--base") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.base = argv[++nextArg];
+
+        } else if (strcmp(argp, "--buffer-size") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.bufferSize = atoi(argv[++nextArg]);
+
+        } else if (strcmp(argp, "--cache") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.cache = argv[++nextArg];
+
+        } else if (strcmp(argp, "--cache-size") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.cacheSize = atoi(argv[++nextArg]);
+
+        } else if (strcmp(argp, "--cmd") == 0) {
             if (nextArg >= argc) {
                 usage();
             }
             cmd = argv[++nextArg];
 
+        } else if (strcmp(argp, "--compact") == 0) {
+            options.compact = 1;
+
+        } else if (strcmp(argp, "--connect-timeout") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.connectTimeout = atoi(argv[++nextArg]);
+
+        } else if (strcmp(argp, "--daemon") == 0) {
+            daemonMode = 1;
+
+        } else if (strcmp(argp, "--direct") == 0) {
+            options.direct = 1;
+
+        } else if (strcmp(argp, "--drop-cache") == 0) {
+            options.dropCache = 1;
+
         } else if (strcmp(argp, "--file") == 0) {
             if (nextArg >= argc) {
                 usage();
@@ -88,12 +272,89 @@ static int parseArgs(int argc, char **argv)
             }
             host = argv[++nextArg];
 
+        } else if (strcmp(argp, "--interval") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            interval = atoi(argv[++nextArg]);
+            if (interval <= 0) {
+                usage();
+            }
+
+        } else if (strcmp(argp, "--key") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.key = argv[++nextArg];
+
+        } else if (strcmp(argp, "--ktls") == 0) {
+            options.ktls = 1;
+
+        } else if (strcmp(argp, "--metrics") == 0) {
+            options.metrics = 1;
+
+        } else if (strcmp(argp, "--mirrors") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.mirrors = argv[++nextArg];
+
+        } else if (strcmp(argp, "--parallel") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.parallel = atoi(argv[++nextArg]);
+
+        } else if (strcmp(argp, "--peer-port") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.peerPort = atoi(argv[++nextArg]);
+
+        } else if (strcmp(argp, "--peers") == 0) {
+            options.peers = 1;
+
+        } else if (strcmp(argp, "--pipeline") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.pipeline = atoi(argv[++nextArg]);
+
         } else if (strcmp(argp, "--product") == 0) {
             if (nextArg >= argc) {
                 usage();
             }
             product = argv[++nextArg];
 
+        } else if (strcmp(argp, "--rate") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.rate = atoi(argv[++nextArg]);
+
+        } else if (strcmp(argp, "--reports") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.reports = argv[++nextArg];
+
+        } else if (strcmp(argp, "--retries") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            //  Zero selects the library default, so no retries is -1
+            options.retries = atoi(argv[++nextArg]);
+            options.retries = options.retries > 0 ? options.retries : -1;
+
+        } else if (strcmp(argp, "--stream") == 0) {
+            options.stream = 1;
+
+        } else if (strcmp(argp, "--timeout") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.timeout = atoi(argv[++nextArg]);
+
         } else if (strcmp(argp, "--token") == 0) {
             if (nextArg >= argc) {
                 usage();
@@ -106,6 +367,12 @@ static int parseArgs(int argc, char **argv)
             }
             device = argv[++nextArg];
 
+        } else if (strcmp(argp, "--digest") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.digest = argv[++nextArg];
+
         } else if (strcmp(argp, "--version") == 0) {
             if (nextArg >= argc) {
                 usage();
@@ -115,6 +382,12 @@ static int parseArgs(int argc, char **argv)
         } else if (strcmp(argp, "--verbose") == 0 || strcmp(argp, "-v") == 0) {
             verbose = 1;
 
+        } else if (strcmp(argp, "--window") == 0) {
+            if (nextArg >= argc) {
+                usage();
+            }
+            options.window = argv[++nextArg];
+
         } else {
             usage();
         }
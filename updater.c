@@ -5,53 +5,920 @@
  */
 
 /********************************** Includes **********************************/
+#if __linux__
+    #define _GNU_SOURCE    //  O_DIRECT, sync_file_range
+#endif
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
+#include <utime.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/provider.h>
+#include <openssl/rand.h>
+#if __linux__
+    #include <linux/if_alg.h>
+    #include <sys/syscall.h>
+#endif
 
 #include "updater.h"
 
+#if ME_UPDATER_DELTA
+    #include <bzlib.h>
+#endif
+#if ME_UPDATER_COMPRESS
+    #include <zlib.h>
+#else
+    #undef HAS_ZSTD
+#endif
+#if HAS_ZSTD
+    #include <zstd.h>
+#endif
+#if HAS_BLAKE3
+    #include <blake3.h>
+#endif
+
 /********************************** Locals ************************************/
 
 #define DEFAULT_IMAGE_PATH "/tmp/update.bin"
 
+#ifndef SERVER_PORT
 #define SERVER_PORT        443
+#endif
 #define UBSIZE             4096
 
+#define RESUME_EXT         ".resume"   //  Extension of the partial download sidecar
+#define RESUME_INTERVAL    (1 << 20)   //  Bytes between resume sidecar checkpoints
+#define FETCH_POOL         4           //  Hosts with cached idle connections and TLS sessions
+#define DNS_CACHE          8           //  Hosts with cached addresses
+#define DNS_ADDRS          8           //  Addresses cached per host
+#define DNS_TTL            300         //  Seconds to cache host addresses
+#define CONNECT_DELAY      250         //  Milliseconds before racing the next address (RFC 8305)
+#define CONNECT_TIMEOUT    10          //  Default seconds to wait for a connection and TLS handshake
+#define READ_TIMEOUT       30          //  Default seconds to wait for response headers and each body read
+#define RETRY_COUNT        3           //  Default retries of a failing check or download
+#define RETRY_DELAY        1000        //  Milliseconds before the first retry. Doubled for each retry.
+#define RETRY_DELAY_MAX    60000       //  Maximum milliseconds between retries
+#define CACHE_EXT          ".meta"     //  Extension of the image cache entry
+#define CACHE_SIZE         256         //  Default image cache size cap in megabytes
+#define PEER_PORT          7447        //  Default port for LAN peer discovery and the peer image service
+#define PEER_GROUP         "239.255.74.47"  //  Site local multicast group for LAN peer discovery
+#define PEER_QUERY         "updater-peer?" //  Discovery query: "updater-peer? CHECKSUM"
+#define PEER_ANSWER        "updater-peer!" //  Discovery answer: "updater-peer! CHECKSUM PORT"
+#define PEER_WAIT          300         //  Milliseconds to wait for peers to answer a query
+#define PEER_MAX           4           //  Maximum peers tried for an image
+#define PEER_CLIENTS       8           //  Maximum concurrent peer image connections served
+#define PEER_BUFSIZE       (16 * 1024) //  Peer image service read and write size
+#define REPORT_MAX         64          //  Maximum update reports held in the report queue
+#define REPORT_FIELDS      768         //  Maximum size of the report members after "success"
+#define REPORT_PIPELINE    8           //  Queued reports written before reading their responses
+#define REPORT_BATCH       32          //  Reports of a batch update queued before the queue is flushed
+#define REPORT_ATTEMPTS    10          //  Failed posts of a queued report before it is discarded
+#define REPORT_DELAY       60          //  Seconds before a failed report is posted again. Doubled for each failure.
+#define REPORT_DELAY_MAX   3600        //  Maximum seconds before a failed report is posted again
+#define BATCH_PIPELINE     16          //  Batch check requests written before reading responses
+#define SHAPE_BLOCK        4096        //  Minimum rate limit burst in bytes
+#define SHAPE_START        (256 * 1024) //  Initial adaptive rate in bytes/sec without a rate limit
+#define SHAPE_MIN          (4 * 1024)  //  Minimum adaptive rate in bytes/sec
+#define SHAPE_SAMPLE       250         //  Milliseconds between adaptive rate updates
+#define SHAPE_TARGET       100.0       //  Target queuing delay in milliseconds (RFC 6817)
+#define SHAPE_GAIN         0.25        //  Proportion of the rate adjusted per sample at full offset
+#define SHAPE_BASE_PERIOD  (600 * 1000) //  Milliseconds before refreshing the base round trip time
+#define RANGE_MIN          (1 << 20)   //  Minimum size of a parallel download range
+#define DOWNLOAD_BUFSIZE   (64 * 1024) //  Default download buffer size
+#define DOWNLOAD_ALIGN     4096        //  Alignment of buffered image writes
+#define PIPE_MAX           16          //  Maximum buffers in the download pipeline ring
+#define APPLY_STATUS_FD    3           //  Apply script descriptor for the streamed image verdict
+#define JSON_TOKENS        32          //  Initial JSON token allocation
+#define PATCH_MAGIC        "ENDSLEY/BSDIFF43"  //  Delta patch format signature
+#define PATCH_HEADER       24          //  Patch signature and new image size
+#define PATCH_BUFSIZE      (64 * 1024) //  Decompressed patch buffer size
+#define DECODE_BUFSIZE     (16 * 1024) //  Compressed response input buffer size
+#define DECODE_WINDOW_LOG  23          //  Maximum zstd window (8MB) to bound decoder memory
+#define BODY_MAX           (256 * 1024) //  Maximum check and report response body
+#define CHUNK_READ         256         //  Read size while receiving chunk framing
+#define ARENA_ALIGN        16          //  Alignment of arena allocations
+#define ARENA_MIN          (64 * 1024) //  Minimum arena size
+
+#define DIGEST_LEN         32          //  SHA-256 and BLAKE3 digest size in bytes
+
+#define DIGEST_SHA256      0           //  SHA-256 image checksums
+#define DIGEST_BLAKE3      1           //  BLAKE3 image checksums, if offered by the Builder
+
+#define FRAME_LENGTH       0           //  Body delimited by Content-Length
+#define FRAME_CHUNKED      1           //  Body uses chunked transfer encoding
+#define FRAME_CLOSE        2           //  Body delimited by the connection closing
+
+#define CHUNK_SIZE         0           //  Receiving a chunk size
+#define CHUNK_EXT          1           //  Receiving chunk extensions, which are ignored
+#define CHUNK_DATA         2           //  Receiving chunk data
+#define CHUNK_END          3           //  Receiving the line ending after chunk data
+#define CHUNK_TRAILER      4           //  Receiving trailer lines after the last chunk
+
+#define DECODE_GZIP        1           //  Content-Encoding: gzip
+#define DECODE_ZSTD        2           //  Content-Encoding: zstd
+
+#if HAS_ZSTD
+    #define ACCEPT_ENCODING "zstd, gzip"
+#else
+    #define ACCEPT_ENCODING "gzip"
+#endif
+
+#ifndef HAS_UCHAR
+typedef unsigned char uchar;
+#endif
+#ifndef HAS_UINT
+typedef unsigned int uint;
+#endif
+
+#ifndef min
+    #define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+    #define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#if ME_UPDATER_COMPRESS
+/*
+    Streaming decoder for a compressed response. Compressed data is read into the input buffer and
+    decoded into the download write buffer.
+ */
+typedef struct Decoder {
+    int encoding;          //  Content encoding
+    int end;               //  End of the compressed stream
+    z_stream zs;           //  Gzip decoder
+#if HAS_ZSTD
+    ZSTD_DStream *zds;     //  Zstd decoder
+#endif
+    char in[DECODE_BUFSIZE];   //  Compressed input
+} Decoder;
+#endif
+
+/*
+    Memory arena block. Blocks tile the arena in address order. Free blocks are coalesced as the
+    arena is searched.
+ */
+typedef struct ArenaBlock {
+    size_t size;           //  Block size including the header
+    size_t used;           //  Block is allocated
+} ArenaBlock;
+
+#define ARENA_HEADER       ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+/*
+    Caller supplied memory for all updater allocations
+ */
+typedef struct Arena {
+    pthread_mutex_t lock;  //  Guards the arena blocks
+    char *base;            //  First block. NULL if allocating from the heap.
+    char *end;             //  End of the arena
+    size_t used;           //  Bytes allocated including headers
+    size_t peak;           //  Maximum bytes allocated since the last update started
+} Arena;
+
+/*
+    Incremental image digest. SHA-256 is computed by OpenSSL or, if selected, the kernel crypto API.
+ */
+typedef struct Digest {
+    int alg;               //  Checksum algorithm
+    EVP_MD_CTX *mdctx;     //  OpenSSL digest context
+    int fd;                //  Kernel crypto API operation socket. -1 if not used.
+#if HAS_BLAKE3
+    blake3_hasher blake3;  //  BLAKE3 hasher
+#endif
+} Digest;
+
 typedef struct Fetch {
-    SSL_CTX *ctx;          //  TLS context
-    SSL *ssl;              //  TLS config
+    const UpdateTransport *transport;  //  TLS transport of the connection
+    void *tls;             //  TLS connection. NULL once closed.
     int fd;                //  Connection socket fd
+    char host[256];        //  Host name of the connection
     char *response;        //  Response headers
-    char *firstBody;       //  Body read with headers
-    size_t contentLength;  //  Response content length
+    char rx[UBSIZE];       //  Received data not yet consumed: headers, body read with them or a pipelined response
+    size_t rxStart;        //  Start of the unconsumed data in rx
+    size_t rxEnd;          //  End of the data in rx
+    int framing;           //  Response body framing
+    size_t contentLength;  //  Response content length. Zero if not known.
+    size_t remaining;      //  Body bytes yet to receive with Content-Length framing
+    int chunkState;        //  Chunked framing parser state
+    size_t chunkLeft;      //  Bytes remaining in the current chunk, or the chunk size being parsed
+    size_t lineLen;        //  Length of the chunk size or trailer line being parsed
     int status;            //  Response HTTP status
+    int reused;            //  Connection was reused from the pool
+    int keepAlive;         //  Connection may be reused once the response is consumed
+    int conditional;       //  Request is conditional, so 412 Precondition Failed is a valid response
+    int complete;          //  Response body has been fully received
+    long long reads;       //  Read calls on the connection
+    long long bytes;       //  Bytes received on the connection
 } Fetch;
 
-static int verbose;        //  Trace execution
+/*
+    JSON token. Parsing is in-situ: after jsonParse, each string and primitive value is NUL
+    terminated within the parsed text and escapes are decoded in place.
+ */
+typedef struct JsonToken {
+    char *value;           //  Token text (objects and arrays refer to the opening bracket)
+    size_t len;            //  Length of the value text
+    int type;              //  Token type
+    int size;              //  Number of members (objects) or elements (arrays)
+    int next;              //  Index of the token following this token and its children
+} JsonToken;
+
+#define JSON_OBJECT        1
+#define JSON_ARRAY         2
+#define JSON_STRING        3
+#define JSON_PRIMITIVE     4
+
+/*
+    Parsed JSON text. Token zero is the top level value.
+ */
+typedef struct Json {
+    JsonToken *tokens;     //  Tokens in document order
+    int count;             //  Number of tokens
+    int max;               //  Allocated tokens
+} Json;
+
+/*
+    Last update check. If the server supplies an entity tag, a repeated check with the same request
+    is conditional and the cached response is used if the server responds "Not Modified". If the
+    server supplies a max-age for a "no update" response, the response is used without checking
+    until it expires.
+ */
+typedef struct CheckCache {
+    char *request;         //  Request body of the cached check
+    char *response;        //  Response body of the cached check
+    char etag[80];         //  Entity tag of the cached response
+    long long expires;     //  Time the cached response must be checked again. Zero if always checked.
+} CheckCache;
+
+/*
+    Resolved host addresses. The addresses are ordered alternating between address families so
+    connection attempts race IPv6 and IPv4. The getaddrinfo API does not provide record TTLs, so
+    entries are kept for DNS_TTL seconds.
+ */
+typedef struct Resolved {
+    char host[256];        //  Host name
+    struct sockaddr_storage addrs[DNS_ADDRS];   //  Addresses in connection order
+    socklen_t lens[DNS_ADDRS];  //  Address lengths
+    int count;             //  Number of addresses
+    time_t expires;        //  Time the entry expires
+} Resolved;
+
+/*
+    Download bandwidth shaping. A token bucket shared by all download connections.
+ */
+typedef struct Shaper {
+    pthread_mutex_t lock;  //  Guards the bucket
+    double rate;           //  Current rate in bytes/sec. Zero until the first download.
+    double tokens;         //  Bytes that may be received. Negative if in debt.
+    long long last;        //  Time the bucket was last filled
+    long long sample;      //  Time of the last adaptive rate update
+    long long baseTime;    //  Time the base round trip time was set
+    double baseRtt;        //  Lowest round trip time observed in msec
+    int limited;           //  Download was held back by the rate since the last sample
+    int windowStart;       //  Download window start in minutes after midnight. -1 if no window.
+    int windowEnd;         //  Download window end in minutes after midnight
+} Shaper;
+
+#if ME_UPDATER_CACHE
+/*
+    Image cache entry for eviction
+ */
+typedef struct CacheEntry {
+    char checksum[EVP_MAX_MD_SIZE * 2 + 1]; //  Image checksum
+    long long size;        //  Image size
+    time_t used;           //  Time of last use
+} CacheEntry;
+#endif
+
+/*
+    LAN peers found to have an image
+ */
+typedef struct Peers {
+    char hosts[PEER_MAX][INET_ADDRSTRLEN + 8];  //  Peer "address:port"
+    int count;             //  Number of peers
+} Peers;
+
+#if ME_UPDATER_PEER
+/*
+    Image service for LAN peers. A single thread answers discovery queries and accepts image
+    connections, which are served by their own threads.
+ */
+typedef struct PeerServer {
+    pthread_t thread;      //  Discovery and accept thread
+    int running;           //  Thread is running
+    atomic_int stop;       //  Request the thread to exit
+    int udp;               //  Discovery socket
+    int listen;            //  Image service listening socket
+    int port;              //  Port of the discovery socket and image service
+    char cache[UBSIZE];    //  Image cache directory served
+    SSL_CTX *ctx;          //  TLS context with a self-signed certificate while serving
+    atomic_int clients;    //  Image connections being served
+    Updater *owner;        //  Context that started the service
+} PeerServer;
+
+/*
+    Peer image connection
+ */
+typedef struct PeerClient {
+    PeerServer *server;    //  Owning image service
+    int fd;                //  Connection socket
+    char cache[UBSIZE];    //  Image cache directory served
+} PeerClient;
+#endif
+
+#if ME_UPDATER_QUEUE
+/*
+    Queued update report. The queue file holds a line per report of the form:
+    "AFTER ATTEMPTS STATE DEVICE UPDATE VERSION FIELDS". Later lines replace earlier lines for the
+    same device and update.
+ */
+typedef struct Report {
+    long long after;       //  Time in seconds before which the report is not posted again
+    int attempts;          //  Failed posts of the report. -1 once delivered.
+    char state[8];         //  "ok" or "failed", or "apply" while the apply script runs
+    char device[128];      //  Device ID
+    char update[64];       //  Update ID
+    char version[64];      //  Version the update installs
+    char fields[REPORT_FIELDS]; //  Report body members after "success"
+} Report;
+#endif
+
+/*
+    Update manifest of a check response. The fields refer to the parsed response.
+    The optional block manifest lists the SHA-256 of each block of the image so blocks can be
+    verified as they are received.
+ */
+typedef struct Manifest {
+    cchar *checksum;       //  Checksum of the complete image
+    cchar *signature;      //  Signature of the checksum. NULL if not provided.
+    int alg;               //  Image checksum algorithm
+    JsonToken *hashes;     //  Block hash tokens. NULL if there is no block manifest.
+    size_t blockSize;      //  Size of each block except the last. Zero if no block manifest.
+    size_t blockCount;     //  Number of blocks
+} Manifest;
+
+#if ME_UPDATER_BATCH
+/*
+    Distinct update image of a batch update. Devices offered the same image share one download.
+ */
+typedef struct BatchImage {
+    char *url;             //  Image URL
+    Manifest manifest;     //  Image checksum, signature and block manifest
+    int verified;          //  Image downloaded and verified: 1 if verified, -1 on failure
+} BatchImage;
+
+/*
+    Batch update state
+ */
+typedef struct Batch {
+    char **responses;      //  Check response for each device
+    Json *json;            //  Parsed check response for each device
+    int *image;            //  Image index for each device, or -1 if none
+    BatchImage *images;    //  Distinct images
+    int imageCount;        //  Number of distinct images
+} Batch;
+#endif
+
+/*
+    Connection pool. Each slot caches an idle keep-alive connection and the last TLS session for a
+    host so subsequent requests avoid the TCP connect and full TLS handshake.
+ */
+typedef struct Conn {
+    char host[256];        //  Host name
+    const UpdateTransport *transport;  //  Transport of the idle connection and session
+    void *tls;             //  Idle TLS connection, NULL if none
+    int fd;                //  Idle connection socket fd
+    void *session;         //  TLS session to resume on reconnect
+} Conn;
+
+/*
+    OpenSSL transport connection
+ */
+typedef struct Tls {
+    SSL *ssl;              //  TLS connection
+    int pipe[2];           //  Pipe to splice kernel TLS data into the image file. -1 until used.
+} Tls;
+
+/*
+    Download state. A partial image and its resume sidecar persist across interrupted downloads.
+ */
+#if ME_UPDATER_PIPELINE
+/*
+    Buffer in the download pipeline ring
+ */
+typedef struct PipeBuffer {
+    char *buf;             //  Aligned buffer
+    size_t len;            //  Bytes in the buffer
+    size_t offset;         //  Image offset of the buffer
+} PipeBuffer;
+
+/*
+    Download pipeline. The reader queues each full write buffer in a ring, and the hash and write
+    stages consume the ring concurrently on their own threads. The ring is exchanged through atomic
+    counters without locking. A thread only takes the lock to sleep when it cannot proceed.
+ */
+typedef struct Pipeline {
+    PipeBuffer ring[PIPE_MAX]; //  Queued buffers
+    int count;             //  Buffers in the ring
+    atomic_size_t queued;  //  Buffers queued by the reader
+    atomic_size_t hashed;  //  Buffers added to the digest
+    atomic_size_t written; //  Buffers written to the image
+    atomic_uint seq;       //  Incremented on each change of the counters
+    atomic_int waiters;    //  Threads sleeping for a change
+    atomic_int error;      //  A stage failed
+    atomic_int stop;       //  Stages should exit once the ring is empty
+    pthread_mutex_t lock;  //  Sleep lock
+    pthread_cond_t cond;   //  Signalled on a change when there are waiters
+    pthread_t hasher;      //  Hash and verify stage thread
+    pthread_t writer;      //  Write stage thread
+} Pipeline;
+#endif
+
+typedef struct Download {
+    Updater *updater;      //  Context of the download, for its worker threads
+    cchar *path;           //  Image file path
+    Manifest *manifest;    //  Expected checksum, signature and block hashes of the image
+    int authentic;         //  Signature verified: 1 if verified, -1 if not, 0 if not yet checked
+#if ME_UPDATER_PIPELINE
+    Pipeline *pipeline;    //  Hash and write stages. NULL if the data is processed inline.
+#endif
+    Digest digest;         //  Incremental digest of the bytes saved so far
+    Digest block;          //  Digest of the current block with a block manifest
+    Digest mark;           //  Image digest at the start of the current block
+    long long rejected;    //  Offset of a block that failed verification, or -1
+    int refetch;           //  A rejected block was rewound to be fetched again
+    int fd;                //  Image file descriptor
+    int stream;            //  Image is streamed to a pipe rather than saved to a file
+    int direct;            //  Image file is open for direct I/O
+    char *buf;             //  Aligned write buffer
+    size_t bufsize;        //  Size of the write buffer
+    size_t fill;           //  Bytes in the write buffer
+    size_t limit;          //  Fill level at which to flush the write buffer
+    size_t offset;         //  Bytes saved and digested
+    size_t dropped;        //  Bytes released from the page cache
+    size_t saved;          //  Bytes recorded in the resume sidecar
+    size_t received;       //  Bytes of the current response body received
+    int patch;             //  Image is produced from a patch and cannot be resumed
+#if ME_UPDATER_COMPRESS
+    Decoder *decoder;      //  Decoder for a compressed response. NULL if not compressed.
+#endif
+    char etag[80];         //  Entity tag of the image being downloaded
+#if ME_UPDATER_PARALLEL
+    atomic_int abort;      //  Abort parallel range downloads
+    pthread_mutex_t lock;  //  Parallel range progress lock
+    pthread_cond_t cond;   //  Signalled on parallel range progress
+#endif
+} Download;
+
+#if ME_UPDATER_PARALLEL
+/*
+    Byte range of an image downloaded by a parallel worker thread
+ */
+typedef struct Range {
+    Download *dp;          //  Owning download
+    cchar *url;            //  Image URL
+    size_t start;          //  Offset of the first byte of the range
+    size_t end;            //  Offset after the last byte of the range
+    size_t written;        //  Bytes written from the start of the range
+    int done;              //  Worker has finished (successfully or not)
+    pthread_t thread;      //  Worker thread
+} Range;
+#endif
+
+#if ME_UPDATER_DELTA
+/*
+    Delta patch state. The decompressed patch is a sequence of control triples (diff length, extra
+    length, base seek) each followed by the diff and extra bytes. Diff bytes are added to the base
+    image bytes at the base position. Extra bytes are copied.
+ */
+typedef struct Patch {
+    Download *dp;          //  Download receiving the new image
+    bz_stream bz;          //  Patch decompressor
+    int bzInit;            //  Decompressor is initialized
+    int end;               //  End of the compressed patch stream
+    int baseFd;            //  Base image file descriptor
+    long long baseSize;    //  Size of the base image
+    long long basePos;     //  Position in the base image
+    long long newSize;     //  Size of the new image
+    uchar header[PATCH_HEADER]; //  Patch header
+    size_t headerLen;      //  Header bytes received
+    uchar ctrl[24];        //  Control triple
+    size_t ctrlLen;        //  Control bytes received
+    long long diff;        //  Diff bytes remaining in the current control
+    long long extra;       //  Extra bytes remaining in the current control
+    long long seek;        //  Base seek at the end of the current control
+    char *base;            //  Base image data for the current diff block
+    char *out;             //  Decompressed patch data
+} Patch;
+#endif
+
+#if ME_UPDATER_ASYNC
+/*
+    Async update phases and HTTP exchange states
+ */
+#define ASYNC_CHECK        1           //  Checking for an update
+#define ASYNC_DOWNLOAD     2           //  Downloading the update image
+#define ASYNC_APPLY        3           //  Waiting for the apply script
+#define ASYNC_REPORT       4           //  Posting the update status
+#define ASYNC_DONE         5           //  Update complete
+
+#define ASYNC_CONNECT      1           //  Resolving the host and connecting
+#define ASYNC_HANDSHAKE    2           //  TLS handshake
+#define ASYNC_SEND         3           //  Writing the request
+#define ASYNC_HEADERS      4           //  Reading the response headers
+#define ASYNC_BODY         5           //  Reading the response body
+
+#define ASYNC_BUDGET       (256 * 1024) //  Bytes to receive before yielding to the caller
+#define ASYNC_ORPHANS      8           //  Abandoned apply scripts awaiting reaping
+
+/*
+    Non-blocking update. Each phase is a single HTTP exchange over a non-blocking connection,
+    except for the apply phase which waits for the apply script to exit.
+ */
+struct UpdateAsync {
+    Updater *updater;      //  Context of the update
+    int phase;             //  Update phase
+    int state;             //  HTTP exchange state
+    int events;            //  Poll events the exchange is waiting for
+    int rc;                //  Update result
+    ssize_t budget;        //  Bytes to receive before yielding
+    char *apiHost;         //  Device cloud host
+    char *token;           //  CloudAPI token
+    char *device;          //  Device ID
+    char *version;         //  Device firmware version
+    char *path;            //  Image file path
+    char *script;          //  Apply script
+    Fetch *fp;             //  Current connection
+    char host[256];        //  Host of the current exchange
+    char request[UBSIZE];  //  Request being written
+    size_t requestLen;     //  Length of the request
+    size_t sent;           //  Request bytes written
+    char *body;            //  Response body of check and report requests
+    size_t bodyLen;        //  Response body bytes read
+    size_t bodySize;       //  Size of the body buffer
+    pthread_t connector;   //  Host resolve and connect thread
+    int connecting;        //  Connect thread is running
+    int connected;         //  Connected socket, or -1 if the connection failed
+    int wake[2];           //  Pipe signalled when the connect thread completes
+    char *check;           //  Check response body
+    Json json;             //  Parsed check response. Fields refer to the check text.
+    char *url;             //  Image URL
+    char *update;          //  Selected update ID
+    Manifest manifest;     //  Image checksum, signature and block manifest
+    Download dl;           //  Image download
+    int attempt;           //  Image download attempt
+    size_t mark;           //  Download offset at the start of the attempt
+    long long started;     //  Time the handshake, response or apply script being awaited started
+    long long transferStarted; //  Time the image request started
+    char sum[EVP_MAX_MD_SIZE * 2 + 1];  //  Image checksum
+    pid_t pid;             //  Apply script process
+    int waitFd;            //  Descriptor readable when the apply script exits
+    int waitPipe;          //  The descriptor is a pipe rather than a process descriptor
+#if ME_UPDATER_QUEUE
+    int queued;            //  Reports posted from the report queue
+    Report report;         //  Queued report being posted
+#endif
+};
+#endif
+
+/*
+    Updater context. All state of the updates run with a context is held by the context, so updates
+    using separate contexts may run concurrently in different threads. The update API functions use
+    a default context.
+ */
+struct Updater {
+    UpdateOptions options;     //  Update tuning options
+    int verbose;               //  Trace execution
+    char *host;                //  Device cloud host
+    char *product;             //  Product ID
+    char *token;               //  CloudAPI token
+    char *device;              //  Device ID
+    char *version;             //  Device firmware version
+    char *properties;          //  Additional device properties
+    char *path;                //  Path to save the update image
+    char *script;              //  Apply script
+    SSL_CTX *sslCtx;           //  OpenSSL transport context
+    Conn pool[FETCH_POOL];     //  Idle connections and TLS sessions by host
+    int poolNext;              //  Next pool slot to recycle
+    Resolved dnsCache[DNS_CACHE];   //  Resolved host addresses
+    int dnsNext;               //  Next DNS cache slot to recycle
+    pthread_mutex_t fetchLock; //  Guards the pool and DNS cache
+    Shaper shaper;             //  Download rate shaping
+    UpdateMetrics metrics;     //  Metrics of the current update
+    long long metricsStart;    //  Start time of the current update
+    pthread_mutex_t metricsLock;    //  Guards the metrics
+    CheckCache checkCache;     //  Last update check response
+    Arena arena;               //  Memory for updater allocations
+    EVP_MD *digestMd;          //  SHA-256 fetched from the selected OpenSSL provider. NULL for the default.
+    OSSL_PROVIDER *digestProvider;  //  Selected OpenSSL provider
+    int digestSocket;          //  Kernel crypto API SHA-256 transform socket. -1 if not used.
+    EVP_PKEY *signKey;         //  Public key to verify update manifest signatures. NULL if not used.
+#if ME_UPDATER_ASYNC
+    pid_t orphans[ASYNC_ORPHANS];   //  Apply scripts of freed updates that have not been reaped
+#endif
+};
+
+static Updater defaultUpdater = {
+    .fetchLock = PTHREAD_MUTEX_INITIALIZER,
+    .shaper = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, 0, 0, -1, -1 },
+    .metricsLock = PTHREAD_MUTEX_INITIALIZER,
+    .arena = { PTHREAD_MUTEX_INITIALIZER },
+    .digestSocket = -1,
+};
+static __thread Updater *updater = &defaultUpdater;    //  Context of the update run by this thread
+
+//  Names of the update parameters of a context in the order of their fields
+static cchar *updaterFields[] = {
+    "host", "product", "token", "device", "version", "properties", "file", "script", NULL
+};
+
+static pthread_once_t fetchOnce = PTHREAD_ONCE_INIT;    //  One time connection setup for the process
+static volatile sig_atomic_t shapePaused;  //  Downloads paused by the application
+#if ME_UPDATER_PEER
+static PeerServer    peerServer = { .udp = -1, .listen = -1 };  //  Image service for LAN peers
+static pthread_mutex_t peerLock = PTHREAD_MUTEX_INITIALIZER;    //  Guards starting and stopping the service
+#endif
 
 /********************************** Forwards **********************************/
 
+static void *arenaAlloc(size_t size, size_t align);
+static int arenaContains(void *ptr);
+static void arenaFree(void *ptr);
+static void arenaInit(void *buf, size_t size);
+static int applyFinish(pid_t pid, int fd, int statusFd, cchar *sum);
+static int applyStart(cchar *script, pid_t *pid, int *statusFd);
+static int applyDevice(cchar *path, cchar *script, cchar *device);
 static int applyUpdate(cchar *path, cchar *script);
+#if ME_UPDATER_BATCH
+static int batchCheck(cchar *host, cchar *product, cchar *token, UpdateDevice *devices, int count,
+                      char **responses);
+static int batchDownload(Batch *bp, cchar *host, cchar *token, UpdateDevice *devices, int count, cchar *path,
+                         cchar *script);
+static void batchFlush(cchar *host, cchar *token, UpdateDevice *devices, int count);
+static char *batchRead(Fetch *fp);
+#endif
+#if ME_UPDATER_CACHE
+static int cacheCompare(const void *a, const void *b);
+static int cacheFind(cchar *dir, cchar *checksum, char *image, size_t size);
+static int cachePath(cchar *dir, cchar *checksum, cchar *ext, char *buf, size_t bufsize);
+static void cachePrune(cchar *keep);
+static int copyFile(cchar *from, cchar *to);
+#endif
+static int cacheLookup(cchar *checksum, cchar *path);
+static void cacheSave(cchar *path, cchar *checksum);
+static int checkCached(cchar *request);
+static int checkCompact(char *body, size_t size, cchar *device, cchar *product, cchar *version,
+                        cchar *properties, int delta);
+static long long checkExpires(Fetch *fp);
+static char *checkFetch(cchar *url, cchar *token, cchar *body, cchar *compact);
+static int checkFresh(cchar *request);
+static void checkRequest(char *body, size_t size, cchar *device, cchar *product, cchar *version,
+                         cchar *properties, int delta);
+static void checkSave(cchar *request, cchar *response, cchar *etag, long long expires);
+#if ME_UPDATER_ASYNC
+static int asyncApply(UpdateAsync *up);
+static int asyncBody(UpdateAsync *up);
+static int asyncCheck(UpdateAsync *up);
+static int asyncConnect(UpdateAsync *up);
+static void *asyncConnector(void *arg);
+static int asyncDownload(UpdateAsync *up, int rc);
+static int asyncExchange(UpdateAsync *up);
+static int asyncFetchImage(UpdateAsync *up);
+static int asyncImage(UpdateAsync *up);
+static void asyncRelease(UpdateAsync *up);
+static void asyncReap(pid_t pid);
+static int asyncReport(UpdateAsync *up, int status);
+static int asyncRequest(UpdateAsync *up, char *method, char *url, char *headers, char *body);
+static int asyncRetry(UpdateAsync *up, int rc);
+static int asyncStep(UpdateAsync *up);
+static int asyncWait(UpdateAsync *up, int *status);
+static int asyncWant(UpdateAsync *up, int rc);
+#endif
+static int blockRewind(Download *dp);
+static int blockVerify(Manifest *mp, Digest *dg, size_t index);
+static int digestAlgorithm(Json *jp);
+static int digestCopy(Digest *dst, Digest *src);
+static int digestFinal(Digest *dg, char sum[EVP_MAX_MD_SIZE * 2 + 1]);
+static void digestFree(Digest *dg);
+static int digestInit(Digest *dg, int alg);
+static int digestReset(Digest *dg);
+static int digestSelect(cchar *digest);
+static int digestUpdate(Digest *dg, const void *buf, size_t len);
+static int download(cchar *url, cchar *path, Manifest *mp, int streamFd, char sum[EVP_MAX_MD_SIZE * 2 + 1]);
+static int downloadBlocks(Download *dp);
+static int downloadBody(Fetch *fp, Download *dp);
+static int downloadClose(Download *dp, int rc, char sum[EVP_MAX_MD_SIZE * 2 + 1]);
+static void downloadCheckpoint(Fetch *fp, Download *dp);
+static int downloadData(Fetch *fp, Download *dp, size_t bytes);
+static int downloadDigest(Download *dp, cchar *buf, size_t len, size_t offset);
+static int downloadEnd(Fetch *fp, Download *dp);
+static int downloadImage(cchar *url, cchar *path, Manifest *mp, int streamFd, Peers *pp,
+                         char sum[EVP_MAX_MD_SIZE * 2 + 1]);
+static void downloadHeaders(Download *dp, char *headers, size_t size);
+static int downloadAuthentic(Download *dp);
+static int downloadOpen(Download *dp, cchar *path, Manifest *mp, int streamFd);
+static int downloadResponse(Download *dp, Fetch *fp);
+static cchar *downloadUrl(cchar *url, Manifest *mp, Peers *pp, int index, char *buf, size_t size);
+static ssize_t downloadSplice(Fetch *fp, Download *dp, size_t room);
+static int downloadSpliceable(Fetch *fp, Download *dp);
+static char *downloadInput(Fetch *fp, Download *dp, size_t *room);
+#if ME_UPDATER_COMPRESS
+static int decodeData(Download *dp, char *data, size_t len);
+static void decodeFree(Download *dp);
+static int decodeOpen(Download *dp, cchar *encoding);
+#endif
 static Fetch *fetch(char *method, char *url, char *headers, char *body);
-static Fetch *fetchAlloc(int fd);
+static Fetch *fetchRequest(char *method, char *url, char *headers, char *body, int *status);
+static Fetch *fetchAlloc(int fd, cchar *host);
+static void fetchClose(const UpdateTransport *tp, void *tls, int fd);
+static const UpdateTransport *fetchTransport(void);
+static Fetch *fetchConnect(cchar *host);
+static Fetch *fetchCreate(int fd, cchar *host);
+static void fetchSetup(void);
+static void fetchSignals(void);
+static int fetchFormat(char *request, size_t size, cchar *method, cchar *url, cchar *headers, cchar *body,
+                       char *host, size_t hostSize);
+static ssize_t fetchBody(Fetch *fp, char *buf, size_t len);
+static int fetchBodyRoom(Fetch *fp, char **body, size_t *size);
+static ssize_t fetchFrame(Fetch *fp, char *buf, size_t len);
+static int fetchHead(Fetch *fp);
+static int fetchHeaders(Fetch *fp);
+static int fetchParse(Fetch *fp, char *response);
+static ssize_t fetchRecv(Fetch *fp, char *buf, size_t len);
+static void fetchUnread(Fetch *fp, char *buf, size_t len);
+static size_t fetchWant(Fetch *fp, size_t len);
 static void fetchFree(Fetch *fp);
 static char *fetchString(Fetch *fp);
-static int fetchFile(Fetch *fp, cchar *path);
-static char *fetchHeader(Fetch *fp, char *key);
-static size_t fetchRead(Fetch *fp, char *buf, size_t buflen);
+static int fetchFile(Fetch *fp, Download *dp);
+static int downloadWrite(Download *dp, char *buf, size_t len, size_t offset);
+static int flushDownload(Download *dp);
+static char *fetchHeader(Fetch *fp, cchar *key);
+static cchar *fetchHeaderFind(Fetch *fp, cchar *key, size_t *len);
+static ssize_t fetchRead(Fetch *fp, char *buf, size_t buflen);
+static ssize_t fetchReadFile(Fetch *fp, int fd, size_t offset, size_t len);
 static size_t fetchWrite(Fetch *fp, char *buf, size_t buflen);
-static int getFileSum(cchar *path, char sum[EVP_MAX_MD_SIZE]);
-static char *json(cchar *json, cchar *key);
+#if ME_UPDATER_DELTA
+static int downloadPatch(cchar *url, cchar *base, cchar *path, Manifest *mp, char sum[EVP_MAX_MD_SIZE * 2 + 1]);
+static int fetchPatch(Fetch *fp, Patch *pp);
+static int hashFile(cchar *path, int alg, char sum[EVP_MAX_MD_SIZE * 2 + 1]);
+static int patchApply(Patch *pp, uchar *data, size_t len);
+static int patchBase(Patch *pp, size_t len);
+static int patchable(cchar *path, cchar *base, cchar *baseChecksum, int alg);
+static void patchClose(Patch *pp);
+static int patchData(Patch *pp, uchar *data, size_t len);
+static int patchOpen(Patch *pp, cchar *base, Download *dp);
+static long long patchOffset(uchar *buf);
+#endif
+static void poolFree(void);
+static Conn *poolLookup(cchar *host, int create);
+static Fetch *poolTake(cchar *host);
+static int connectHost(cchar *host);
+static void resolveExpire(cchar *host);
+static int resolveHost(cchar *host, Resolved *rp);
+static long long ticks(void);
+static long long uticks(void);
+static void *ualign(size_t size, size_t align);
+static void *ualloc(size_t size);
+#if ME_UPDATER_BATCH || ME_UPDATER_COMPRESS || ME_UPDATER_DELTA || ME_UPDATER_PARALLEL || ME_UPDATER_PIPELINE || \
+    ME_UPDATER_QUEUE
+static void *ucalloc(size_t count, size_t size);
+#endif
+static void ufree(void *ptr);
+static void *urealloc(void *ptr, size_t size);
+static char *ustrdup(cchar *str);
+#if ME_UPDATER_DELTA
+static void *bzAlloc(void *opaque, int items, int size);
+#endif
+#if ME_UPDATER_COMPRESS
+static void *zAlloc(void *opaque, uint items, uint size);
+#endif
+#if ME_UPDATER_COMPRESS || ME_UPDATER_DELTA
+static void zFree(void *opaque, void *ptr);
+#endif
+static void jsonFree(Json *jp);
+static char *jsonGet(Json *jp, int parent, cchar *key);
+static int jsonLookup(Json *jp, int parent, cchar *key);
+static int jsonParse(Json *jp, char *text);
+static char *jsonString(char *start, char **endp);
+static int manifestParse(Json *jp, Manifest *mp);
+static void metricsAdd(long long *field, long long value);
+static void metricsEnd(void);
+static void metricsReset(void);
+static int mirrorCount(void);
+static cchar *mirrorUrl(cchar *url, int index, char *buf, size_t size);
+static void opensslClose(void *tls);
+static void opensslFreeSession(void *session);
+static int opensslHandshake(void *tls);
+static void *opensslOpen(int fd, cchar *host, void *session);
+static ssize_t opensslRead(void *tls, char *buf, size_t len);
+static ssize_t opensslRecvFile(void *tls, int fd, off_t offset, size_t len);
+static int opensslResult(Tls *tp, int rc);
+static int opensslResumed(void *tls);
+static void *opensslSession(void *tls);
+static ssize_t opensslWrite(void *tls, cchar *buf, size_t len);
+#if ME_UPDATER_PEER
+static void peerClose(PeerServer *sp);
+static void *peerClient(void *arg);
+static int peerContext(PeerServer *sp);
+static int peerFind(cchar *checksum, Peers *pp);
+static int peerPort(void);
+static int peerReply(PeerClient *cp, SSL *ssl, char *buf);
+static void *peerServe(void *arg);
+static int peerStart(void);
+static int peerStatus(SSL *ssl, cchar *status);
+static void peerStop(void);
+#endif
 static int postReport(int success, cchar *host, cchar *device, cchar *update, cchar *token);
+#if ME_UPDATER_QUEUE
+static int reportLoad(Report *reports);
+static int reportResolve(Report *rp, cchar **devices, cchar **versions, int count);
+static void reportRetry(Report *rp);
+static int reportSave(Report *reports, int count);
+#endif
+#if ME_UPDATER_QUEUE && ME_UPDATER_ASYNC
+static int asyncFlush(UpdateAsync *up);
+static void reportDone(Report *report, int delivered);
+static int reportNext(Report *report, cchar *device, cchar *version);
+#endif
+static int processUpdate(Json *jp, cchar *host, cchar *token, cchar *device, cchar *path, cchar *script);
+#if ME_UPDATER_PARALLEL
+static int downloadRanges(cchar *url, Download *dp);
+static int rangeBlocks(Range *rp, Digest *dg, cchar *buf, size_t len, size_t offset);
+static void *rangeWorker(void *arg);
+#endif
+static int runUpdate(cchar *host, cchar *product, cchar *token, cchar *device, cchar *version,
+                     cchar *properties, cchar *path, cchar *script, int verboseArg);
+static int readResume(Download *dp);
+static void reportBody(char *body, size_t size, int status, cchar *device, cchar *update);
+static void reportFields(char *buf, size_t size, cchar *device, cchar *update);
+static void reportFlush(cchar *host, cchar *token, cchar **devices, cchar **versions, int count);
+static int reportQueue(cchar *state, cchar *device, cchar *update, cchar *version);
+static int reportUpdate(int status, cchar *host, cchar *device, cchar *update, cchar *version, cchar *token);
+static char *resumePath(cchar *path, char *buf, size_t bufsize);
+static int retryCount(void);
+static long long retryDelay(long long delay, long long max, int attempt);
+static void retryWait(int attempt);
+static int pipeClose(Download *dp);
+static int pipeDrain(Download *dp);
+#if ME_UPDATER_PIPELINE
+static int pipeDigest(Download *dp, PipeBuffer *bp);
+static void *pipeHasher(void *arg);
+static int pipeOpen(Download *dp);
+static void pipeRun(Download *dp, atomic_size_t *done, int (*stage)(Download *dp, PipeBuffer *bp));
+static int pipeSubmit(Download *dp);
+static void pipeWait(Pipeline *pp, uint seq);
+static void pipeWake(Pipeline *pp);
+static int pipeWrite(Download *dp, PipeBuffer *bp);
+static void *pipeWriter(void *arg);
+#endif
+static int saveResume(Download *dp);
+static int signatureLoad(cchar *path);
+static int signatureVerify(cchar *checksum, cchar *signature);
+static void shapeAdapt(Shaper *sp, int fd, long long now);
+static void shapeUsed(size_t bytes);
+static size_t shapeWait(Fetch *fp, size_t room);
+static int shapeWindow(void);
+static int timeoutConnect(void);
+static int timeoutRead(void);
+static void timeoutSocket(int fd, int msecs);
+static char **updaterField(Updater *up, cchar *name);
+
+/*
+    Built-in TLS transport
+ */
+static const UpdateTransport opensslTransport = {
+    .name = "openssl",
+    .open = opensslOpen,
+    .handshake = opensslHandshake,
+    .read = opensslRead,
+    .write = opensslWrite,
+    .close = opensslClose,
+    .resumed = opensslResumed,
+    .session = opensslSession,
+    .freeSession = opensslFreeSession,
+    .recvFile = opensslRecvFile,
+};
 
 /************************************ Code ************************************/
 /*
@@ -69,482 +936,6837 @@ static int postReport(int success, cchar *host, cchar *device, cchar *update, cc
 int update(cchar *host, cchar *product, cchar *token, cchar *device, cchar *version,
            cchar *properties, cchar *path, cchar *script, int verboseArg)
 {
-    Fetch *fp;
-    char  body[UBSIZE], request[UBSIZE], url[UBSIZE], headers[256], fileSum[EVP_MAX_MD_SIZE];
-    char  *checksum, *downloadUrl, *response, *update, *updateVersion;
-    int   status;
+    int rc;
+
+    metricsReset();
+    rc = runUpdate(host, product, token, device, version, properties, path, script, verboseArg);
+    metricsEnd();
+    return rc;
+}
+
+/*
+    Check for an update and apply it
+ */
+static int runUpdate(cchar *host, cchar *product, cchar *token, cchar *device, cchar *version,
+                     cchar *properties, cchar *path, cchar *script, int verboseArg)
+{
+    Json json;
+    char body[UBSIZE], compact[UBSIZE], url[UBSIZE];
+    char *response;
+    int  attempt, delta, rc;
 
     if (!host || !product || !token || !device || !version || !path) {
         fprintf(stderr, "Bad update args");
         return -1;
     }
-    verbose = verboseArg;
+    updater->verbose = verboseArg;
 
     /*
         Issue update request to determine if there is an update.
         Authentication is using the CloudAPI builder token.
      */
     snprintf(url, sizeof(url), "%s/tok/provision/update", host);
-    snprintf(body, sizeof(body), "{\"id\":\"%s\",\"product\":\"%s\",\"version\":\"%s\",%s}",
-             device, product, version, properties);
-    snprintf(headers, sizeof(headers), "Content-Type: application/json\r\nAuthorization: %s\r\n", token);
-
-    printf("\nCheck for update at: %s\n", url);
-    if ((fp = fetch("POST", url, headers, body)) == NULL) {
+    delta = updater->options.base != NULL;
+    checkRequest(body, sizeof(body), device, product, version, properties, delta);
+    if (updater->options.compact &&
+        checkCompact(compact, sizeof(compact), device, product, version, properties, delta) < 0) {
         return -1;
     }
-    if ((response = fetchString(fp)) == NULL || response == NULL) {
-        fetchFree(fp);
+    printf("\nCheck for update at: %s\n", url);
+    if (checkFresh(body)) {
+        //  The server said there is no update and not to check again yet
+        response = ustrdup(updater->checkCache.response);
+        if (updater->verbose) {
+            printf("Update check cached for %d secs\n", (int) ((updater->checkCache.expires - ticks()) / 1000));
+        }
+    } else {
+        for (attempt = 0;
+             (response = checkFetch(url, token, body, updater->options.compact ? compact : NULL)) == NULL &&
+             attempt < retryCount(); attempt++) {
+            retryWait(attempt);
+            metricsAdd(&updater->metrics.retries, 1);
+        }
+    }
+    if (response == NULL) {
         return -1;
     }
-    fetchFree(fp);
 
     /*
-        If an update is available, the "url" will be defined to point to the update image
-        The "update" field contains the selected update ID and is use when posting update status.
+        Index the response once. Field values refer to the response text.
      */
-    if ((downloadUrl = json(response, "url")) != NULL) {
-        checksum = json(response, "checksum");
-        update = json(response, "update");
-        updateVersion = json(response, "version");
-        snprintf(headers, sizeof(headers), "Accept: */*\r\n");
-        free(response);
-
-        printf("Update %s available\n", updateVersion);
-        if ((fp = fetch("GET", downloadUrl, headers, NULL)) == NULL) {
-            return -1;
-        }
-        //  Fetch the update and save to the given path
-        if (fetchFile(fp, path) < 0) {
-            fetchFree(fp);
-            return -1;
-        }
-        fetchFree(fp);
-
-        /*
-            Validate the SHA-256 checksum
-         */
-        printf("Verify update checksum in %s\n", path);
-        getFileSum(path, fileSum);
-        if (strcmp(fileSum, checksum) != 0) {
-            fprintf(stderr, "Checksum does not match\n%s vs\n%s\n", fileSum, checksum);
-            return -1;
-        }
-        if (script) {
-            status = applyUpdate(path, script);
-            if (postReport(status, host, device, update, token) < 0) {
-                return -1;
-            }
-        }
-    } else {
-        free(response);
-        printf("No update available\n");
+    if (jsonParse(&json, response) < 0) {
+        fprintf(stderr, "Bad update response\n");
+        updater->checkCache.expires = 0;
+        ufree(response);
+        return -1;
     }
-    return 0;
+    if (jsonGet(&json, 0, "url")) {
+        //  Only a "no update" response is used without checking
+        updater->checkCache.expires = 0;
+    }
+    //  Post reports queued by prior updates on the check connection
+    reportFlush(host, token, &device, &version, 1);
+    rc = processUpdate(&json, host, token, device, path, script);
+    jsonFree(&json);
+    ufree(response);
+    return rc;
 }
 
 /*
-    Apply the update by invoking the "scripts.update" script
-    This may exit or reboot if instructed by the update script
+    Format the body of an update check request
  */
-static int applyUpdate(cchar *path, cchar *script)
+static void checkRequest(char *body, size_t size, cchar *device, cchar *product, cchar *version,
+                         cchar *properties, int delta)
 {
-    char command[UBSIZE];
-    int  status;
+    cchar *digest;
 
-    snprintf(command, sizeof(command), "%s \"%s\"", script, path);
-    printf("Applying update: %s\n", command);
-    status = system(command);
-    printf("Update %s\n\n", status == 0 ? "Successful" : "Failed");
-    return status;
+    //  BLAKE3 checksums are requested if selected. Otherwise the Builder provides SHA-256.
+    digest = updater->options.digest && strcmp(updater->options.digest, "blake3") == 0 ? ",\"digest\":\"blake3\"" : "";
+    snprintf(body, size, "{\"id\":\"%s\",\"product\":\"%s\",\"version\":\"%s\"%s%s%s%s}",
+             device, product, version, delta ? ",\"delta\":\"bsdiff43\"" : "", digest,
+             properties && *properties ? "," : "", properties ? properties : "");
 }
 
 /*
-    Post update status back to the builder for metrics and version tracking
+    Format the body of a compact update check request. The device properties are replaced by their
+    SHA-256, which the server matches against the properties of the last full check.
  */
-static int postReport(int status, cchar *host, cchar *device, cchar *update, cchar *token)
+static int checkCompact(char *body, size_t size, cchar *device, cchar *product, cchar *version,
+                        cchar *properties, int delta)
 {
-    Fetch *fp;
-    char  body[UBSIZE], url[256], headers[256];
+    Digest dg;
+    char   member[DIGEST_LEN * 2 + 32], sum[EVP_MAX_MD_SIZE * 2 + 1];
 
-    snprintf(body, sizeof(body), "{\"success\":%s,\"id\":\"%s\",\"update\":\"%s\"}",
-             status == 0 ? "true" : "false", device, update);
-    snprintf(url, sizeof(url), "%s/tok/provision/updateReport", host);
-    snprintf(headers, sizeof(headers), "Content-Type: application/json\r\nAuthorization: %s\r\n", token);
-
-    if ((fp = fetch("POST", url, headers, body)) == NULL) {
-        fprintf(stderr, "Cannot post update-report\n");
+    if (!properties || !*properties) {
+        checkRequest(body, size, device, product, version, properties, delta);
+        return 0;
+    }
+    if (digestInit(&dg, DIGEST_SHA256) < 0) {
         return -1;
     }
-    fetchFree(fp);
+    if (digestUpdate(&dg, properties, strlen(properties)) < 0) {
+        digestFree(&dg);
+        return -1;
+    }
+    if (digestFinal(&dg, sum) < 0) {
+        return -1;
+    }
+    snprintf(member, sizeof(member), "\"propertiesHash\":\"%s\"", sum);
+    checkRequest(body, size, device, product, version, member, delta);
     return 0;
 }
 
 /*
-    Mini-fetch API. Start an HTTP action. This is NOT a generic fetch API implementation.
+    Post an update check and return the response body. If the last check had the same request, the
+    check is conditional and, if a "compact" request is given, it is sent instead of the full
+    request. If the server cannot match the compact request (412), the full request is sent.
+    Caller must free.
  */
-static Fetch *fetch(char *method, char *url, char *headers, char *body)
+static char *checkFetch(cchar *url, cchar *token, cchar *body, cchar *compact)
 {
-    struct sockaddr_in server_addr;
-    struct hostent     *server;
-    Fetch              *fp;
-    char               request[UBSIZE], response[UBSIZE], uri[UBSIZE];
-    char               *data, *header, *host, *path, *status;
-    int                fd;
-
-    strncpy(uri, url, sizeof(uri));
-    if ((host = strstr(uri, "https://")) != NULL) {
-        host += 8;
-    } else {
-        host = uri;
-    }
-    if ((path = strchr(host, '/')) != NULL) {
-        *path++ = '\0';
-    } else {
-        path = "";
-    }
-    fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) {
-        perror("Cannot open socket");
-        return NULL;
-    }
-    server = gethostbyname(host);
-    if (server == NULL) {
-        close(fd);
-        fprintf(stderr, "Cannot find host\n");
-        return NULL;
-    }
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
-    server_addr.sin_port = htons(SERVER_PORT);
-
-    if (connect(fd, (struct sockaddr*) &server_addr, sizeof(server_addr)) < 0) {
-        perror("Error connecting to host");
-        close(fd);
-        return NULL;
-    }
-    if ((fp = fetchAlloc(fd)) == NULL) {
-        close(fd);
-        return NULL;
-    }
-    /*
-        Format the request and calculate the body content length
-     */
-    snprintf(request, sizeof(request),
-             "%s /%s HTTP/1.1\r\n" \
-             "Host: %s\r\n" \
-             "Content-Length: %d\r\n" \
-             "%s\r\n" \
-             "%s",
-             method, path, host, body ? (int) strlen(body) : 0, headers, body ? body : "");
-
-    if (verbose) {
-        printf("\nFetch Request:\n%s\n\n", request);
-    }
+    Fetch *fp;
+    char  headers[512], *etag, *response;
+    int   cached;
 
-    /*
-        Write the request and wait for a response
-     */
-    if (fetchWrite(fp, request, strlen(request)) <= 0) {
-        fetchFree(fp);
-        return NULL;
-    }
-    memset(response, 0, UBSIZE);
-    if (fetchRead(fp, response, UBSIZE - 1) < 0) {
-        fetchFree(fp);
-        return NULL;
+    snprintf(headers, sizeof(headers), "Content-Type: application/json\r\nAuthorization: %s\r\n", token);
+    if ((cached = checkCached(body)) != 0) {
+        //  Conditional request to short-circuit if nothing has changed since the last check
+        snprintf(&headers[strlen(headers)], sizeof(headers) - strlen(headers), "If-None-Match: %s\r\n",
+                 updater->checkCache.etag);
     }
-    if (strncmp(response, "HTTP/1.1 ", 9) != 0) {
-        fprintf(stderr, "Bad response\n%s\n", response);
-        fetchFree(fp);
+    if ((fp = fetch("POST", (char*) url, headers, (char*) (cached && compact ? compact : body))) == NULL) {
         return NULL;
     }
-    if ((status = strchr(response, ' ')) == NULL) {
-        fprintf(stderr, "Bad response\n%s\n", response);
+    if ((response = fetchString(fp)) == NULL) {
         fetchFree(fp);
         return NULL;
     }
-    fp->response = strdup(response);
-    if (verbose) {
-        printf("Fetch response:\n%s\n\n", response);
-    }
-    fp->status = atoi(++status);
-    if (fp->status != 200) {
-        fprintf(stderr, "Bad response status %d\n%s\n", fp->status, response);
+    if (fp->status == 412) {
+        ufree(response);
         fetchFree(fp);
-        return NULL;
+        if (!cached || !compact) {
+            fprintf(stderr, "Bad response status 412\n");
+            return NULL;
+        }
+        //  The server no longer has the properties of the last full check
+        checkSave(NULL, NULL, NULL, 0);
+        return checkFetch(url, token, body, NULL);
     }
-    if ((data = strstr(response, "\r\n\r\n")) == NULL) {
-        fprintf(stderr, "Bad response\n%s\n", response);
+    if (fp->status != 200 && !(fp->status == 304 && cached)) {
+        fprintf(stderr, "Bad response status %d\n", fp->status);
+        ufree(response);
         fetchFree(fp);
         return NULL;
     }
-    *data = '\0';
-    data += 4;
-    if ((header = fetchHeader(fp, "Content-Length")) != NULL) {
-        fp->contentLength = atoi(header);
-        free(header);
-        if (fp->contentLength) {
-            fp->firstBody = strdup(data);
+    if (fp->status == 304) {
+        ufree(response);
+        response = ustrdup(updater->checkCache.response);
+        updater->checkCache.expires = checkExpires(fp);
+        if (updater->verbose) {
+            printf("Update check not modified\n");
         }
+    } else {
+        etag = fetchHeader(fp, "ETag");
+        checkSave(body, response, etag, checkExpires(fp));
+        ufree(etag);
     }
-    return fp;
+    fetchFree(fp);
+    return response;
 }
 
 /*
-    Return a small response body as a string. Caller must free.
+    Return the time a successful check response expires from its Cache-Control max-age.
+    Returns zero if none.
  */
-static char *fetchString(Fetch *fp)
+static long long checkExpires(Fetch *fp)
 {
-    char   *bp, *body;
-    size_t bytes, len;
+    char      *cache, *cp;
+    long long expires;
 
-    if (fp->contentLength == 0) {
-        return strdup("");
-    }
-    if ((body = malloc(fp->contentLength + 1)) == NULL) {
-        fprintf(stderr, "Cannot allocate %d bytes", (int) fp->contentLength);
-        return NULL;
-    }
-    bp = body;
-    if (fp->firstBody) {
-        //  Use the body fragment already read
-        len = strlen(fp->firstBody);
-        memcpy(body, fp->firstBody, len);
-        bp += len;
-    }
-    while (len < fp->contentLength) {
-        printf("READ %d\n", (int) (fp->contentLength - (bp - body)));
-        if ((bytes = fetchRead(fp, bp, fp->contentLength - (bp - body))) > 0) {
-            len += bytes;
-            bp += bytes;
+    expires = 0;
+    if ((fp->status == 200 || fp->status == 304) && (cache = fetchHeader(fp, "Cache-Control")) != NULL) {
+        if ((cp = strstr(cache, "max-age=")) != NULL && atoi(&cp[8]) > 0) {
+            expires = ticks() + (long long) atoi(&cp[8]) * 1000;
         }
+        ufree(cache);
     }
-    return body;
+    return expires;
 }
 
 /*
-    Return a response body to a file.
+    Test if there is a cached response for a check request
  */
-static int fetchFile(Fetch *fp, cchar *path)
+static int checkCached(cchar *request)
 {
-    char   buf[UBSIZE], sum[EVP_MAX_MD_SIZE * 2 + 1], *body;
-    int    bytes, fd, seenHeaders;
-    size_t len;
+    CheckCache *cp;
 
-    printf("Downloading update to %s\n", path);
-    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
-        fprintf(stderr, "Cannot open image temp file");
-        return -1;
-    }
-    if (fp->firstBody) {
-        len = strlen(fp->firstBody);
-        if (write(fd, fp->firstBody, len) < 0) {
-            fprintf(stderr, "Cannot write to file");
-            close(fd);
-            return -1;
-        }
-    }
-    while ((bytes = fetchRead(fp, buf, sizeof(buf))) > 0) {
-        if (write(fd, buf, bytes) != bytes) {
-            fprintf(stderr, "Cannot save response");
-            close(fd);
-            return -1;
-        }
-    }
-    close(fd);
-    return 0;
+    cp = &updater->checkCache;
+    return cp->request && cp->etag[0] && strcmp(cp->request, request) == 0;
 }
 
 /*
-    Return a response HTTP header. Caller must free.
+    Test if there is a cached response for a check request that can be used without checking
  */
-static char *fetchHeader(Fetch *fp, char *key)
+static int checkFresh(cchar *request)
 {
-    char   *end, *start, kbuf[80], *value;
-    size_t len;
+    CheckCache *cp;
 
-    snprintf(kbuf, sizeof(kbuf), "%s:", key);
-    value = 0;
-    if ((start = strstr(fp->response, kbuf)) != NULL) {
-        if ((end = strstr(start, "\r\n")) != NULL) {
-            start += strlen(kbuf);
-            while (start < end && isspace(*start)) start++;
-            len = end - start;
-            value = malloc(len + 1);
-            strncpy(value, start, len);
-            value[len] = '\0';
-        }
-    }
-    return value;
+    cp = &updater->checkCache;
+    return cp->request && cp->expires > ticks() && strcmp(cp->request, request) == 0;
 }
 
 /*
-    Read response data
+    Save a check response for conditional requests or, with an expiry time, for use without
+    checking. Responses without an entity tag or expiry are not cached.
  */
-static size_t fetchRead(Fetch *fp, char *buf, size_t buflen)
+static void checkSave(cchar *request, cchar *response, cchar *etag, long long expires)
 {
-    size_t bytes;
-
-    if ((bytes = SSL_read(fp->ssl, buf, buflen)) < 0) {
-        ERR_print_errors_fp(stderr);
-        return -1;
+    ufree(updater->checkCache.request);
+    ufree(updater->checkCache.response);
+    memset(&updater->checkCache, 0, sizeof(updater->checkCache));
+    if ((etag && strlen(etag) < sizeof(updater->checkCache.etag)) || expires) {
+        updater->checkCache.request = ustrdup(request);
+        updater->checkCache.response = ustrdup(response);
+        if (updater->checkCache.request && updater->checkCache.response) {
+            if (etag && strlen(etag) < sizeof(updater->checkCache.etag)) {
+                snprintf(updater->checkCache.etag, sizeof(updater->checkCache.etag), "%s", etag);
+            }
+            updater->checkCache.expires = expires;
+        }
     }
-    return bytes;
 }
 
 /*
-    Write request data
+    Process the update response. If an update is available, download, verify and apply.
  */
-static size_t fetchWrite(Fetch *fp, char *buf, size_t buflen)
+static int processUpdate(Json *jp, cchar *host, cchar *token, cchar *device, cchar *path, cchar *script)
 {
-    size_t bytes;
+    Manifest manifest, *mp;
+    char     fileSum[EVP_MAX_MD_SIZE * 2 + 1];
+    char     *downloadUrl, *update, *updateVersion;
+#if ME_UPDATER_DELTA
+    char     *baseChecksum, *patchUrl;
+#endif
+    pid_t    pid;
+    int      fd, rc, status, statusFd, verified;
 
-    if ((bytes = SSL_write(fp->ssl, buf, buflen)) <= 0) {
-        ERR_print_errors_fp(stderr);
+    /*
+        If an update is available, the "url" will be defined to point to the update image
+        The "update" field contains the selected update ID and is use when posting update status.
+     */
+    if ((downloadUrl = jsonGet(jp, 0, "url")) == NULL) {
+        printf("No update available\n");
+        return 0;
+    }
+    mp = &manifest;
+    if (manifestParse(jp, mp) < 0) {
         return -1;
     }
-    return bytes;
-}
+    update = jsonGet(jp, 0, "update");
+    updateVersion = jsonGet(jp, 0, "version");
+
+    printf("Update %s available\n", updateVersion);
+    if (script && updater->options.stream) {
+        /*
+            Stream the image to the apply script as it is received. Once the download completes,
+            the script is told whether the checksum matched so it can commit or roll back.
+         */
+        reportQueue("apply", device, update, updateVersion);
+        if ((fd = applyStart(script, &pid, &statusFd)) < 0) {
+            return -1;
+        }
+        rc = download(downloadUrl, path, mp, fd, fileSum);
+        verified = rc == 0 && strcmp(fileSum, mp->checksum) == 0;
+        if (rc == 0 && !verified) {
+            fprintf(stderr, "Checksum does not match\n%s vs\n%s\n", fileSum, mp->checksum);
+        }
+        status = applyFinish(pid, fd, statusFd, verified ? fileSum : NULL);
+        if (reportUpdate(status, host, device, update, updateVersion, token) < 0 || !verified) {
+            return -1;
+        }
+        return 0;
+    }
+    /*
+        If a patch from the current image is offered, download and apply it to produce the image.
+        Otherwise, or if the patch cannot be applied, fetch the full update and save to the given
+        path. The checksum is computed as the image is received, so it is ready to validate
+        as soon as the download completes. An interrupted download is resumed from the partial image.
+        An image already in the cache is not fetched at all.
+     */
+    if (cacheLookup(mp->checksum, path) == 0) {
+        if (signatureVerify(mp->checksum, mp->signature) < 0) {
+            return -1;
+        }
+        snprintf(fileSum, sizeof(fileSum), "%s", mp->checksum);
+    } else {
+        rc = -1;
+#if ME_UPDATER_DELTA
+        patchUrl = jsonGet(jp, 0, "patch");
+        baseChecksum = jsonGet(jp, 0, "baseChecksum");
+        if (updater->options.base && patchUrl && baseChecksum &&
+            patchable(path, updater->options.base, baseChecksum, mp->alg)) {
+            if ((rc = downloadPatch(patchUrl, updater->options.base, path, mp, fileSum)) < 0) {
+                printf("Cannot apply update patch, downloading the full image\n");
+            }
+        }
+#endif
+        if (rc < 0 && download(downloadUrl, path, mp, -1, fileSum) < 0) {
+            return -1;
+        }
+        printf("Verify update checksum in %s\n", path);
+        if (strcmp(fileSum, mp->checksum) != 0) {
+            fprintf(stderr, "Checksum does not match\n%s vs\n%s\n", fileSum, mp->checksum);
+            unlink(path);
+            return -1;
+        }
+        cacheSave(path, mp->checksum);
+    }
+    if (script) {
+        reportQueue("apply", device, update, updateVersion);
+        status = applyUpdate(path, script);
+        if (reportUpdate(status, host, device, update, updateVersion, token) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Set options for subsequent updates
+ */
+int updateSetOptions(const UpdateOptions *opts)
+{
+    const UpdateTransport *tp;
+    int                   endHour, endMin, rc, rearena, startHour, startMin;
+
+    if (opts && ((opts->base && !ME_UPDATER_DELTA) || (opts->cache && !ME_UPDATER_CACHE) ||
+                 (opts->parallel > 1 && !ME_UPDATER_PARALLEL) || (opts->pipeline > 0 && !ME_UPDATER_PIPELINE) ||
+                 (opts->peers && !ME_UPDATER_PEER) || (opts->reports && !ME_UPDATER_QUEUE))) {
+        fprintf(stderr, "Update options use a feature omitted from this build\n");
+        return -1;
+    }
+    if (opts && (tp = opts->transport) != NULL && (!tp->name || !tp->open || !tp->handshake || !tp->read ||
+                                                   !tp->write || !tp->close || (tp->session && !tp->freeSession))) {
+        fprintf(stderr, "Bad TLS transport\n");
+        return -1;
+    }
+    if (opts && opts->peers && !opts->cache) {
+        fprintf(stderr, "Peer distribution requires an image cache\n");
+        return -1;
+    }
+    if (opts && opts->arena && opts->arenaSize < ARENA_MIN) {
+        fprintf(stderr, "Update arena must be at least %d bytes\n", ARENA_MIN);
+        return -1;
+    }
+    if (opts && opts->window) {
+        if (sscanf(opts->window, "%d:%d-%d:%d", &startHour, &startMin, &endHour, &endMin) != 4 ||
+            startHour < 0 || startHour > 23 || endHour < 0 || endHour > 23 ||
+            startMin < 0 || startMin > 59 || endMin < 0 || endMin > 59) {
+            fprintf(stderr, "Bad download window \"%s\", expected HH:MM-HH:MM\n", opts->window);
+            return -1;
+        }
+    }
+    if (digestSelect(opts ? opts->digest : NULL) < 0 || signatureLoad(opts ? opts->key : NULL) < 0) {
+        return -1;
+    }
+    rearena = (opts ? opts->arena : NULL) != updater->options.arena ||
+              (opts ? opts->arenaSize : 0) != updater->options.arenaSize;
+#if ME_UPDATER_PEER
+    //  Peer connection threads allocate from the owner's arena
+    pthread_mutex_lock(&peerLock);
+    if (peerServer.owner == updater && (rearena || !opts || !opts->peers)) {
+        peerStop();
+    }
+    pthread_mutex_unlock(&peerLock);
+#endif
+    if (rearena) {
+        //  The cached check response may be in the prior arena
+        checkSave(NULL, NULL, NULL, 0);
+        arenaInit(opts ? opts->arena : NULL, opts ? opts->arenaSize : 0);
+    }
+    if (opts) {
+        updater->options = *opts;
+    } else {
+        memset(&updater->options, 0, sizeof(updater->options));
+    }
+    pthread_mutex_lock(&updater->shaper.lock);
+    //  Restart the rate from the new options
+    updater->shaper.rate = 0;
+    updater->shaper.windowStart = updater->shaper.windowEnd = -1;
+    if (updater->options.window) {
+        updater->shaper.windowStart = startHour * 60 + startMin;
+        updater->shaper.windowEnd = endHour * 60 + endMin;
+    }
+    pthread_mutex_unlock(&updater->shaper.lock);
+    rc = 0;
+#if ME_UPDATER_PEER
+    pthread_mutex_lock(&peerLock);
+    if (updater->options.peers) {
+        rc = peerStart();
+    }
+    pthread_mutex_unlock(&peerLock);
+#endif
+    return rc;
+}
+
+void updatePause(int pause)
+{
+    shapePaused = pause;
+}
+
+void updateGetMetrics(UpdateMetrics *mp)
+{
+    pthread_mutex_lock(&updater->metricsLock);
+    *mp = updater->metrics;
+    if (updater->metricsStart) {
+        mp->total = uticks() - updater->metricsStart;
+    }
+    pthread_mutex_unlock(&updater->metricsLock);
+    mp->throughput = mp->transfer > 0 ? mp->bytes * 1000000 / mp->transfer : 0;
+
+    pthread_mutex_lock(&updater->arena.lock);
+    mp->memory = (long long) updater->arena.peak;
+    pthread_mutex_unlock(&updater->arena.lock);
+}
+
+Updater *updaterAlloc(void)
+{
+    Updater *up;
+
+    if ((up = calloc(1, sizeof(Updater))) == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&up->fetchLock, NULL);
+    pthread_mutex_init(&up->metricsLock, NULL);
+    pthread_mutex_init(&up->shaper.lock, NULL);
+    pthread_mutex_init(&up->arena.lock, NULL);
+    up->shaper.windowStart = up->shaper.windowEnd = -1;
+    up->digestSocket = -1;
+    return up;
+}
+
+int updaterSetOption(Updater *up, cchar *name, cchar *value)
+{
+    char **field, *copy;
+
+    if (!up || !name) {
+        return -1;
+    }
+    if (strcmp(name, "verbose") == 0) {
+        up->verbose = value && strcmp(value, "0") != 0;
+        return 0;
+    }
+    if ((field = updaterField(up, name)) == NULL) {
+        fprintf(stderr, "Unknown updater option \"%s\"\n", name);
+        return -1;
+    }
+    //  Parameters are held on the heap as the arena may change with the options
+    copy = NULL;
+    if (value && (copy = strdup(value)) == NULL) {
+        return -1;
+    }
+    free(*field);
+    *field = copy;
+    return 0;
+}
+
+int updaterSetOptions(Updater *up, const UpdateOptions *opts)
+{
+    Updater *prior;
+    int     rc;
+
+    if (!up) {
+        return -1;
+    }
+    prior = updater;
+    updater = up;
+    rc = updateSetOptions(opts);
+    updater = prior;
+    return rc;
+}
+
+int updaterRun(Updater *up)
+{
+    Updater *prior;
+    int     rc;
+
+    if (!up) {
+        return -1;
+    }
+    prior = updater;
+    updater = up;
+    rc = update(up->host, up->product, up->token, up->device, up->version, up->properties, up->path, up->script,
+                up->verbose);
+    updater = prior;
+    return rc;
+}
+
+#if ME_UPDATER_ASYNC
+UpdateAsync *updaterStart(Updater *up)
+{
+    UpdateAsync *async;
+    Updater     *prior;
+
+    if (!up) {
+        return NULL;
+    }
+    prior = updater;
+    updater = up;
+    async = updateStart(up->host, up->product, up->token, up->device, up->version, up->properties, up->path,
+                        up->script, up->verbose);
+    updater = prior;
+    return async;
+}
+#endif
+
+#if ME_UPDATER_BATCH
+int updaterBatch(Updater *up, UpdateDevice *devices, int count)
+{
+    Updater *prior;
+    int     rc;
+
+    if (!up) {
+        return -1;
+    }
+    prior = updater;
+    updater = up;
+    rc = updateBatch(up->host, up->product, up->token, devices, count, up->path, up->script, up->verbose);
+    updater = prior;
+    return rc;
+}
+#endif
+
+void updaterGetMetrics(Updater *up, UpdateMetrics *mp)
+{
+    Updater *prior;
+
+    prior = updater;
+    updater = up;
+    updateGetMetrics(mp);
+    updater = prior;
+}
+
+void updaterFree(Updater *up)
+{
+    Updater *prior;
+    int     i;
+
+    if (!up) {
+        return;
+    }
+    prior = updater;
+    updater = up;
+    checkSave(NULL, NULL, NULL, 0);
+    poolFree();
+#if ME_UPDATER_ASYNC
+    asyncReap(0);
+#endif
+    //  Release the digest, signing key and peer service of the options
+    updateSetOptions(NULL);
+    if (up->sslCtx) {
+        SSL_CTX_free(up->sslCtx);
+    }
+    updater = prior;
+
+    for (i = 0; updaterFields[i]; i++) {
+        free(*updaterField(up, updaterFields[i]));
+    }
+    pthread_mutex_destroy(&up->fetchLock);
+    pthread_mutex_destroy(&up->metricsLock);
+    pthread_mutex_destroy(&up->shaper.lock);
+    pthread_mutex_destroy(&up->arena.lock);
+    free(up);
+}
+
+/*
+    Return the field of an update parameter of a context. Returns NULL if the name is unknown.
+ */
+static char **updaterField(Updater *up, cchar *name)
+{
+    char **fields[] = {
+        &up->host, &up->product, &up->token, &up->device, &up->version, &up->properties, &up->path, &up->script
+    };
+    int  i;
+
+    for (i = 0; updaterFields[i]; i++) {
+        if (strcmp(name, updaterFields[i]) == 0) {
+            return fields[i];
+        }
+    }
+    return NULL;
+}
+
+#if ME_UPDATER_BATCH
+/*
+    Update a batch of devices. The check requests are pipelined over a shared connection. Each
+    distinct image offered is downloaded and verified once and then applied to each device.
+ */
+int updateBatch(cchar *host, cchar *product, cchar *token, UpdateDevice *devices, int count,
+                cchar *path, cchar *script, int verboseArg)
+{
+    Batch    batch, *bp;
+    Manifest manifest;
+    char     *url;
+    int      failed, i, j;
+
+    if (!host || !product || !token || !devices || count <= 0 || !path) {
+        fprintf(stderr, "Bad update args");
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (!devices[i].device || !devices[i].version) {
+            fprintf(stderr, "Bad update args");
+            return -1;
+        }
+        devices[i].status = -1;
+    }
+    updater->verbose = verboseArg;
+    metricsReset();
+
+    bp = &batch;
+    memset(bp, 0, sizeof(Batch));
+    bp->responses = ucalloc(count, sizeof(char*));
+    bp->json = ucalloc(count, sizeof(Json));
+    bp->image = ucalloc(count, sizeof(int));
+    bp->images = ucalloc(count, sizeof(BatchImage));
+    if (!bp->responses || !bp->json || !bp->image || !bp->images) {
+        fprintf(stderr, "Cannot allocate batch\n");
+        ufree(bp->responses);
+        ufree(bp->json);
+        ufree(bp->image);
+        ufree(bp->images);
+        return -1;
+    }
+    printf("\nCheck for updates for %d devices at: %s/tok/provision/update\n", count, host);
+    batchCheck(host, product, token, devices, count, bp->responses);
+
+    /*
+        Group the devices by the image offered. Images are identified by checksum.
+     */
+    for (i = 0; i < count; i++) {
+        bp->image[i] = -1;
+        if (!bp->responses[i] || jsonParse(&bp->json[i], bp->responses[i]) < 0) {
+            fprintf(stderr, "Bad update response for %s\n", devices[i].device);
+            continue;
+        }
+        if ((url = jsonGet(&bp->json[i], 0, "url")) == NULL) {
+            devices[i].status = 0;
+            continue;
+        }
+        if (manifestParse(&bp->json[i], &manifest) < 0) {
+            fprintf(stderr, "Bad update manifest for %s\n", devices[i].device);
+            continue;
+        }
+        for (j = 0; j < bp->imageCount; j++) {
+            if (strcmp(bp->images[j].manifest.checksum, manifest.checksum) == 0) {
+                break;
+            }
+        }
+        if (j == bp->imageCount) {
+            bp->images[j].url = url;
+            bp->images[j].manifest = manifest;
+            bp->imageCount++;
+        }
+        bp->image[i] = j;
+    }
+    batchFlush(host, token, devices, count);
+    batchDownload(bp, host, token, devices, count, path, script);
+
+    for (failed = i = 0; i < count; i++) {
+        if (devices[i].status < 0) {
+            failed++;
+        }
+        jsonFree(&bp->json[i]);
+        ufree(bp->responses[i]);
+    }
+    ufree(bp->responses);
+    ufree(bp->json);
+    ufree(bp->image);
+    ufree(bp->images);
+    printf("Batch update: %d of %d devices failed\n", failed, count);
+    metricsEnd();
+    return failed ? -1 : 0;
+}
+
+/*
+    Post the reports queued by prior updates of the batch devices
+ */
+static void batchFlush(cchar *host, cchar *token, UpdateDevice *devices, int count)
+{
+    cchar **ids, **versions;
+    int   i;
+
+    ids = ucalloc(count, sizeof(cchar*));
+    versions = ucalloc(count, sizeof(cchar*));
+    if (ids && versions) {
+        for (i = 0; i < count; i++) {
+            ids[i] = devices[i].device;
+            versions[i] = devices[i].version;
+        }
+        reportFlush(host, token, ids, versions, count);
+    }
+    ufree(ids);
+    ufree(versions);
+}
+
+/*
+    Pipeline the check requests for a batch of devices. Requests are written in windows of
+    BATCH_PIPELINE and the responses read in order. If the connection fails, the requests without
+    responses are reissued on a new connection. The response for each device is returned in
+    "responses" (NULL on failure).
+ */
+static int batchCheck(cchar *host, cchar *product, cchar *token, UpdateDevice *devices, int count,
+                      char **responses)
+{
+    Fetch *fp;
+    char  request[UBSIZE], body[UBSIZE], url[UBSIZE], headers[256], hostname[256];
+    int   done, next, reused, sent;
+
+    snprintf(url, sizeof(url), "%s/tok/provision/update", host);
+    snprintf(headers, sizeof(headers), "Content-Type: application/json\r\nAuthorization: %s\r\n", token);
+    if (fetchFormat(request, sizeof(request), "POST", url, headers, NULL, hostname, sizeof(hostname)) < 0) {
+        return -1;
+    }
+    for (next = 0; next < count; next = done) {
+        if ((fp = fetchConnect(hostname)) == NULL) {
+            break;
+        }
+        for (sent = next; sent < count && sent - next < BATCH_PIPELINE; sent++) {
+            checkRequest(body, sizeof(body), devices[sent].device, product, devices[sent].version,
+                         devices[sent].properties, 0);
+            if (fetchFormat(request, sizeof(request), "POST", url, headers, body, hostname, sizeof(hostname)) < 0 ||
+                (ssize_t) fetchWrite(fp, request, strlen(request)) <= 0) {
+                break;
+            }
+        }
+        for (done = next; done < sent; done++) {
+            if ((responses[done] = batchRead(fp)) == NULL) {
+                break;
+            }
+        }
+        //  The connection can be reused only if every response was consumed
+        fp->complete = fp->complete && done == sent;
+        reused = fp->reused;
+        fetchFree(fp);
+        if (done == next && !reused) {
+            //  No progress on a new connection
+            break;
+        }
+    }
+    return next == count ? 0 : -1;
+}
+
+/*
+    Read the next pipelined response on a connection. Data received beyond the response is retained
+    for the next response. Returns the response body. Caller must free.
+ */
+static char *batchRead(Fetch *fp)
+{
+    if (fetchHeaders(fp) < 0) {
+        return NULL;
+    }
+    return fetchString(fp);
+}
+
+/*
+    Download each distinct image of a batch once, verify and apply it to each device offered it.
+    Images are saved to "path" or, if there are several, to "path.N".
+ */
+static int batchDownload(Batch *bp, cchar *host, cchar *token, UpdateDevice *devices, int count, cchar *path,
+                         cchar *script)
+{
+    BatchImage *ip;
+    Manifest   *mp;
+    char       fileSum[EVP_MAX_MD_SIZE * 2 + 1], imagePath[UBSIZE], *update, *version;
+    cchar      *deviceScript;
+    int        applied, i, j, queued, status;
+
+    queued = 0;
+    for (j = 0; j < bp->imageCount; j++) {
+        ip = &bp->images[j];
+        mp = &ip->manifest;
+        if (bp->imageCount > 1) {
+            snprintf(imagePath, sizeof(imagePath), "%s.%d", path, j);
+        } else {
+            snprintf(imagePath, sizeof(imagePath), "%s", path);
+        }
+        printf("Update image %d of %d available\n", j + 1, bp->imageCount);
+        ip->verified = -1;
+        if (cacheLookup(mp->checksum, imagePath) == 0) {
+            ip->verified = signatureVerify(mp->checksum, mp->signature) == 0 ? 1 : -1;
+
+        } else if (download(ip->url, imagePath, mp, -1, fileSum) == 0) {
+            printf("Verify update checksum in %s\n", imagePath);
+            if (strcmp(fileSum, mp->checksum) == 0) {
+                ip->verified = 1;
+                cacheSave(imagePath, mp->checksum);
+            } else {
+                fprintf(stderr, "Checksum does not match\n%s vs\n%s\n", fileSum, mp->checksum);
+                unlink(imagePath);
+            }
+        }
+        if (ip->verified < 0) {
+            continue;
+        }
+        for (applied = i = 0; i < count; i++) {
+            if (bp->image[i] != j) {
+                continue;
+            }
+            if ((deviceScript = devices[i].script ? devices[i].script : script) == NULL) {
+                devices[i].status = 0;
+                continue;
+            }
+            update = jsonGet(&bp->json[i], 0, "update");
+            version = jsonGet(&bp->json[i], 0, "version");
+            reportQueue("apply", devices[i].device, update, version);
+            status = applyDevice(imagePath, deviceScript, devices[i].device);
+            applied++;
+            if (reportQueue(status == 0 ? "ok" : "failed", devices[i].device, update, version) == 0) {
+                devices[i].status = status == 0 ? 0 : -1;
+                if (++queued % REPORT_BATCH == 0) {
+                    //  Post the queued reports in windows so a large batch does not fill the queue
+                    reportFlush(host, token, NULL, NULL, 0);
+                }
+            } else if (postReport(status, host, devices[i].device, update, token) == 0) {
+                devices[i].status = status == 0 ? 0 : -1;
+            }
+        }
+        if (applied) {
+            //  The image is shared by the devices, so remove once applied to all
+            unlink(imagePath);
+        }
+    }
+    if (queued % REPORT_BATCH) {
+        reportFlush(host, token, NULL, NULL, 0);
+    }
+    return 0;
+}
+#endif /* ME_UPDATER_BATCH */
+
+#if ME_UPDATER_ASYNC
+/*
+    Start an update without blocking. The update proceeds as the caller invokes updatePoll when
+    the descriptor returned by updateFd is ready.
+ */
+UpdateAsync *updateStart(cchar *host, cchar *product, cchar *token, cchar *device, cchar *version,
+                         cchar *properties, cchar *path, cchar *script, int verboseArg)
+{
+    UpdateAsync *up;
+    char        body[UBSIZE], url[UBSIZE], headers[256];
+
+    if (!host || !product || !token || !device || !version || !path) {
+        fprintf(stderr, "Bad update args");
+        return NULL;
+    }
+    updater->verbose = verboseArg;
+    metricsReset();
+    asyncReap(0);
+
+    if ((up = ualloc(sizeof(UpdateAsync))) == NULL) {
+        return NULL;
+    }
+    memset(up, 0, sizeof(UpdateAsync));
+    up->updater = updater;
+    up->wake[0] = up->wake[1] = up->waitFd = -1;
+    up->apiHost = ustrdup(host);
+    up->token = ustrdup(token);
+    up->device = ustrdup(device);
+    up->version = ustrdup(version);
+    up->path = ustrdup(path);
+    up->script = script ? ustrdup(script) : NULL;
+    if (!up->apiHost || !up->token || !up->device || !up->version || !up->path || (script && !up->script)) {
+        updateFree(up);
+        return NULL;
+    }
+    snprintf(url, sizeof(url), "%s/tok/provision/update", host);
+    checkRequest(body, sizeof(body), device, product, version, properties, 0);
+    snprintf(headers, sizeof(headers), "Content-Type: application/json\r\nAuthorization: %s\r\n", token);
+
+    printf("\nCheck for update at: %s\n", url);
+    up->phase = ASYNC_CHECK;
+    if (asyncRequest(up, "POST", url, headers, body) < 0) {
+        updateFree(up);
+        return NULL;
+    }
+    return up;
+}
+
+/*
+    Advance an update as far as possible without blocking
+ */
+int updatePoll(UpdateAsync *up)
+{
+    Updater *prior;
+
+    if (!up) {
+        return -1;
+    }
+    if (up->phase == ASYNC_DONE) {
+        return up->rc;
+    }
+    prior = updater;
+    updater = up->updater;
+    up->budget = ASYNC_BUDGET;
+    while (up->phase != ASYNC_DONE) {
+        if (asyncStep(up) > 0) {
+            updater = prior;
+            return 1;
+        }
+    }
+    //  The metrics end once, when the update completes
+    metricsEnd();
+    updater = prior;
+    return up->rc;
+}
+
+/*
+    Return the descriptor and poll events the update is waiting for
+ */
+int updateFd(UpdateAsync *up, int *events)
+{
+    int fd, want;
+
+    fd = -1;
+    want = 0;
+    if (up && up->phase != ASYNC_DONE) {
+        if (up->phase == ASYNC_APPLY) {
+            fd = up->waitFd;
+            want = POLLIN;
+        } else if (up->state == ASYNC_CONNECT) {
+            fd = up->wake[0];
+            want = POLLIN;
+        } else if (up->fp) {
+            fd = up->fp->fd;
+            want = up->events;
+        }
+    }
+    if (events) {
+        *events = want;
+    }
+    return fd;
+}
+
+/*
+    Free an update. An update in progress is abandoned.
+ */
+void updateFree(UpdateAsync *up)
+{
+    Updater *prior;
+
+    if (!up) {
+        return;
+    }
+    prior = updater;
+    updater = up->updater;
+    if (up->connecting) {
+        //  The connect thread cannot be cancelled, so wait for it
+        pthread_join(up->connector, NULL);
+        if (up->connected >= 0) {
+            close(up->connected);
+        }
+    }
+    if (up->wake[0] >= 0) {
+        close(up->wake[0]);
+        close(up->wake[1]);
+    }
+    if (up->fp) {
+        fetchFree(up->fp);
+    }
+    if (up->dl.buf) {
+        downloadClose(&up->dl, -1, up->sum);
+    }
+    if (up->waitFd >= 0) {
+        close(up->waitFd);
+    }
+    if (up->pid > 0) {
+        //  Let the apply script finish, but do not wait for it. It is reaped once it exits.
+        asyncReap(up->pid);
+    }
+    jsonFree(&up->json);
+    ufree(up->body);
+    ufree(up->check);
+    ufree(up->apiHost);
+    ufree(up->token);
+    ufree(up->device);
+    ufree(up->version);
+    ufree(up->path);
+    ufree(up->script);
+    ufree(up);
+    updater = prior;
+}
+
+/*
+    Run one step of the update. Returns 1 if the update must wait for I/O, 0 to continue.
+ */
+static int asyncStep(UpdateAsync *up)
+{
+    int code, rc, status;
+
+    if (up->phase == ASYNC_APPLY) {
+        if ((rc = asyncWait(up, &status)) > 0) {
+            return 1;
+        }
+        metricsAdd(&updater->metrics.apply, uticks() - up->started);
+        printf("Update %s\n\n", status == 0 ? "Successful" : "Failed");
+        if (asyncReport(up, status) < 0) {
+            up->phase = ASYNC_DONE;
+            up->rc = -1;
+        }
+        return 0;
+    }
+    if ((rc = asyncExchange(up)) > 0) {
+        return 1;
+    }
+    //  Check and report requests succeed only with 200. Downloads check the status of each response.
+    code = up->fp ? up->fp->status : 0;
+    if (rc == 0 && up->fp->complete) {
+        asyncRelease(up);
+    } else {
+        fetchFree(up->fp);
+        up->fp = NULL;
+    }
+    switch (up->phase) {
+    case ASYNC_CHECK:
+        rc = rc < 0 || code != 200 ? -1 : asyncCheck(up);
+        break;
+    case ASYNC_DOWNLOAD:
+        rc = asyncDownload(up, rc);
+        break;
+    case ASYNC_REPORT:
+#if ME_UPDATER_QUEUE
+        if (up->queued) {
+            reportDone(&up->report, rc == 0 && code == 200);
+            rc = asyncFlush(up);
+            break;
+        }
+#endif
+        if (rc < 0) {
+            fprintf(stderr, "Cannot post update-report\n");
+        }
+        up->phase = ASYNC_DONE;
+        break;
+    }
+    if (rc < 0) {
+        up->phase = ASYNC_DONE;
+    }
+    up->rc = rc < 0 ? -1 : 0;
+    return 0;
+}
+
+/*
+    Process the check response. If an update is available, start the download.
+ */
+static int asyncCheck(UpdateAsync *up)
+{
+    Manifest *mp;
+    char     *updateVersion;
+
+    up->check = up->body;
+    up->body = NULL;
+    if (jsonParse(&up->json, up->check) < 0) {
+        fprintf(stderr, "Bad update response\n");
+        return -1;
+    }
+    if ((up->url = jsonGet(&up->json, 0, "url")) == NULL) {
+        printf("No update available\n");
+        up->phase = ASYNC_DONE;
+#if ME_UPDATER_QUEUE
+        //  Post reports queued by prior updates
+        return asyncFlush(up);
+#else
+        return 0;
+#endif
+    }
+    mp = &up->manifest;
+    if (manifestParse(&up->json, mp) < 0) {
+        return -1;
+    }
+    up->update = jsonGet(&up->json, 0, "update");
+    updateVersion = jsonGet(&up->json, 0, "version");
+    printf("Update %s available\n", updateVersion);
+
+    if (cacheLookup(mp->checksum, up->path) == 0) {
+        if (signatureVerify(mp->checksum, mp->signature) < 0) {
+            return -1;
+        }
+        snprintf(up->sum, sizeof(up->sum), "%s", mp->checksum);
+        return asyncImage(up);
+    }
+    if (downloadOpen(&up->dl, up->path, mp, -1) < 0) {
+        memset(&up->dl, 0, sizeof(Download));
+        return -1;
+    }
+    up->phase = ASYNC_DOWNLOAD;
+    up->attempt = 0;
+    return asyncFetchImage(up);
+}
+
+/*
+    Request the remainder of the image
+ */
+static int asyncFetchImage(UpdateAsync *up)
+{
+    char headers[256];
+
+    downloadHeaders(&up->dl, headers, sizeof(headers));
+    up->mark = up->dl.offset;
+    up->transferStarted = uticks();
+    return asyncRequest(up, "GET", up->url, headers, NULL);
+}
+
+/*
+    Process the end of an image request with result "rc". Interrupted downloads are resumed.
+    Once complete, the image is verified and the apply script started.
+ */
+static int asyncDownload(UpdateAsync *up, int rc)
+{
+    Download *dp;
+
+    dp = &up->dl;
+    metricsAdd(&updater->metrics.transfer, uticks() - up->transferStarted);
+    if (rc < 0) {
+        blockRewind(dp);
+    }
+    if (rc < 0 && (dp->offset > up->mark || dp->refetch) && dp->rejected < 0 && ++up->attempt <= retryCount()) {
+        if (dp->refetch) {
+            printf("Fetching the image again from %d bytes\n", (int) dp->offset);
+        } else {
+            printf("Download interrupted at %d bytes, resuming\n", (int) dp->offset);
+        }
+        metricsAdd(&updater->metrics.retries, 1);
+        dp->refetch = 0;
+        return asyncFetchImage(up);
+    }
+    if (downloadClose(dp, rc, up->sum) < 0) {
+        return -1;
+    }
+    printf("Verify update checksum in %s\n", up->path);
+    if (strcmp(up->sum, up->manifest.checksum) != 0) {
+        fprintf(stderr, "Checksum does not match\n%s vs\n%s\n", up->sum, up->manifest.checksum);
+        unlink(up->path);
+        return -1;
+    }
+    cacheSave(up->path, up->sum);
+    return asyncImage(up);
+}
+
+/*
+    Apply a verified image
+ */
+static int asyncImage(UpdateAsync *up)
+{
+    if (!up->script) {
+        up->phase = ASYNC_DONE;
+        return 0;
+    }
+    reportQueue("apply", up->device, up->update, jsonGet(&up->json, 0, "version"));
+    if (asyncApply(up) < 0) {
+        return asyncReport(up, -1);
+    }
+    up->phase = ASYNC_APPLY;
+    return 0;
+}
+
+/*
+    Start the apply script. Its exit is signalled by a process descriptor where supported (Linux 5.3
+    and later) so processes the script leaves running do not delay it. Otherwise, its exit is
+    signalled by EOF on a pipe held open by the script and any processes it starts.
+ */
+static int asyncApply(UpdateAsync *up)
+{
+    char  command[UBSIZE];
+    pid_t pid;
+    int   fds[2], fd;
+
+    snprintf(command, sizeof(command), "%s \"%s\"", up->script, up->path);
+    printf("Applying update: %s\n", command);
+    if (pipe(fds) < 0) {
+        perror("Cannot create pipe");
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    if ((pid = fork()) < 0) {
+        perror("Cannot start apply script");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        execl("/bin/sh", "sh", "-c", command, (char*) NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    fd = -1;
+#if defined(SYS_pidfd_open)
+    if ((fd = (int) syscall(SYS_pidfd_open, pid, 0)) >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        close(fds[0]);
+    }
+#endif
+    if (fd < 0) {
+        fd = fds[0];
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    up->pid = pid;
+    up->waitFd = fd;
+    up->waitPipe = fd == fds[0];
+    up->started = uticks();
+    return 0;
+}
+
+/*
+    Check if the apply script has exited. Returns 1 if still running.
+ */
+static int asyncWait(UpdateAsync *up, int *status)
+{
+    char    buf[16];
+    ssize_t bytes;
+    pid_t   pid;
+
+    if ((pid = waitpid(up->pid, status, WNOHANG)) == 0) {
+        if (!up->waitPipe) {
+            //  The process descriptor is readable only once the script has exited
+            return 1;
+        }
+        while ((bytes = read(up->waitFd, buf, sizeof(buf))) > 0) {}
+        if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return 1;
+        }
+        //  The pipe is closed, so the script has exited or closed its descriptors
+        while ((pid = waitpid(up->pid, status, 0)) < 0 && errno == EINTR) {}
+    }
+    if (pid < 0) {
+        *status = -1;
+    }
+    close(up->waitFd);
+    up->waitFd = -1;
+    up->pid = 0;
+    return 0;
+}
+
+/*
+    Reap the apply scripts of freed updates that have exited. A script that is still running is
+    retained to be reaped by a later update or when the context is freed.
+ */
+static void asyncReap(pid_t pid)
+{
+    pid_t *orphans;
+    int   i;
+
+    orphans = updater->orphans;
+    for (i = 0; i < ASYNC_ORPHANS; i++) {
+        if (orphans[i] > 0 && waitpid(orphans[i], NULL, WNOHANG) != 0) {
+            orphans[i] = 0;
+        }
+    }
+    if (pid > 0 && waitpid(pid, NULL, WNOHANG) == 0) {
+        for (i = 0; i < ASYNC_ORPHANS && orphans[i] > 0; i++) {}
+        if (i < ASYNC_ORPHANS) {
+            orphans[i] = pid;
+        }
+    }
+}
+
+/*
+    Post the update status
+ */
+static int asyncReport(UpdateAsync *up, int status)
+{
+    char body[UBSIZE], url[256], headers[256];
+
+#if ME_UPDATER_QUEUE
+    if (reportQueue(status == 0 ? "ok" : "failed", up->device, up->update, jsonGet(&up->json, 0, "version")) == 0) {
+        return asyncFlush(up);
+    }
+#endif
+    reportBody(body, sizeof(body), status, up->device, up->update);
+    snprintf(url, sizeof(url), "%s/tok/provision/updateReport", up->apiHost);
+    snprintf(headers, sizeof(headers), "Content-Type: application/json\r\nAuthorization: %s\r\n", up->token);
+
+    up->phase = ASYNC_REPORT;
+    if (asyncRequest(up, "POST", url, headers, body) < 0) {
+        fprintf(stderr, "Cannot post update-report\n");
+        return -1;
+    }
+    return 0;
+}
+
+#if ME_UPDATER_QUEUE
+/*
+    Post the next due report from the report queue. The update is done once no reports are due.
+    Reports that cannot be posted remain queued and do not fail the update.
+ */
+static int asyncFlush(UpdateAsync *up)
+{
+    Report *rp;
+    char   body[UBSIZE], url[256], headers[256];
+
+    rp = &up->report;
+    up->phase = ASYNC_DONE;
+    //  Bound the reports posted in case the queue cannot be updated
+    if (up->queued >= REPORT_MAX || !reportNext(rp, up->device, up->version)) {
+        return 0;
+    }
+    snprintf(body, sizeof(body), "{\"success\":%s,%s", strcmp(rp->state, "ok") == 0 ? "true" : "false",
+             rp->fields);
+    snprintf(url, sizeof(url), "%s/tok/provision/updateReport", up->apiHost);
+    snprintf(headers, sizeof(headers), "Content-Type: application/json\r\nAuthorization: %s\r\n", up->token);
+
+    up->phase = ASYNC_REPORT;
+    up->queued++;
+    if (asyncRequest(up, "POST", url, headers, body) < 0) {
+        reportDone(rp, 0);
+        up->phase = ASYNC_DONE;
+    }
+    return 0;
+}
+#endif
+
+/*
+    Start an HTTP exchange on a pooled connection or a new non-blocking connection
+ */
+static int asyncRequest(UpdateAsync *up, char *method, char *url, char *headers, char *body)
+{
+    if (fetchFormat(up->request, sizeof(up->request), method, url, headers, body, up->host,
+                    sizeof(up->host)) < 0) {
+        return -1;
+    }
+    up->requestLen = strlen(up->request);
+    up->sent = 0;
+    metricsAdd(&updater->metrics.requests, 1);
+    ufree(up->body);
+    up->body = NULL;
+
+    if ((up->fp = poolTake(up->host)) != NULL) {
+        fcntl(up->fp->fd, F_SETFL, fcntl(up->fp->fd, F_GETFL) | O_NONBLOCK);
+        up->state = ASYNC_SEND;
+        up->events = POLLOUT;
+        return 0;
+    }
+    return asyncConnect(up);
+}
+
+/*
+    Resolve the host and connect in a helper thread so the caller is not blocked
+ */
+static int asyncConnect(UpdateAsync *up)
+{
+    if (up->wake[0] < 0) {
+        if (pipe(up->wake) < 0) {
+            perror("Cannot create pipe");
+            return -1;
+        }
+        fcntl(up->wake[0], F_SETFL, fcntl(up->wake[0], F_GETFL) | O_NONBLOCK);
+        fcntl(up->wake[0], F_SETFD, FD_CLOEXEC);
+        fcntl(up->wake[1], F_SETFD, FD_CLOEXEC);
+    }
+    up->state = ASYNC_CONNECT;
+    up->connected = -1;
+    if (pthread_create(&up->connector, NULL, asyncConnector, up) != 0) {
+        fprintf(stderr, "Cannot create connect thread\n");
+        return -1;
+    }
+    up->connecting = 1;
+    return 0;
+}
+
+static void *asyncConnector(void *arg)
+{
+    UpdateAsync *up;
+
+    up = arg;
+    updater = up->updater;
+    up->connected = connectHost(up->host);
+    if (write(up->wake[1], "", 1) < 0) {
+        //  Nothing more can be done
+    }
+    return NULL;
+}
+
+/*
+    Advance the current HTTP exchange. Returns 1 if waiting for I/O, 0 when the response has been
+    received and -1 on errors.
+ */
+static int asyncExchange(UpdateAsync *up)
+{
+    Fetch   *fp;
+    ssize_t bytes;
+    size_t  room;
+    char    c, *buf;
+    int     err;
+
+    while (1) {
+        fp = up->fp;
+        switch (up->state) {
+        case ASYNC_CONNECT:
+            if (read(up->wake[0], &c, 1) != 1) {
+                return 1;
+            }
+            pthread_join(up->connector, NULL);
+            up->connecting = 0;
+            if (up->connected < 0) {
+                return -1;
+            }
+            fcntl(up->connected, F_SETFL, fcntl(up->connected, F_GETFL) | O_NONBLOCK);
+            if ((up->fp = fetchCreate(up->connected, up->host)) == NULL) {
+                close(up->connected);
+                return -1;
+            }
+            up->connected = -1;
+            up->state = ASYNC_HANDSHAKE;
+            up->started = uticks();
+            break;
+
+        case ASYNC_HANDSHAKE:
+            if ((err = fp->transport->handshake(fp->tls)) != 1) {
+                return asyncWant(up, err);
+            }
+            metricsAdd(&updater->metrics.tls, uticks() - up->started);
+            if (updater->verbose && fp->transport->resumed && fp->transport->resumed(fp->tls)) {
+                printf("Resumed TLS session with %s\n", up->host);
+            }
+            up->state = ASYNC_SEND;
+            break;
+
+        case ASYNC_SEND:
+            if ((bytes = fp->transport->write(fp->tls, &up->request[up->sent], up->requestLen - up->sent)) <= 0) {
+                return asyncRetry(up, asyncWant(up, (int) bytes));
+            }
+            up->sent += bytes;
+            if (up->sent == up->requestLen) {
+                up->state = ASYNC_HEADERS;
+                up->started = uticks();
+            }
+            break;
+
+        case ASYNC_HEADERS:
+            if ((err = fetchHead(fp)) > 0) {
+                if ((bytes = fetchRead(fp, &fp->rx[fp->rxEnd], sizeof(fp->rx) - 1 - fp->rxEnd)) <= 0) {
+                    return asyncRetry(up, asyncWant(up, (int) bytes));
+                }
+                fp->rxEnd += bytes;
+                break;
+            }
+            if (err < 0) {
+                return -1;
+            }
+            metricsAdd(&updater->metrics.firstByte, uticks() - up->started);
+            if (asyncBody(up) < 0) {
+                return -1;
+            }
+            up->state = ASYNC_BODY;
+            break;
+
+        case ASYNC_BODY:
+            if (fp->complete) {
+                if (up->phase == ASYNC_DOWNLOAD) {
+                    return downloadEnd(fp, &up->dl);
+                }
+                up->body[up->bodyLen] = '\0';
+                return 0;
+            }
+            if (up->phase == ASYNC_DOWNLOAD) {
+                buf = downloadInput(fp, &up->dl, &room);
+            } else {
+                if (up->bodyLen >= up->bodySize && fetchBodyRoom(fp, &up->body, &up->bodySize) < 0) {
+                    return -1;
+                }
+                buf = &up->body[up->bodyLen];
+                room = up->bodySize - up->bodyLen;
+            }
+            if ((bytes = fetchRecv(fp, buf, fetchWant(fp, room))) <= 0) {
+                if ((err = asyncWant(up, (int) bytes)) > 0) {
+                    return 1;
+                }
+                if (err == 0 && fp->framing == FRAME_CLOSE) {
+                    //  The body ends when the server closes the connection
+                    fp->complete = 1;
+                    break;
+                }
+                if (up->phase == ASYNC_DOWNLOAD) {
+                    return downloadEnd(fp, &up->dl) < 0 ? -1 : 0;
+                }
+                fprintf(stderr, "Cannot read response body\n");
+                return -1;
+            }
+            if ((bytes = fetchFrame(fp, buf, bytes)) < 0) {
+                return -1;
+            }
+            if (up->phase == ASYNC_DOWNLOAD) {
+                if (downloadData(fp, &up->dl, bytes) < 0) {
+                    return -1;
+                }
+            } else {
+                up->bodyLen += bytes;
+            }
+            err = (int) bytes;
+            /*
+                Yield after a burst so a fast download does not starve the caller's event loop.
+                No events are requested so the caller polls again without waiting.
+             */
+            if ((up->budget -= err) <= 0) {
+                up->events = 0;
+                return 1;
+            }
+            break;
+        }
+    }
+}
+
+/*
+    Prepare to receive the response body
+ */
+static int asyncBody(UpdateAsync *up)
+{
+    Fetch *fp;
+
+    fp = up->fp;
+    if (up->phase == ASYNC_DOWNLOAD) {
+        if (downloadResponse(&up->dl, fp) < 0) {
+            return -1;
+        }
+        return downloadBody(fp, &up->dl);
+    }
+    up->body = NULL;
+    up->bodyLen = up->bodySize = 0;
+    return fetchBodyRoom(fp, &up->body, &up->bodySize);
+}
+
+/*
+    Map a transport result to the I/O the connection is waiting for. Returns 1 to wait, 0 if the peer
+    closed the connection and -1 on errors.
+ */
+static int asyncWant(UpdateAsync *up, int rc)
+{
+    switch (rc) {
+    case UPDATE_WANT_READ:
+        up->events = POLLIN;
+        return 1;
+    case UPDATE_WANT_WRITE:
+        up->events = POLLOUT;
+        return 1;
+    case 0:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/*
+    A pooled connection may have been closed by the server while idle. If the request fails before
+    any response is received, retry once on a new connection.
+ */
+static int asyncRetry(UpdateAsync *up, int rc)
+{
+    if (rc > 0) {
+        return rc;
+    }
+    if (!up->fp->reused || up->fp->bytes > 0) {
+        return -1;
+    }
+    fetchFree(up->fp);
+    up->fp = NULL;
+    up->sent = 0;
+    metricsAdd(&updater->metrics.retries, 1);
+    return asyncConnect(up) < 0 ? -1 : 1;
+}
+
+/*
+    Release the connection of a completed exchange to the pool in blocking mode for reuse
+ */
+static void asyncRelease(UpdateAsync *up)
+{
+    fcntl(up->fp->fd, F_SETFL, fcntl(up->fp->fd, F_GETFL) & ~O_NONBLOCK);
+    fetchFree(up->fp);
+    up->fp = NULL;
+}
+#endif /* ME_UPDATER_ASYNC */
+
+/*
+    Apply the update by invoking the "scripts.update" script
+    This may exit or reboot if instructed by the update script
+ */
+static int applyUpdate(cchar *path, cchar *script)
+{
+    return applyDevice(path, script, NULL);
+}
+
+/*
+    Apply the update for a device. A batch update supplies the device ID as a second argument.
+ */
+static int applyDevice(cchar *path, cchar *script, cchar *device)
+{
+    char      command[UBSIZE];
+    long long start;
+    int       status;
+
+    snprintf(command, sizeof(command), "%s \"%s\"%s%s%s", script, path, device ? " \"" : "", device ? device : "",
+             device ? "\"" : "");
+    printf("Applying update: %s\n", command);
+    start = uticks();
+    status = system(command);
+    metricsAdd(&updater->metrics.apply, uticks() - start);
+    printf("Update %s\n\n", status == 0 ? "Successful" : "Failed");
+    return status;
+}
+
+/*
+    Start the apply script to receive a streamed update image on its standard input. The path
+    argument is "-". Once the image is complete, the verdict is written to the descriptor
+    APPLY_STATUS_FD (also given by the UPDATE_STATUS_FD environment variable) as "OK checksum"
+    or "FAIL". Returns the descriptor to write the image to.
+ */
+static int applyStart(cchar *script, pid_t *pidp, int *statusFd)
+{
+    char  command[UBSIZE], fdbuf[16];
+    pid_t pid;
+    int   data[2], status[2];
+
+    snprintf(command, sizeof(command), "%s -", script);
+    printf("Applying streamed update: %s\n", command);
+    if (pipe(data) < 0) {
+        perror("Cannot create pipe");
+        return -1;
+    }
+    if (pipe(status) < 0) {
+        perror("Cannot create pipe");
+        close(data[0]);
+        close(data[1]);
+        return -1;
+    }
+    //  Keep the parent ends private if other children are started
+    fcntl(data[1], F_SETFD, FD_CLOEXEC);
+    fcntl(status[1], F_SETFD, FD_CLOEXEC);
+
+    if ((pid = fork()) < 0) {
+        perror("Cannot start apply script");
+        close(data[0]);
+        close(data[1]);
+        close(status[0]);
+        close(status[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(data[0], 0);
+        if (status[0] != APPLY_STATUS_FD) {
+            dup2(status[0], APPLY_STATUS_FD);
+            close(status[0]);
+        }
+        if (data[0] != APPLY_STATUS_FD) {
+            close(data[0]);
+        }
+        snprintf(fdbuf, sizeof(fdbuf), "%d", APPLY_STATUS_FD);
+        setenv("UPDATE_STATUS_FD", fdbuf, 1);
+        execl("/bin/sh", "sh", "-c", command, (char*) NULL);
+        _exit(127);
+    }
+    close(data[0]);
+    close(status[0]);
+    *pidp = pid;
+    *statusFd = status[1];
+    return data[1];
+}
+
+/*
+    Complete a streamed update. Close the image stream, send the verdict to the apply script and
+    wait for it to exit. Set "sum" to NULL if the image failed verification. Returns the script
+    exit status.
+ */
+static int applyFinish(pid_t pid, int fd, int statusFd, cchar *sum)
+{
+    char      verdict[EVP_MAX_MD_SIZE * 2 + 8];
+    long long start;
+    int       status;
+
+    //  The script runs as the image is streamed. Only the wait for it to finish is measured.
+    start = uticks();
+    close(fd);
+    snprintf(verdict, sizeof(verdict), "%s%s\n", sum ? "OK " : "FAIL", sum ? sum : "");
+    if (write(statusFd, verdict, strlen(verdict)) < 0) {
+        //  The script exited without reading the verdict
+    }
+    close(statusFd);
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            status = -1;
+            break;
+        }
+    }
+    metricsAdd(&updater->metrics.apply, uticks() - start);
+    printf("Update %s\n\n", status == 0 ? "Successful" : "Failed");
+    return status;
+}
+
+/*
+    Post update status back to the builder for metrics and version tracking
+ */
+static int postReport(int status, cchar *host, cchar *device, cchar *update, cchar *token)
+{
+    Fetch *fp;
+    char  body[UBSIZE], url[256], headers[256];
+
+    reportBody(body, sizeof(body), status, device, update);
+    snprintf(url, sizeof(url), "%s/tok/provision/updateReport", host);
+    snprintf(headers, sizeof(headers), "Content-Type: application/json\r\nAuthorization: %s\r\n", token);
+
+    if ((fp = fetch("POST", url, headers, body)) == NULL) {
+        fprintf(stderr, "Cannot post update-report\n");
+        return -1;
+    }
+    //  Consume the response so the connection can be reused
+    ufree(fetchString(fp));
+    fetchFree(fp);
+    return 0;
+}
+
+/*
+    Report the result of applying an update. With a report queue, the result is queued and the queue
+    flushed, so a report that cannot be posted now is retried later and does not fail the update.
+ */
+static int reportUpdate(int status, cchar *host, cchar *device, cchar *update, cchar *version, cchar *token)
+{
+    if (reportQueue(status == 0 ? "ok" : "failed", device, update, version) == 0) {
+        reportFlush(host, token, NULL, NULL, 0);
+        return 0;
+    }
+    return postReport(status, host, device, update, token);
+}
+
+/*
+    Format the update report body
+ */
+static void reportBody(char *body, size_t size, int status, cchar *device, cchar *update)
+{
+    char fields[REPORT_FIELDS];
+
+    reportFields(fields, sizeof(fields), device, update);
+    snprintf(body, size, "{\"success\":%s,%s", status == 0 ? "true" : "false", fields);
+}
+
+/*
+    Format the members of the update report body after "success". If requested, the update metrics
+    are included.
+ */
+static void reportFields(char *buf, size_t size, cchar *device, cchar *update)
+{
+    UpdateMetrics m;
+
+    if (!updater->options.metrics) {
+        snprintf(buf, size, "\"id\":\"%s\",\"update\":\"%s\"}", device, update);
+        return;
+    }
+    updateGetMetrics(&m);
+    snprintf(buf, size, "\"id\":\"%s\",\"update\":\"%s\",\"metrics\":{"
+             "\"dns\":%lld,\"connect\":%lld,\"tls\":%lld,\"firstByte\":%lld,\"transfer\":%lld,"
+             "\"checksum\":%lld,\"apply\":%lld,\"total\":%lld,\"bytes\":%lld,\"throughput\":%lld,"
+             "\"requests\":%lld,\"connections\":%lld,\"retries\":%lld,\"reads\":%lld,\"writes\":%lld,"
+             "\"memory\":%lld}}",
+             device, update,
+             m.dns, m.connect, m.tls, m.firstByte, m.transfer, m.checksum, m.apply, m.total, m.bytes,
+             m.throughput, m.requests, m.connections, m.retries, m.reads, m.writes, m.memory);
+}
+
+#if ME_UPDATER_QUEUE
+/*
+    Append a report to the report queue. The state is "apply" before the apply script runs, so the
+    result is still reported if the script reboots the device, then "ok" or "failed". The queue is
+    synced so the report survives a crash or reboot.
+ */
+static int reportQueue(cchar *state, cchar *device, cchar *update, cchar *version)
+{
+    FILE *file;
+    char fields[REPORT_FIELDS];
+    int  rc;
+
+    //  Fields are space separated and must fit the report
+    if (!updater->options.reports || !update || strpbrk(device, " \t\n") || strpbrk(update, " \t\n") ||
+        strlen(device) >= sizeof(((Report*) 0)->device) || strlen(update) >= sizeof(((Report*) 0)->update)) {
+        return -1;
+    }
+    if (!version || !*version || strpbrk(version, " \t\n") || strlen(version) >= sizeof(((Report*) 0)->version)) {
+        version = "-";
+    }
+    if ((file = fopen(updater->options.reports, "a")) == NULL) {
+        fprintf(stderr, "Cannot open report queue %s\n", updater->options.reports);
+        return -1;
+    }
+    reportFields(fields, sizeof(fields), device, update);
+    rc = fprintf(file, "0 0 %s %s %s %s %s\n", state, device, update, version, fields) < 0 ? -1 : 0;
+    if (fflush(file) != 0 || fsync(fileno(file)) < 0) {
+        rc = -1;
+    }
+    if (fclose(file) != 0 || rc < 0) {
+        fprintf(stderr, "Cannot write report queue %s\n", updater->options.reports);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Read the report queue into "reports". A later line replaces an earlier line for the same device and
+    update. A partial line from an interrupted write is ignored. If the queue holds more than REPORT_MAX
+    reports, the oldest are dropped. Returns the count of reports.
+ */
+static int reportLoad(Report *reports)
+{
+    FILE   *file;
+    Report report;
+    char   line[UBSIZE];
+    size_t len;
+    int    count, i;
+
+    if ((file = fopen(updater->options.reports, "r")) == NULL) {
+        return 0;
+    }
+    count = 0;
+    while (fgets(line, sizeof(line), file)) {
+        memset(&report, 0, sizeof(report));
+        if ((len = strlen(line)) == 0 || line[len - 1] != '\n' ||
+            sscanf(line, "%lld %d %7s %127s %63s %63s %767[^\n]", &report.after, &report.attempts, report.state,
+                   report.device, report.update, report.version, report.fields) != 7) {
+            continue;
+        }
+        for (i = 0; i < count; i++) {
+            if (strcmp(reports[i].device, report.device) == 0 && strcmp(reports[i].update, report.update) == 0) {
+                break;
+            }
+        }
+        if (i == REPORT_MAX) {
+            fprintf(stderr, "Report queue is full, discarding the oldest report\n");
+            memmove(reports, &reports[1], (REPORT_MAX - 1) * sizeof(Report));
+            i = --count;
+        }
+        if (i == count) {
+            count++;
+        }
+        reports[i] = report;
+    }
+    fclose(file);
+    return count;
+}
+
+/*
+    Replace the report queue with the undelivered "reports". The queue is removed once empty.
+ */
+static int reportSave(Report *reports, int count)
+{
+    FILE   *file;
+    Report *rp;
+    char   path[UBSIZE];
+    int    i, rc;
+
+    for (i = 0; i < count && reports[i].attempts < 0; i++) {}
+    if (i == count) {
+        unlink(updater->options.reports);
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s.tmp", updater->options.reports);
+    if ((file = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "Cannot write report queue %s\n", path);
+        return -1;
+    }
+    rc = 0;
+    for (i = 0; i < count; i++) {
+        rp = &reports[i];
+        if (rp->attempts >= 0 && fprintf(file, "%lld %d %s %s %s %s %s\n", rp->after, rp->attempts, rp->state,
+                                         rp->device, rp->update, rp->version, rp->fields) < 0) {
+            rc = -1;
+        }
+    }
+    if (fflush(file) != 0 || fsync(fileno(file)) < 0) {
+        rc = -1;
+    }
+    if (fclose(file) != 0 || rc < 0 || rename(path, updater->options.reports) < 0) {
+        fprintf(stderr, "Cannot write report queue %s\n", updater->options.reports);
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Post the due reports in the report queue. The reports are pipelined over one connection in windows
+    of REPORT_PIPELINE. The results of updates whose apply script did not return are resolved from the
+    "versions" of the given "devices". A report that cannot be posted is retried by a later flush.
+ */
+static void reportFlush(cchar *host, cchar *token, cchar **devices, cchar **versions, int count)
+{
+    Fetch  *fp;
+    Report *reports, *rp;
+    char   request[UBSIZE], body[UBSIZE], url[UBSIZE], headers[256], hostname[256];
+    int    due[REPORT_MAX], delivered, done, i, next, queued, ready, reused, sent;
+
+    if (!updater->options.reports) {
+        return;
+    }
+    if ((reports = ucalloc(REPORT_MAX, sizeof(Report))) == NULL) {
+        fprintf(stderr, "Cannot allocate report queue\n");
+        return;
+    }
+    if ((queued = reportLoad(reports)) == 0) {
+        ufree(reports);
+        return;
+    }
+    for (ready = i = 0; i < queued; i++) {
+        if (reportResolve(&reports[i], devices, versions, count)) {
+            due[ready++] = i;
+        }
+    }
+    snprintf(url, sizeof(url), "%s/tok/provision/updateReport", host);
+    snprintf(headers, sizeof(headers), "Content-Type: application/json\r\nAuthorization: %s\r\n", token);
+    if (fetchFormat(request, sizeof(request), "POST", url, headers, NULL, hostname, sizeof(hostname)) < 0) {
+        ready = 0;
+    }
+    for (delivered = next = 0; next < ready; next = done) {
+        if ((fp = fetchConnect(hostname)) == NULL) {
+            reportRetry(&reports[due[next]]);
+            break;
+        }
+        for (sent = next; sent < ready && sent - next < REPORT_PIPELINE; sent++) {
+            rp = &reports[due[sent]];
+            snprintf(body, sizeof(body), "{\"success\":%s,%s", strcmp(rp->state, "ok") == 0 ? "true" : "false",
+                     rp->fields);
+            if (fetchFormat(request, sizeof(request), "POST", url, headers, body, hostname, sizeof(hostname)) < 0 ||
+                (ssize_t) fetchWrite(fp, request, strlen(request)) <= 0) {
+                break;
+            }
+            metricsAdd(&updater->metrics.requests, 1);
+        }
+        for (done = next; done < sent; done++) {
+            if (fetchHeaders(fp) < 0) {
+                break;
+            }
+            //  Consume the response so the next response can be read
+            ufree(fetchString(fp));
+            if (fp->status == 200) {
+                reports[due[done]].attempts = -1;
+                delivered++;
+            } else {
+                reportRetry(&reports[due[done]]);
+            }
+        }
+        //  The connection can be reused only if every response was consumed
+        fp->complete = fp->complete && done == sent;
+        reused = fp->reused;
+        fetchFree(fp);
+        if (done == next && !reused) {
+            //  No progress on a new connection
+            reportRetry(&reports[due[next]]);
+            break;
+        }
+    }
+    if (updater->verbose && delivered) {
+        printf("Posted %d queued update reports\n", delivered);
+    }
+    reportSave(reports, queued);
+    ufree(reports);
+}
+
+/*
+    Test if a queued report is due to be posted. A report in the "apply" state is from an apply script that
+    did not return. It is resolved as "ok" if one of the "devices" now runs the version the update installs.
+ */
+static int reportResolve(Report *rp, cchar **devices, cchar **versions, int count)
+{
+    int i;
+
+    if (strcmp(rp->state, "apply") == 0) {
+        for (i = 0; i < count; i++) {
+            if (strcmp(devices[i], rp->device) == 0) {
+                snprintf(rp->state, sizeof(rp->state), "%s", strcmp(versions[i], rp->version) == 0 ? "ok" : "failed");
+                break;
+            }
+        }
+        if (i == count) {
+            return 0;
+        }
+    }
+    return rp->after <= (long long) time(0);
+}
+
+/*
+    Schedule a report that could not be posted to be posted again with exponential backoff. After
+    REPORT_ATTEMPTS failures, the report is discarded.
+ */
+static void reportRetry(Report *rp)
+{
+    fprintf(stderr, "Cannot post update-report\n");
+    if (++rp->attempts >= REPORT_ATTEMPTS) {
+        fprintf(stderr, "Discarding update report for %s\n", rp->device);
+        rp->attempts = -1;
+        return;
+    }
+    rp->after = (long long) time(0) + retryDelay(REPORT_DELAY, REPORT_DELAY_MAX, rp->attempts - 1);
+}
+
+#if ME_UPDATER_ASYNC
+/*
+    Find the next due report in the report queue for a non-blocking update. Reports in the "apply" state
+    for "device" are resolved from its "version". Returns 1 if a report is returned in "report".
+ */
+static int reportNext(Report *report, cchar *device, cchar *version)
+{
+    Report *reports;
+    int    count, found, i;
+
+    if (!updater->options.reports || (reports = ucalloc(REPORT_MAX, sizeof(Report))) == NULL) {
+        return 0;
+    }
+    count = reportLoad(reports);
+    for (found = i = 0; i < count && !found; i++) {
+        if (reportResolve(&reports[i], &device, &version, 1)) {
+            *report = reports[i];
+            found = 1;
+        }
+    }
+    ufree(reports);
+    return found;
+}
+
+/*
+    Record the outcome of posting a queued report for a non-blocking update
+ */
+static void reportDone(Report *report, int delivered)
+{
+    Report *reports, *rp;
+    int    count, i;
+
+    if ((reports = ucalloc(REPORT_MAX, sizeof(Report))) == NULL) {
+        return;
+    }
+    count = reportLoad(reports);
+    for (i = 0; i < count; i++) {
+        rp = &reports[i];
+        if (strcmp(rp->device, report->device) == 0 && strcmp(rp->update, report->update) == 0) {
+            //  The report may have been replaced while it was posted
+            if (strcmp(rp->state, "apply") != 0 && strcmp(rp->state, report->state) != 0) {
+                break;
+            }
+            *rp = *report;
+            if (delivered) {
+                rp->attempts = -1;
+            } else {
+                reportRetry(rp);
+            }
+            break;
+        }
+    }
+    reportSave(reports, count);
+    ufree(reports);
+}
+#endif /* ME_UPDATER_ASYNC */
+
+#else
+/*
+    Without the report queue, reports are posted directly
+ */
+static int reportQueue(cchar *state, cchar *device, cchar *update, cchar *version)
+{
+    return -1;
+}
+
+static void reportFlush(cchar *host, cchar *token, cchar **devices, cchar **versions, int count)
+{
+}
+#endif /* ME_UPDATER_QUEUE */
+
+/*
+    Mini-fetch API. Start an HTTP action. This is NOT a generic fetch API implementation.
+    Connections are reused via HTTP/1.1 keep-alive where possible.
+ */
+static Fetch *fetch(char *method, char *url, char *headers, char *body)
+{
+    return fetchRequest(method, url, headers, body, NULL);
+}
+
+/*
+    Start an HTTP action. If "status" is given, it is set to the HTTP status of a response that was
+    rejected, or to zero if no response was received.
+ */
+static Fetch *fetchRequest(char *method, char *url, char *headers, char *body, int *status)
+{
+    Fetch     *fp;
+    char      request[UBSIZE], host[256];
+    long long start;
+
+    if (fetchFormat(request, sizeof(request), method, url, headers, body, host, sizeof(host)) < 0) {
+        return NULL;
+    }
+    /*
+        Write the request and wait for a response. A pooled connection may have been closed by
+        the server while idle, in which case retry once on a new connection.
+     */
+    while (1) {
+        if ((fp = fetchConnect(host)) == NULL) {
+            return NULL;
+        }
+        fp->conditional = headers && strstr(headers, "If-None-Match:") != NULL;
+        fp->status = 0;
+        metricsAdd(&updater->metrics.requests, 1);
+        start = uticks();
+        if (fetchWrite(fp, request, strlen(request)) > 0 && fetchHeaders(fp) == 0) {
+            metricsAdd(&updater->metrics.firstByte, uticks() - start);
+            return fp;
+        }
+        if (!fp->reused || fp->bytes > 0) {
+            //  Only retry if nothing was received
+            if (status) {
+                *status = fp->status;
+            }
+            fetchFree(fp);
+            return NULL;
+        }
+        fetchFree(fp);
+        metricsAdd(&updater->metrics.retries, 1);
+    }
+}
+
+/*
+    Format an HTTP request for a URL and calculate the body content length.
+    The request host is returned in "host".
+ */
+static int fetchFormat(char *request, size_t size, cchar *method, cchar *url, cchar *headers, cchar *body,
+                       char *host, size_t hostSize)
+{
+    char uri[UBSIZE], *hp, *path;
+
+    snprintf(uri, sizeof(uri), "%s", url);
+    if ((hp = strstr(uri, "https://")) != NULL) {
+        hp += 8;
+    } else {
+        hp = uri;
+    }
+    if ((path = strchr(hp, '/')) != NULL) {
+        *path++ = '\0';
+    } else {
+        path = "";
+    }
+    snprintf(host, hostSize, "%s", hp);
+    if (snprintf(request, size,
+                 "%s /%s HTTP/1.1\r\n" \
+                 "Host: %s\r\n" \
+                 "Content-Length: %d\r\n" \
+                 "%s\r\n" \
+                 "%s",
+                 method, path, host, body ? (int) strlen(body) : 0, headers, body ? body : "") >= (int) size) {
+        fprintf(stderr, "Request too large\n");
+        return -1;
+    }
+    if (updater->verbose) {
+        printf("\nFetch Request:\n%s\n\n", request);
+    }
+    return 0;
+}
+
+/*
+    Read the response status and headers. The headers may span several reads, which must complete
+    within the read timeout.
+ */
+static int fetchHeaders(Fetch *fp)
+{
+    ssize_t   bytes;
+    long long deadline;
+    int       rc;
+
+    deadline = ticks() + timeoutRead();
+    while ((rc = fetchHead(fp)) > 0) {
+        if (ticks() >= deadline) {
+            fprintf(stderr, "Timeout waiting for response from %s\n", fp->host);
+            return -1;
+        }
+        if ((bytes = fetchRead(fp, &fp->rx[fp->rxEnd], sizeof(fp->rx) - 1 - fp->rxEnd)) <= 0) {
+            return -1;
+        }
+        fp->rxEnd += bytes;
+    }
+    return rc;
+}
+
+/*
+    Parse the response headers if they have been fully received. Returns 1 if more data is
+    required, 0 when parsed and -1 on errors. Body data received with the headers is retained in
+    the receive buffer.
+ */
+static int fetchHead(Fetch *fp)
+{
+    char *data, *end;
+
+    data = &fp->rx[fp->rxStart];
+    fp->rx[fp->rxEnd] = '\0';
+    if ((end = strstr(data, "\r\n\r\n")) == NULL) {
+        if (fp->rxStart == 0 && fp->rxEnd >= sizeof(fp->rx) - 1) {
+            fprintf(stderr, "Response headers too large\n");
+            return -1;
+        }
+        //  Move the partial headers to the start of the buffer to read the remainder
+        memmove(fp->rx, data, fp->rxEnd - fp->rxStart);
+        fp->rxEnd -= fp->rxStart;
+        fp->rxStart = 0;
+        return 1;
+    }
+    //  Retain the final header line terminator for fetchHeader
+    end[2] = '\0';
+    fp->rxStart = end + 4 - fp->rx;
+    return fetchParse(fp, data);
+}
+
+/*
+    Parse the response status and headers and determine how the body is framed. The body is
+    delimited by chunked transfer encoding, by Content-Length, or by the connection closing.
+ */
+static int fetchParse(Fetch *fp, char *response)
+{
+    cchar     *header;
+    char      *end, *status;
+    long long length;
+    size_t    len;
+
+    ufree(fp->response);
+    fp->response = NULL;
+    fp->complete = 0;
+    fp->contentLength = fp->remaining = fp->chunkLeft = fp->lineLen = 0;
+    fp->chunkState = CHUNK_SIZE;
+
+    if (strncmp(response, "HTTP/1.1 ", 9) != 0 || (status = strchr(response, ' ')) == NULL) {
+        fprintf(stderr, "Bad response\n%s\n", response);
+        return -1;
+    }
+    if ((fp->response = ustrdup(response)) == NULL) {
+        return -1;
+    }
+    if (updater->verbose) {
+        printf("Fetch response:\n%s\n\n", response);
+    }
+    fp->status = atoi(++status);
+    /*
+        Callers check for the success status they expect. Precondition Failed is returned for a
+        compact check the server cannot match.
+     */
+    if ((fp->status < 200 || fp->status >= 300) && fp->status != 304 && !(fp->status == 412 && fp->conditional)) {
+        fprintf(stderr, "Bad response status %d\n%s\n", fp->status, response);
+        return -1;
+    }
+    fp->keepAlive = 1;
+    if (fp->status == 204 || fp->status == 304) {
+        //  No Content and Not Modified responses have no body
+        fp->framing = FRAME_LENGTH;
+        fp->complete = 1;
+
+    } else if ((header = fetchHeaderFind(fp, "Transfer-Encoding", &len)) != NULL) {
+        //  A transfer encoding overrides any content length. Chunked must be the final encoding.
+        if (len != 7 || strncasecmp(header, "chunked", 7) != 0) {
+            fprintf(stderr, "Unsupported transfer encoding %.*s\n", (int) len, header);
+            return -1;
+        }
+        fp->framing = FRAME_CHUNKED;
+
+    } else if ((header = fetchHeaderFind(fp, "Content-Length", &len)) != NULL) {
+        length = strtoll(header, &end, 10);
+        if (end == header || end != &header[len] || length < 0) {
+            fprintf(stderr, "Bad content length %.*s\n", (int) len, header);
+            return -1;
+        }
+        fp->framing = FRAME_LENGTH;
+        fp->contentLength = fp->remaining = (size_t) length;
+        fp->complete = fp->remaining == 0;
+
+    } else {
+        fp->framing = FRAME_CLOSE;
+        fp->keepAlive = 0;
+    }
+    if ((header = fetchHeaderFind(fp, "Connection", &len)) != NULL && len == 5 &&
+        strncasecmp(header, "close", 5) == 0) {
+        fp->keepAlive = 0;
+    }
+    return 0;
+}
+
+/*
+    Get the number of bytes that may be received into a "len" byte buffer without reading beyond
+    the response body. Chunk framing is read in small amounts, so little is read beyond the last chunk.
+ */
+static size_t fetchWant(Fetch *fp, size_t len)
+{
+    if (fp->framing == FRAME_LENGTH) {
+        return min(len, fp->remaining);
+    }
+    if (fp->framing == FRAME_CHUNKED) {
+        return min(len, fp->chunkState == CHUNK_DATA ? fp->chunkLeft : CHUNK_READ);
+    }
+    return len;
+}
+
+/*
+    Receive response data. Data already in the receive buffer is returned first. Returns the
+    result of fetchRead when reading from the connection.
+ */
+static ssize_t fetchRecv(Fetch *fp, char *buf, size_t len)
+{
+    size_t n;
+
+    if (fp->rxStart < fp->rxEnd) {
+        n = min(len, fp->rxEnd - fp->rxStart);
+        memcpy(buf, &fp->rx[fp->rxStart], n);
+        fp->rxStart += n;
+        return (ssize_t) n;
+    }
+    fp->rxStart = fp->rxEnd = 0;
+    return fetchRead(fp, buf, len);
+}
+
+/*
+    Return data received beyond the end of a response to the receive buffer. The data was either
+    just taken from the buffer or read from the connection with the buffer empty.
+ */
+static void fetchUnread(Fetch *fp, char *buf, size_t len)
+{
+    if (fp->rxStart >= len) {
+        fp->rxStart -= len;
+    } else {
+        fp->rxStart = 0;
+        fp->rxEnd = len;
+    }
+    memmove(&fp->rx[fp->rxStart], buf, len);
+}
+
+/*
+    Remove the transfer framing from "len" bytes of received response data in place. Returns the
+    number of body bytes, which is zero if only framing was received, or -1 for bad framing. The
+    response is complete once the end of the body is received.
+ */
+static ssize_t fetchFrame(Fetch *fp, char *buf, size_t len)
+{
+    size_t i, n, out;
+    int    c;
+
+    if (fp->framing == FRAME_LENGTH) {
+        fp->remaining -= min(len, fp->remaining);
+        fp->complete = fp->remaining == 0;
+        return (ssize_t) len;
+    }
+    if (fp->framing == FRAME_CLOSE) {
+        return (ssize_t) len;
+    }
+    for (i = out = 0; i < len && !fp->complete; ) {
+        if (fp->chunkState == CHUNK_DATA) {
+            n = min(fp->chunkLeft, len - i);
+            memmove(&buf[out], &buf[i], n);
+            out += n;
+            i += n;
+            if ((fp->chunkLeft -= n) == 0) {
+                fp->chunkState = CHUNK_END;
+            }
+            continue;
+        }
+        c = (uchar) buf[i++];
+        switch (fp->chunkState) {
+        case CHUNK_SIZE:
+        case CHUNK_EXT:
+            if (c == '\n') {
+                if (fp->lineLen == 0) {
+                    fprintf(stderr, "Bad chunked response\n");
+                    return -1;
+                }
+                fp->lineLen = 0;
+                fp->chunkState = fp->chunkLeft ? CHUNK_DATA : CHUNK_TRAILER;
+
+            } else if (fp->chunkState == CHUNK_SIZE && isxdigit(c)) {
+                if (fp->chunkLeft > (SIZE_MAX >> 4)) {
+                    fprintf(stderr, "Bad chunked response\n");
+                    return -1;
+                }
+                fp->chunkLeft = fp->chunkLeft * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+                fp->lineLen++;
+
+            } else if (c != '\r') {
+                if (fp->lineLen == 0) {
+                    fprintf(stderr, "Bad chunked response\n");
+                    return -1;
+                }
+                fp->chunkState = CHUNK_EXT;
+            }
+            break;
+
+        case CHUNK_END:
+            if (c == '\n') {
+                fp->chunkState = CHUNK_SIZE;
+            } else if (c != '\r') {
+                fprintf(stderr, "Bad chunked response\n");
+                return -1;
+            }
+            break;
+
+        case CHUNK_TRAILER:
+            //  Trailer fields are ignored. The body ends with an empty line.
+            if (c == '\n') {
+                fp->complete = fp->lineLen == 0;
+                fp->lineLen = 0;
+            } else if (c != '\r') {
+                fp->lineLen++;
+            }
+            break;
+        }
+    }
+    if (i < len) {
+        //  Data beyond the body belongs to the next response
+        fetchUnread(fp, &buf[i], len - i);
+    }
+    return (ssize_t) out;
+}
+
+/*
+    Receive response body data. Returns the number of body bytes read, zero at the end of the
+    body, or -1 if the connection fails before the body is complete.
+ */
+static ssize_t fetchBody(Fetch *fp, char *buf, size_t len)
+{
+    ssize_t bytes;
+
+    while (!fp->complete) {
+        if ((bytes = fetchRecv(fp, buf, fetchWant(fp, len))) <= 0) {
+            if (bytes == 0 && fp->framing == FRAME_CLOSE) {
+                //  The body ends when the server closes the connection
+                fp->complete = 1;
+                return 0;
+            }
+            return -1;
+        }
+        if ((bytes = fetchFrame(fp, buf, bytes)) != 0) {
+            return bytes;
+        }
+    }
+    return 0;
+}
+
+/*
+    Grow a response body buffer. The buffer is sized for the content length, or grown as a body
+    of unknown length is received, up to BODY_MAX.
+ */
+static int fetchBodyRoom(Fetch *fp, char **body, size_t *size)
+{
+    char   *bp;
+    size_t want;
+
+    if (*body) {
+        want = max(*size * 2, UBSIZE);
+    } else {
+        want = fp->framing == FRAME_LENGTH ? fp->contentLength : UBSIZE;
+    }
+    if (want > BODY_MAX) {
+        fprintf(stderr, "Response body too large\n");
+        return -1;
+    }
+    if ((bp = urealloc(*body, want + 1)) == NULL) {
+        fprintf(stderr, "Cannot allocate %d bytes\n", (int) want);
+        return -1;
+    }
+    *body = bp;
+    *size = want;
+    return 0;
+}
+
+/*
+    Get a connection to the host. Use an idle pooled connection if one is available, otherwise
+    open a new connection.
+ */
+static Fetch *fetchConnect(cchar *host)
+{
+    Fetch *fp;
+    int   fd;
+
+    if ((fp = poolTake(host)) != NULL) {
+        fp->conditional = 0;
+        return fp;
+    }
+    if ((fd = connectHost(host)) < 0) {
+        return NULL;
+    }
+    if ((fp = fetchAlloc(fd, host)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    return fp;
+}
+
+/*
+    Open a TCP connection to the host. Connection attempts to the host addresses are raced
+    (RFC 8305 happy eyeballs): if an attempt has not connected within CONNECT_DELAY, the next
+    address is tried in parallel and the first to connect is used. Returns the connected socket.
+ */
+static int connectHost(cchar *host)
+{
+    struct pollfd fds[DNS_ADDRS];
+    Resolved      resolved, *rp;
+    socklen_t     len;
+    long long     deadline, launched, now, start;
+    int           active, err, fd, i, next, wait;
+
+    rp = &resolved;
+    if (resolveHost(host, rp) < 0) {
+        return -1;
+    }
+    start = uticks();
+    now = ticks();
+    deadline = now + timeoutConnect();
+    launched = 0;
+    active = next = 0;
+    fd = -1;
+
+    while (fd < 0) {
+        if (next < rp->count && (active == 0 || now - launched >= CONNECT_DELAY)) {
+            //  Start the next attempt
+            if ((fds[active].fd = socket(rp->addrs[next].ss_family, SOCK_STREAM, 0)) >= 0) {
+                fcntl(fds[active].fd, F_SETFL, fcntl(fds[active].fd, F_GETFL) | O_NONBLOCK);
+                if (connect(fds[active].fd, (struct sockaddr*) &rp->addrs[next], rp->lens[next]) == 0 ||
+                    errno == EINPROGRESS) {
+                    fds[active].events = POLLOUT;
+                    fds[active].revents = 0;
+                    active++;
+                } else {
+                    close(fds[active].fd);
+                }
+            }
+            next++;
+            launched = now;
+            continue;
+        }
+        if (active == 0) {
+            fprintf(stderr, "Error connecting to %s\n", host);
+            break;
+        }
+        if (now >= deadline) {
+            fprintf(stderr, "Timeout connecting to %s\n", host);
+            break;
+        }
+        wait = (int) (deadline - now);
+        if (next < rp->count) {
+            wait = (int) min(wait, launched + CONNECT_DELAY - now);
+        }
+        if (poll(fds, active, wait) < 0 && errno != EINTR) {
+            break;
+        }
+        for (i = active - 1; i >= 0; i--) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            len = sizeof(err);
+            if (fd < 0 && getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+                fd = fds[i].fd;
+            } else {
+                close(fds[i].fd);
+            }
+            fds[i] = fds[--active];
+        }
+        now = ticks();
+    }
+    for (i = 0; i < active; i++) {
+        //  Abandon the attempts that lost the race
+        close(fds[i].fd);
+    }
+    metricsAdd(&updater->metrics.connect, uticks() - start);
+    if (fd < 0) {
+        //  Resolve again on the next attempt in case the addresses have changed
+        resolveExpire(host);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    metricsAdd(&updater->metrics.connections, 1);
+    return fd;
+}
+
+/*
+    Return the milliseconds to wait for a connection and for its TLS handshake
+ */
+static int timeoutConnect(void)
+{
+    return (updater->options.connectTimeout > 0 ? updater->options.connectTimeout : CONNECT_TIMEOUT) * 1000;
+}
+
+/*
+    Return the milliseconds to wait for response headers and for each read of a response body
+ */
+static int timeoutRead(void)
+{
+    return (updater->options.timeout > 0 ? updater->options.timeout : READ_TIMEOUT) * 1000;
+}
+
+/*
+    Set the time blocking reads and writes on a socket may wait before failing
+ */
+static void timeoutSocket(int fd, int msecs)
+{
+    struct timeval tv;
+
+    tv.tv_sec = msecs / 1000;
+    tv.tv_usec = (msecs % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/*
+    Return the number of times to retry a failing request
+ */
+static int retryCount(void)
+{
+    if (updater->options.retries < 0) {
+        return 0;
+    }
+    return updater->options.retries ? updater->options.retries : RETRY_COUNT;
+}
+
+/*
+    Wait before retry "attempt", counting from zero
+ */
+static void retryWait(int attempt)
+{
+    long long delay;
+
+    delay = retryDelay(RETRY_DELAY, RETRY_DELAY_MAX, attempt);
+    if (updater->verbose) {
+        printf("Retrying in %d msec\n", (int) delay);
+    }
+    poll(NULL, 0, (int) delay);
+}
+
+/*
+    Return the delay before retry "attempt", counting from zero. The delay doubles with each attempt
+    up to "max" and is randomized so devices that failed together do not retry together.
+ */
+static long long retryDelay(long long delay, long long max, int attempt)
+{
+    uint jitter;
+
+    delay = min(delay << min(attempt, 16), max);
+    if (RAND_bytes((uchar*) &jitter, sizeof(jitter)) != 1) {
+        jitter = (uint) getpid();
+    }
+    //  Wait between half and all of the delay
+    return delay / 2 + jitter % (delay / 2 + 1);
+}
+
+/*
+    Return the number of download hosts: the image host and the mirrors
+ */
+static int mirrorCount(void)
+{
+    cchar *cp;
+    int   count;
+
+    if (!updater->options.mirrors || !*updater->options.mirrors) {
+        return 1;
+    }
+    for (count = 2, cp = updater->options.mirrors; (cp = strchr(cp, ',')) != NULL; cp++) {
+        count++;
+    }
+    return count;
+}
+
+/*
+    Return the URL of an image on download host "index". Host zero is the host of "url" and the
+    others are the mirrors in order. A mirror URL is formatted into "buf".
+ */
+static cchar *mirrorUrl(cchar *url, int index, char *buf, size_t size)
+{
+    cchar  *cp, *path;
+    size_t len;
+    int    i;
+
+    if (index == 0 || !updater->options.mirrors) {
+        return url;
+    }
+    for (cp = updater->options.mirrors, i = 1; i < index && cp; i++) {
+        if ((cp = strchr(cp, ',')) != NULL) {
+            cp++;
+        }
+    }
+    if (!cp) {
+        return url;
+    }
+    cp += strspn(cp, " ");
+    for (len = strcspn(cp, ", "); len > 0 && cp[len - 1] == '/'; len--) {}
+    path = strstr(url, "://") ? strstr(url, "://") + 3 : url;
+    path = strchr(path, '/');
+    snprintf(buf, size, "%.*s%s", (int) len, cp, path ? path : "/");
+    return buf;
+}
+
+/*
+    Resolve the addresses of a host. Results are cached for use by subsequent requests.
+ */
+static int resolveHost(cchar *host, Resolved *rp)
+{
+    struct addrinfo hints, *ai, *res;
+    Resolved        *cp;
+    time_t          now;
+    long long       start;
+    char            name[256], port[16], *colon;
+    int             family, i, rc, slot;
+
+    now = time(NULL);
+    pthread_mutex_lock(&updater->fetchLock);
+    for (i = 0; i < DNS_CACHE; i++) {
+        cp = &updater->dnsCache[i];
+        if (cp->count && cp->expires > now && strcmp(cp->host, host) == 0) {
+            *rp = *cp;
+            pthread_mutex_unlock(&updater->fetchLock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&updater->fetchLock);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    //  A host may have a port suffix, as LAN peers do
+    snprintf(name, sizeof(name), "%s", host);
+    if ((colon = strchr(name, ':')) != NULL) {
+        *colon++ = '\0';
+        snprintf(port, sizeof(port), "%s", colon);
+    } else {
+        snprintf(port, sizeof(port), "%d", SERVER_PORT);
+    }
+    start = uticks();
+    rc = getaddrinfo(name, port, &hints, &res);
+    metricsAdd(&updater->metrics.dns, uticks() - start);
+    if (rc != 0) {
+        fprintf(stderr, "Cannot find host %s: %s\n", host, gai_strerror(rc));
+        return -1;
+    }
+    /*
+        Interleave the address families, starting with the family of the preferred address
+     */
+    memset(rp, 0, sizeof(Resolved));
+    snprintf(rp->host, sizeof(rp->host), "%s", host);
+    family = res->ai_family;
+    while (rp->count < DNS_ADDRS) {
+        for (ai = res; ai; ai = ai->ai_next) {
+            if (ai->ai_family == family && ai->ai_addrlen <= sizeof(struct sockaddr_storage)) {
+                break;
+            }
+        }
+        if (ai == NULL) {
+            for (ai = res; ai && ai->ai_addrlen > sizeof(struct sockaddr_storage); ai = ai->ai_next) {}
+            if (ai == NULL) {
+                break;
+            }
+        }
+        memcpy(&rp->addrs[rp->count], ai->ai_addr, ai->ai_addrlen);
+        rp->lens[rp->count++] = ai->ai_addrlen;
+        //  Consume the address and switch family
+        ai->ai_addrlen = sizeof(struct sockaddr_storage) + 1;
+        family = ai->ai_family == AF_INET ? AF_INET6 : AF_INET;
+    }
+    freeaddrinfo(res);
+    rp->expires = now + DNS_TTL;
+
+    pthread_mutex_lock(&updater->fetchLock);
+    for (slot = -1, i = 0; i < DNS_CACHE; i++) {
+        if (strcmp(updater->dnsCache[i].host, host) == 0 || (slot < 0 && updater->dnsCache[i].count == 0)) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        slot = updater->dnsNext;
+        updater->dnsNext = (updater->dnsNext + 1) % DNS_CACHE;
+    }
+    updater->dnsCache[slot] = *rp;
+    pthread_mutex_unlock(&updater->fetchLock);
+    return rp->count ? 0 : -1;
+}
+
+/*
+    Remove a host from the DNS cache
+ */
+static void resolveExpire(cchar *host)
+{
+    int i;
+
+    pthread_mutex_lock(&updater->fetchLock);
+    for (i = 0; i < DNS_CACHE; i++) {
+        if (strcmp(updater->dnsCache[i].host, host) == 0) {
+            memset(&updater->dnsCache[i], 0, sizeof(Resolved));
+        }
+    }
+    pthread_mutex_unlock(&updater->fetchLock);
+}
+
+/*
+    Return a monotonic time in milliseconds
+ */
+static long long ticks(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+    Return a monotonic time in microseconds for metrics
+ */
+static long long uticks(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+    Add to an update metric. Metrics are updated by the parallel download workers.
+ */
+static void metricsAdd(long long *field, long long value)
+{
+    pthread_mutex_lock(&updater->metricsLock);
+    *field += value;
+    pthread_mutex_unlock(&updater->metricsLock);
+}
+
+/*
+    Start collecting metrics for an update
+ */
+static void metricsReset(void)
+{
+    pthread_mutex_lock(&updater->metricsLock);
+    memset(&updater->metrics, 0, sizeof(updater->metrics));
+    updater->metricsStart = uticks();
+    pthread_mutex_unlock(&updater->metricsLock);
+
+    pthread_mutex_lock(&updater->arena.lock);
+    updater->arena.peak = updater->arena.used;
+    pthread_mutex_unlock(&updater->arena.lock);
+}
+
+/*
+    Finish collecting metrics for an update
+ */
+static void metricsEnd(void)
+{
+    pthread_mutex_lock(&updater->metricsLock);
+    if (updater->metricsStart) {
+        updater->metrics.total = uticks() - updater->metricsStart;
+        updater->metricsStart = 0;
+    }
+    pthread_mutex_unlock(&updater->metricsLock);
+}
+
+/*
+    Use "buf" for all updater allocations. If "buf" is NULL, allocations are made from the heap.
+ */
+static void arenaInit(void *buf, size_t size)
+{
+    ArenaBlock *bp;
+    char       *base;
+
+    pthread_mutex_lock(&updater->arena.lock);
+    updater->arena.base = updater->arena.end = NULL;
+    updater->arena.used = updater->arena.peak = 0;
+    if (buf) {
+        base = (char*) (((uintptr_t) buf + ARENA_ALIGN - 1) & ~(uintptr_t) (ARENA_ALIGN - 1));
+        size = (size - (base - (char*) buf)) & ~(size_t) (ARENA_ALIGN - 1);
+        updater->arena.base = base;
+        updater->arena.end = base + size;
+        bp = (ArenaBlock*) base;
+        bp->size = size;
+        bp->used = 0;
+    }
+    pthread_mutex_unlock(&updater->arena.lock);
+}
+
+/*
+    Allocate from the arena. The first free block that fits is used and the remainder split off.
+    Returns NULL if the arena is exhausted.
+ */
+static void *arenaAlloc(size_t size, size_t align)
+{
+    ArenaBlock *bp, *np;
+    char       *data;
+    size_t     pad;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    pthread_mutex_lock(&updater->arena.lock);
+    for (bp = (ArenaBlock*) updater->arena.base; (char*) bp < updater->arena.end;
+         bp = (ArenaBlock*) ((char*) bp + bp->size)) {
+        if (bp->used) {
+            continue;
+        }
+        for (np = (ArenaBlock*) ((char*) bp + bp->size); (char*) np < updater->arena.end && !np->used;
+             np = (ArenaBlock*) ((char*) bp + bp->size)) {
+            bp->size += np->size;
+        }
+        //  Leading padding to align the data is left as a free block
+        data = (char*) bp + ARENA_HEADER;
+        if (align > ARENA_ALIGN) {
+            data = (char*) (((uintptr_t) data + align - 1) & ~(uintptr_t) (align - 1));
+            if (data > (char*) bp + ARENA_HEADER && data < (char*) bp + ARENA_HEADER * 2) {
+                data += align;
+            }
+        }
+        pad = data - ((char*) bp + ARENA_HEADER);
+        if (pad + ARENA_HEADER + size > bp->size) {
+            continue;
+        }
+        if (pad) {
+            np = (ArenaBlock*) ((char*) bp + pad);
+            np->size = bp->size - pad;
+            bp->size = pad;
+            bp = np;
+        }
+        if (bp->size - ARENA_HEADER - size >= ARENA_HEADER + ARENA_ALIGN) {
+            np = (ArenaBlock*) ((char*) bp + ARENA_HEADER + size);
+            np->size = bp->size - ARENA_HEADER - size;
+            np->used = 0;
+            bp->size = ARENA_HEADER + size;
+        }
+        bp->used = 1;
+        updater->arena.used += bp->size;
+        updater->arena.peak = max(updater->arena.peak, updater->arena.used);
+        pthread_mutex_unlock(&updater->arena.lock);
+        return data;
+    }
+    pthread_mutex_unlock(&updater->arena.lock);
+    return NULL;
+}
+
+/*
+    Return an allocation to the arena
+ */
+static void arenaFree(void *ptr)
+{
+    ArenaBlock *bp;
+
+    pthread_mutex_lock(&updater->arena.lock);
+    bp = (ArenaBlock*) ((char*) ptr - ARENA_HEADER);
+    bp->used = 0;
+    updater->arena.used -= bp->size;
+    pthread_mutex_unlock(&updater->arena.lock);
+}
+
+/*
+    Test if memory was allocated from the arena
+ */
+static int arenaContains(void *ptr)
+{
+    return updater->arena.base && (char*) ptr >= updater->arena.base && (char*) ptr < updater->arena.end;
+}
+
+/*
+    Allocate memory from the arena if one is configured, otherwise from the heap
+ */
+static void *ualloc(size_t size)
+{
+    return updater->arena.base ? arenaAlloc(size, ARENA_ALIGN) : malloc(size);
+}
+
+/*
+    Allocate memory aligned to "align", which must be a power of two
+ */
+static void *ualign(size_t size, size_t align)
+{
+    void *ptr;
+
+    if (updater->arena.base) {
+        return arenaAlloc(size, align);
+    }
+    return posix_memalign(&ptr, align, size) == 0 ? ptr : NULL;
+}
+
+#if ME_UPDATER_BATCH || ME_UPDATER_COMPRESS || ME_UPDATER_DELTA || ME_UPDATER_PARALLEL || ME_UPDATER_PIPELINE || \
+    ME_UPDATER_QUEUE
+static void *ucalloc(size_t count, size_t size)
+{
+    void *ptr;
+
+    if (size && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    if ((ptr = ualloc(count * size)) != NULL) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+#endif
+
+static void *urealloc(void *ptr, size_t size)
+{
+    ArenaBlock *bp;
+    void       *np;
+
+    if (ptr && !arenaContains(ptr)) {
+        return realloc(ptr, size);
+    }
+    if (!ptr) {
+        return ualloc(size);
+    }
+    bp = (ArenaBlock*) ((char*) ptr - ARENA_HEADER);
+    if (bp->size - ARENA_HEADER >= size) {
+        return ptr;
+    }
+    if ((np = arenaAlloc(size, ARENA_ALIGN)) != NULL) {
+        memcpy(np, ptr, bp->size - ARENA_HEADER);
+        arenaFree(ptr);
+    }
+    return np;
+}
+
+static char *ustrdup(cchar *str)
+{
+    char   *ptr;
+    size_t len;
+
+    len = strlen(str) + 1;
+    if ((ptr = ualloc(len)) != NULL) {
+        memcpy(ptr, str, len);
+    }
+    return ptr;
+}
+
+static void ufree(void *ptr)
+{
+    if (arenaContains(ptr)) {
+        arenaFree(ptr);
+    } else {
+        free(ptr);
+    }
+}
+
+/*
+    Decompressor allocators so zlib and bzip2 state is also taken from the arena
+ */
+#if ME_UPDATER_COMPRESS
+static void *zAlloc(void *opaque, uint items, uint size)
+{
+    return ucalloc(items, size);
+}
+#endif
+
+#if ME_UPDATER_DELTA
+static void *bzAlloc(void *opaque, int items, int size)
+{
+    return ucalloc((size_t) items, (size_t) size);
+}
+#endif
+
+#if ME_UPDATER_COMPRESS || ME_UPDATER_DELTA
+static void zFree(void *opaque, void *ptr)
+{
+    ufree(ptr);
+}
+#endif
+
+/*
+    Select the SHA-256 digest engine. "openssl" uses the OpenSSL default, "openssl:NAME" loads the
+    NAME provider for hardware accelerated hashing, and "kernel" uses the Linux kernel crypto API
+    so SoC hash offload can be used. "blake3" requests BLAKE3 image checksums from the Builder.
+ */
+static int digestSelect(cchar *digest)
+{
+    OSSL_PROVIDER *provider;
+    EVP_MD        *md;
+    char          query[80];
+    int           fd;
+
+    provider = NULL;
+    md = NULL;
+    fd = -1;
+    if (digest && strncmp(digest, "openssl:", 8) == 0) {
+        if ((provider = OSSL_PROVIDER_load(NULL, &digest[8])) == NULL) {
+            fprintf(stderr, "Cannot load OpenSSL provider \"%s\"\n", &digest[8]);
+            return -1;
+        }
+        snprintf(query, sizeof(query), "provider=%s", &digest[8]);
+        if ((md = EVP_MD_fetch(NULL, "SHA256", query)) == NULL) {
+            fprintf(stderr, "OpenSSL provider \"%s\" does not support SHA-256\n", &digest[8]);
+            OSSL_PROVIDER_unload(provider);
+            return -1;
+        }
+    } else if (digest && strcmp(digest, "kernel") == 0) {
+#if __linux__
+        struct sockaddr_alg sa = { .salg_family = AF_ALG, .salg_type = "hash", .salg_name = "sha256" };
+
+        if ((fd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0 ||
+            bind(fd, (struct sockaddr*) &sa, sizeof(sa)) < 0) {
+            fprintf(stderr, "Cannot use the kernel crypto API for SHA-256, errno %d\n", errno);
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+#else
+        fprintf(stderr, "The kernel crypto API is only supported on Linux\n");
+        return -1;
+#endif
+    } else if (digest && strcmp(digest, "blake3") == 0) {
+#if !HAS_BLAKE3
+        fprintf(stderr, "BLAKE3 is not supported, rebuild with BLAKE3=1\n");
+        return -1;
+#endif
+    } else if (digest && strcmp(digest, "openssl") != 0) {
+        fprintf(stderr, "Unknown digest \"%s\"\n", digest);
+        return -1;
+    }
+    //  Release the prior engine. Options are only changed between updates.
+    EVP_MD_free(updater->digestMd);
+    if (updater->digestProvider) {
+        OSSL_PROVIDER_unload(updater->digestProvider);
+    }
+    if (updater->digestSocket >= 0) {
+        close(updater->digestSocket);
+    }
+    updater->digestMd = md;
+    updater->digestProvider = provider;
+    updater->digestSocket = fd;
+    return 0;
+}
+
+/*
+    Get the checksum algorithm of an update response. The Builder provides SHA-256 checksums unless
+    BLAKE3 was requested and is supported.
+ */
+static int digestAlgorithm(Json *jp)
+{
+    cchar *digest;
+
+    if ((digest = jsonGet(jp, 0, "digest")) == NULL || strcmp(digest, "sha256") == 0) {
+        return DIGEST_SHA256;
+    }
+#if HAS_BLAKE3
+    if (strcmp(digest, "blake3") == 0) {
+        return DIGEST_BLAKE3;
+    }
+#endif
+    fprintf(stderr, "Unsupported update checksum \"%s\"\n", digest);
+    return -1;
+}
+
+/*
+    Parse the update manifest of a check response. The optional block manifest is of the form:
+    "blocks": {"size": bytes, "hashes": ["SHA-256 of block 0", ...]}.
+    Block hashes are always SHA-256, whatever the algorithm of the image checksum.
+ */
+static int manifestParse(Json *jp, Manifest *mp)
+{
+    JsonToken *tp;
+    cchar     *size;
+    size_t    i;
+    int       blocks, hashes;
+
+    memset(mp, 0, sizeof(Manifest));
+    if ((mp->checksum = jsonGet(jp, 0, "checksum")) == NULL) {
+        fprintf(stderr, "Missing update checksum\n");
+        return -1;
+    }
+    if ((mp->alg = digestAlgorithm(jp)) < 0) {
+        return -1;
+    }
+    mp->signature = jsonGet(jp, 0, "signature");
+
+    if ((blocks = jsonLookup(jp, 0, "blocks")) < 0) {
+        return 0;
+    }
+    if ((size = jsonGet(jp, blocks, "size")) == NULL || (hashes = jsonLookup(jp, blocks, "hashes")) < 0 ||
+        jp->tokens[hashes].type != JSON_ARRAY || jp->tokens[hashes].size == 0 ||
+        (mp->blockSize = (size_t) strtoll(size, NULL, 10)) == 0 || mp->blockSize > (1 << 30)) {
+        fprintf(stderr, "Bad update block manifest\n");
+        return -1;
+    }
+    //  Each hash is a string, so the elements are consecutive tokens
+    mp->hashes = &jp->tokens[hashes + 1];
+    mp->blockCount = (size_t) jp->tokens[hashes].size;
+    for (i = 0; i < mp->blockCount; i++) {
+        tp = &mp->hashes[i];
+        if (tp->type != JSON_STRING || tp->len != DIGEST_LEN * 2 ||
+            strspn(tp->value, "0123456789abcdefABCDEF") != tp->len) {
+            fprintf(stderr, "Bad update block manifest\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Load the public key used to verify update manifest signatures. Ed25519 and ECDSA keys in PEM
+    format are supported.
+ */
+static int signatureLoad(cchar *path)
+{
+    EVP_PKEY *key;
+    FILE     *file;
+    int      type;
+
+    key = NULL;
+    if (path) {
+        if ((file = fopen(path, "r")) == NULL) {
+            fprintf(stderr, "Cannot open update signing key %s\n", path);
+            return -1;
+        }
+        key = PEM_read_PUBKEY(file, NULL, NULL, NULL);
+        fclose(file);
+        if (key == NULL) {
+            fprintf(stderr, "Cannot read update signing key %s\n", path);
+            return -1;
+        }
+        type = EVP_PKEY_get_base_id(key);
+        if (type != EVP_PKEY_ED25519 && type != EVP_PKEY_EC) {
+            fprintf(stderr, "Update signing key must be Ed25519 or ECDSA\n");
+            EVP_PKEY_free(key);
+            return -1;
+        }
+    }
+    EVP_PKEY_free(updater->signKey);
+    updater->signKey = key;
+    return 0;
+}
+
+/*
+    Verify the update manifest signature. The Builder signs the image checksum hex string and
+    provides the signature base64 encoded. ECDSA signatures are over the SHA-256 of the checksum.
+    Returns 0 if verified or if no signing key is configured.
+ */
+static int signatureVerify(cchar *checksum, cchar *signature)
+{
+    EVP_MD_CTX   *ctx;
+    const EVP_MD *md;
+    uchar        *sig;
+    size_t       len;
+    int          rc, sigLen;
+
+    if (updater->signKey == NULL) {
+        return 0;
+    }
+    if (signature == NULL) {
+        fprintf(stderr, "Missing update signature\n");
+        return -1;
+    }
+    len = strlen(signature);
+    if ((sig = ualloc(len / 4 * 3 + 1)) == NULL) {
+        return -1;
+    }
+    //  The decoded length includes a zero byte for each pad character
+    if ((sigLen = EVP_DecodeBlock(sig, (uchar*) signature, (int) len)) < 0 || len % 4) {
+        fprintf(stderr, "Bad update signature\n");
+        ufree(sig);
+        return -1;
+    }
+    for (; len > 0 && signature[len - 1] == '='; len--) {
+        sigLen--;
+    }
+    //  Ed25519 signs the message itself
+    md = EVP_PKEY_get_base_id(updater->signKey) == EVP_PKEY_EC ? EVP_sha256() : NULL;
+    rc = -1;
+    if ((ctx = EVP_MD_CTX_new()) != NULL) {
+        if (EVP_DigestVerifyInit(ctx, NULL, md, NULL, updater->signKey) == 1 &&
+            EVP_DigestVerify(ctx, sig, (size_t) sigLen, (const uchar*) checksum, strlen(checksum)) == 1) {
+            rc = 0;
+        }
+        EVP_MD_CTX_free(ctx);
+    }
+    ufree(sig);
+    if (rc < 0) {
+        fprintf(stderr, "Update signature does not verify\n");
+    }
+    return rc;
+}
+
+/*
+    Initialize a digest for the checksum algorithm
+ */
+static int digestInit(Digest *dg, int alg)
+{
+    memset(dg, 0, sizeof(Digest));
+    dg->alg = alg;
+    dg->fd = -1;
+    if (digestReset(dg) < 0) {
+        digestFree(dg);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Restart a digest
+ */
+static int digestReset(Digest *dg)
+{
+#if HAS_BLAKE3
+    if (dg->alg == DIGEST_BLAKE3) {
+        blake3_hasher_init(&dg->blake3);
+        return 0;
+    }
+#endif
+    if (updater->digestSocket >= 0) {
+        //  Each kernel digest operation uses a new socket from the transform
+        if (dg->fd >= 0) {
+            close(dg->fd);
+        }
+        if ((dg->fd = accept(updater->digestSocket, NULL, NULL)) < 0) {
+            fprintf(stderr, "Cannot open kernel digest, errno %d\n", errno);
+            return -1;
+        }
+        return 0;
+    }
+    if (!dg->mdctx && (dg->mdctx = EVP_MD_CTX_new()) == NULL) {
+        fprintf(stderr, "Failed to create EVP_MD_CTX");
+        return -1;
+    }
+    if (EVP_DigestInit_ex(dg->mdctx, updater->digestMd ? updater->digestMd : EVP_sha256(), NULL) != 1) {
+        fprintf(stderr, "DigestInit error\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Add data to a digest. The time spent hashing is measured.
+ */
+static int digestUpdate(Digest *dg, const void *buf, size_t len)
+{
+    long long start;
+    ssize_t   bytes;
+    size_t    pos;
+    int       rc;
+
+    start = uticks();
+    rc = 0;
+#if HAS_BLAKE3
+    if (dg->alg == DIGEST_BLAKE3) {
+        blake3_hasher_update(&dg->blake3, buf, len);
+    } else
+#endif
+    if (dg->fd >= 0) {
+        //  More data follows until the digest is read
+        for (pos = 0; pos < len; pos += bytes) {
+            if ((bytes = send(dg->fd, (cchar*) buf + pos, len - pos, MSG_MORE)) < 0) {
+                if (errno == EINTR) {
+                    bytes = 0;
+                    continue;
+                }
+                rc = -1;
+                break;
+            }
+        }
+    } else if (EVP_DigestUpdate(dg->mdctx, buf, len) != 1) {
+        rc = -1;
+    }
+    metricsAdd(&updater->metrics.checksum, uticks() - start);
+    return rc;
+}
+
+/*
+    Complete a digest and return the checksum as a hex string in "sum". The digest is freed.
+ */
+static int digestFinal(Digest *dg, char sum[EVP_MAX_MD_SIZE * 2 + 1])
+{
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int  hashLen;
+    int           rc;
+
+    rc = 0;
+    hashLen = DIGEST_LEN;
+#if HAS_BLAKE3
+    if (dg->alg == DIGEST_BLAKE3) {
+        blake3_hasher_finalize(&dg->blake3, hash, DIGEST_LEN);
+    } else
+#endif
+    if (dg->fd >= 0) {
+        if (read(dg->fd, hash, DIGEST_LEN) != DIGEST_LEN) {
+            rc = -1;
+        }
+    } else if (EVP_DigestFinal_ex(dg->mdctx, hash, &hashLen) != 1) {
+        rc = -1;
+    }
+    digestFree(dg);
+    if (rc < 0) {
+        fprintf(stderr, "DigestFinal error\n");
+        return -1;
+    }
+    for (uint i = 0; i < hashLen; i++) {
+        sprintf(&sum[i * 2], "%02x", hash[i]);
+    }
+    return 0;
+}
+
+/*
+    Release a digest
+ */
+static void digestFree(Digest *dg)
+{
+    EVP_MD_CTX_free(dg->mdctx);
+    dg->mdctx = NULL;
+    if (dg->fd >= 0) {
+        close(dg->fd);
+        dg->fd = -1;
+    }
+}
+
+/*
+    Copy the state of the "src" digest to "dst". Any prior state of "dst" is released.
+ */
+static int digestCopy(Digest *dst, Digest *src)
+{
+    digestFree(dst);
+    memset(dst, 0, sizeof(Digest));
+    dst->alg = src->alg;
+    dst->fd = -1;
+#if HAS_BLAKE3
+    if (src->alg == DIGEST_BLAKE3) {
+        dst->blake3 = src->blake3;
+        return 0;
+    }
+#endif
+    if (src->fd >= 0) {
+        //  Accepting on a kernel digest operation socket clones its state
+        if ((dst->fd = accept(src->fd, NULL, NULL)) < 0) {
+            fprintf(stderr, "Cannot copy kernel digest, errno %d\n", errno);
+            return -1;
+        }
+        return 0;
+    }
+    if ((dst->mdctx = EVP_MD_CTX_new()) == NULL || EVP_MD_CTX_copy_ex(dst->mdctx, src->mdctx) != 1) {
+        fprintf(stderr, "Cannot copy digest\n");
+        digestFree(dst);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Take an idle pooled connection to the host. Returns NULL if none is available.
+ */
+static Fetch *poolTake(cchar *host)
+{
+    struct pollfd pfd;
+    Fetch         *fp;
+    Conn          *cp;
+
+    fp = NULL;
+    pthread_mutex_lock(&updater->fetchLock);
+    if ((cp = poolLookup(host, 0)) != NULL && cp->tls) {
+        /*
+            An idle connection that is readable has been closed (or is in an unknown state)
+         */
+        pfd.fd = cp->fd;
+        pfd.events = POLLIN;
+        if (cp->transport == fetchTransport() && poll(&pfd, 1, 0) == 0 && (fp = ualloc(sizeof(Fetch))) != NULL) {
+            memset(fp, 0, sizeof(Fetch));
+            fp->transport = cp->transport;
+            fp->tls = cp->tls;
+            fp->fd = cp->fd;
+            fp->reused = 1;
+            snprintf(fp->host, sizeof(fp->host), "%s", host);
+        } else {
+            fetchClose(cp->transport, cp->tls, cp->fd);
+        }
+        cp->tls = NULL;
+        cp->fd = -1;
+    }
+    pthread_mutex_unlock(&updater->fetchLock);
+    if (fp && updater->verbose) {
+        printf("Reusing connection to %s\n", host);
+    }
+    return fp;
+}
+
+/*
+    Close a connection and its socket
+ */
+static void fetchClose(const UpdateTransport *tp, void *tls, int fd)
+{
+    tp->close(tls);
+    close(fd);
+}
+
+/*
+    Get the TLS transport for new connections
+ */
+static const UpdateTransport *fetchTransport(void)
+{
+    return updater->options.transport ? updater->options.transport : &opensslTransport;
+}
+
+/*
+    Close the idle connections and release the TLS sessions of the pool
+ */
+static void poolFree(void)
+{
+    Conn *cp;
+    int  i;
+
+    pthread_mutex_lock(&updater->fetchLock);
+    for (i = 0; i < FETCH_POOL; i++) {
+        cp = &updater->pool[i];
+        if (cp->tls) {
+            fetchClose(cp->transport, cp->tls, cp->fd);
+        }
+        if (cp->session) {
+            cp->transport->freeSession(cp->session);
+        }
+        memset(cp, 0, sizeof(Conn));
+        cp->fd = -1;
+    }
+    pthread_mutex_unlock(&updater->fetchLock);
+}
+
+/*
+    Lookup the pool slot for a host. If "create" is set, recycle a slot if the host is not present.
+ */
+static Conn *poolLookup(cchar *host, int create)
+{
+    Conn *cp;
+    int  i;
+
+    for (i = 0; i < FETCH_POOL; i++) {
+        if (strcmp(updater->pool[i].host, host) == 0) {
+            return &updater->pool[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    for (i = 0; i < FETCH_POOL; i++) {
+        if (updater->pool[i].host[0] == '\0') {
+            break;
+        }
+    }
+    if (i == FETCH_POOL) {
+        i = updater->poolNext;
+        updater->poolNext = (updater->poolNext + 1) % FETCH_POOL;
+    }
+    cp = &updater->pool[i];
+    if (cp->tls) {
+        fetchClose(cp->transport, cp->tls, cp->fd);
+    }
+    if (cp->session) {
+        cp->transport->freeSession(cp->session);
+    }
+    memset(cp, 0, sizeof(Conn));
+    cp->fd = -1;
+    snprintf(cp->host, sizeof(cp->host), "%s", host);
+    return cp;
+}
+
+/*
+    Return a small response body as a string. Caller must free.
+ */
+static char *fetchString(Fetch *fp)
+{
+    char    *body;
+    ssize_t bytes;
+    size_t  len, size;
+
+    body = NULL;
+    len = size = 0;
+    do {
+        if ((body == NULL || len >= size) && fetchBodyRoom(fp, &body, &size) < 0) {
+            ufree(body);
+            return NULL;
+        }
+        if ((bytes = fetchBody(fp, &body[len], size - len)) < 0) {
+            fprintf(stderr, "Cannot read response body\n");
+            ufree(body);
+            return NULL;
+        }
+        len += bytes;
+    } while (!fp->complete);
+    body[len] = '\0';
+    return body;
+}
+
+/*
+    Download the image at "url" to "path", resuming a prior partial download if one exists.
+    If "streamFd" is not negative, the image is written to it instead and "path" is not used.
+    The checksum of the image using the manifest algorithm is returned as a hex string in "sum".
+    If a signing key is configured, the manifest signature of the checksum must verify. With a
+    block manifest, a block that does not verify is fetched again. With peer distribution, the
+    image is first sought from LAN peers.
+ */
+static int download(cchar *url, cchar *path, Manifest *mp, int streamFd, char sum[EVP_MAX_MD_SIZE * 2 + 1])
+{
+    Peers peers;
+    int   rc;
+
+    peers.count = 0;
+#if ME_UPDATER_PEER
+    //  A streamed image cannot be recalled if a peer serves a different image
+    if (updater->options.peers && streamFd < 0) {
+        peerFind(mp->checksum, &peers);
+    }
+#endif
+    rc = downloadImage(url, path, mp, streamFd, &peers, sum);
+#if ME_UPDATER_PEER
+    if (rc == 0 && peers.count && strcmp(sum, mp->checksum) != 0) {
+        //  Peers are not trusted, so an image that does not verify is downloaded from the image host
+        printf("Update from LAN peers does not match the checksum, downloading from %s\n", url);
+        unlink(path);
+        peers.count = 0;
+        rc = downloadImage(url, path, mp, streamFd, &peers, sum);
+    }
+#endif
+    return rc;
+}
+
+/*
+    Download the image trying the LAN peers "pp" first
+ */
+static int downloadImage(cchar *url, cchar *path, Manifest *mp, int streamFd, Peers *pp,
+                         char sum[EVP_MAX_MD_SIZE * 2 + 1])
+{
+    Download dl, *dp;
+    Fetch    *fp;
+    char     headers[256], target[UBSIZE];
+    size_t   len;
+    int      failed, host, status, transient, rc;
+
+    dp = &dl;
+    if (downloadOpen(dp, path, mp, streamFd) < 0) {
+        return -1;
+    }
+    //  Hold off connecting while paused or outside the download window
+    shapeWait(NULL, 0);
+
+    rc = -1;
+#if ME_UPDATER_PARALLEL
+    if (updater->options.parallel > 1 && !dp->stream && !pp->count) {
+        //  If the image is not large enough or ranges are not supported, use a single stream
+        rc = downloadRanges(url, dp);
+    }
+#endif
+    /*
+        An interrupted download resumes immediately from where it stopped. An attempt that makes no
+        progress moves on to the next host: the LAN peers, the image host and then the mirrors.
+        Once all hosts have failed, waits with backoff before trying them again.
+     */
+    for (failed = host = transient = 0; rc < 0; ) {
+        downloadHeaders(dp, headers, sizeof(headers));
+        len = dp->offset;
+        status = 0;
+        if ((fp = fetchRequest("GET", (char*) downloadUrl(url, mp, pp, host, target, sizeof(target)), headers,
+                               NULL, &status)) != NULL) {
+            if (downloadResponse(dp, fp) == 0) {
+                rc = fetchFile(fp, dp);
+            }
+            status = fp->status;
+            fetchFree(fp);
+        }
+        //  Client errors other than timeouts and rate limiting will not succeed on this host
+        if (status < 400 || status >= 500 || status == 408 || status == 429) {
+            transient = 1;
+        }
+        if (rc < 0) {
+            blockRewind(dp);
+        }
+        if (rc == 0 || dp->rejected >= 0) {
+            //  Complete or a rejected block cannot be fetched again
+            break;
+        }
+        if (dp->offset > len || dp->refetch) {
+            if (dp->refetch) {
+                if (host < pp->count) {
+                    //  The peer sent a bad block, so fetch it from the next host
+                    host++;
+                }
+                printf("Fetching the image again from %d bytes\n", (int) dp->offset);
+            } else {
+                printf("Download interrupted at %d bytes, resuming\n", (int) dp->offset);
+            }
+        } else {
+            if (++host >= pp->count + mirrorCount()) {
+                //  Retry only if a host failed in a way that may succeed later
+                host = 0;
+                if (!transient || failed++ >= retryCount()) {
+                    break;
+                }
+                transient = 0;
+                retryWait(failed - 1);
+            }
+            printf("Download failed, retrying from %s\n", downloadUrl(url, mp, pp, host, target, sizeof(target)));
+        }
+        metricsAdd(&updater->metrics.retries, 1);
+        dp->refetch = 0;
+    }
+    return downloadClose(dp, rc, sum);
+}
+
+/*
+    Return the URL of the image on download host "index". The LAN peers with the image are first,
+    then the image host and the mirrors. Peers serve images by checksum.
+ */
+static cchar *downloadUrl(cchar *url, Manifest *mp, Peers *pp, int index, char *buf, size_t size)
+{
+    if (index < pp->count) {
+        snprintf(buf, size, "https://%s/%s", pp->hosts[index], mp->checksum);
+        return buf;
+    }
+    return mirrorUrl(url, index - pp->count, buf, size);
+}
+
+/*
+    Prepare a download. Allocate the write buffer and digest, and open the image file. If a prior
+    partial download can be resumed, the digest is restored over the partial image and the blocks
+    of a block manifest verified. With a pipeline, the hash and write stages are started.
+ */
+static int downloadOpen(Download *dp, cchar *path, Manifest *mp, int streamFd)
+{
+    ssize_t bytes;
+    size_t  len;
+
+    memset(dp, 0, sizeof(Download));
+    dp->updater = updater;
+    dp->path = path;
+    dp->manifest = mp;
+    dp->block.fd = dp->mark.fd = -1;
+    dp->rejected = -1;
+
+    /*
+        Received data is batched in an aligned buffer and written in whole blocks
+     */
+    dp->bufsize = updater->options.bufferSize > 0 ? (size_t) updater->options.bufferSize : DOWNLOAD_BUFSIZE;
+    dp->bufsize = (dp->bufsize + DOWNLOAD_ALIGN - 1) / DOWNLOAD_ALIGN * DOWNLOAD_ALIGN;
+    if ((dp->buf = ualign(dp->bufsize, DOWNLOAD_ALIGN)) == NULL) {
+        fprintf(stderr, "Cannot allocate %d byte download buffer\n", (int) dp->bufsize);
+        return -1;
+    }
+
+    if (digestInit(&dp->digest, mp->alg) < 0) {
+        ufree(dp->buf);
+        return -1;
+    }
+    /*
+        A new image is written to a new file. The prior image may be linked to the image cache.
+     */
+    if (streamFd >= 0) {
+        dp->fd = streamFd;
+        dp->stream = 1;
+
+    } else if (readResume(dp), (!dp->offset && unlink(path) < 0 && errno != ENOENT) ||
+               (dp->fd = open(path, O_RDWR | O_CREAT | (dp->offset ? 0 : O_TRUNC), 0600)) < 0) {
+        fprintf(stderr, "Cannot open image temp file");
+        digestFree(&dp->digest);
+        ufree(dp->buf);
+        return -1;
+    }
+    if (dp->offset) {
+        /*
+            Resuming from a prior run. Discard any bytes saved after the last checkpoint and restore
+            the digest over the partial image. The partial image is kept up to the first block
+            that does not verify.
+         */
+        printf("Resuming download of %s at %d bytes\n", path, (int) dp->offset);
+        for (len = 0; len < dp->offset; len += bytes) {
+            bytes = pread(dp->fd, dp->buf, min(dp->bufsize, dp->offset - len), len);
+            if (bytes <= 0 || downloadDigest(dp, dp->buf, bytes, len) < 0) {
+                break;
+            }
+        }
+        if (dp->rejected >= 0 && blockRewind(dp) == 0) {
+            printf("Partial image verified to %d bytes\n", (int) dp->offset);
+            dp->refetch = 0;
+        } else if (len < dp->offset || ftruncate(dp->fd, dp->offset) < 0) {
+            dp->offset = 0;
+            dp->rejected = -1;
+            digestFree(&dp->block);
+            digestFree(&dp->mark);
+            if (digestReset(&dp->digest) < 0) {
+                digestFree(&dp->digest);
+                ufree(dp->buf);
+                return -1;
+            }
+        }
+    }
+#if ME_UPDATER_PIPELINE
+    if (updater->options.pipeline > 0 && pipeOpen(dp) < 0) {
+        if (!dp->stream) {
+            close(dp->fd);
+        }
+        digestFree(&dp->digest);
+        digestFree(&dp->block);
+        digestFree(&dp->mark);
+        ufree(dp->buf);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/*
+    Format the request headers to fetch the remainder of the image
+ */
+static void downloadHeaders(Download *dp, char *headers, size_t size)
+{
+    if (dp->offset) {
+        snprintf(headers, size, "Accept: */*\r\nRange: bytes=%lld-\r\n%s%s%s",
+                 (long long) dp->offset, dp->etag[0] ? "If-Range: " : "", dp->etag, dp->etag[0] ? "\r\n" : "");
+    } else {
+#if ME_UPDATER_COMPRESS
+        /*
+            Only the complete image is requested compressed. A resumed download requests the
+            remainder uncompressed so the range offset is the same as the image offset. The zstd
+            decoder allocates from the heap, so is not used with an arena.
+         */
+        snprintf(headers, size, "Accept: */*\r\nAccept-Encoding: %s\r\n",
+                 updater->options.arena ? "gzip" : ACCEPT_ENCODING);
+#else
+        snprintf(headers, size, "Accept: */*\r\n");
+#endif
+    }
+}
+
+/*
+    Check the response to an image request. If the server is not resuming at the download offset,
+    the download starts over.
+ */
+static int downloadResponse(Download *dp, Fetch *fp)
+{
+    char   *encoding, *range;
+    size_t len, start;
+
+    if (pipeDrain(dp) < 0) {
+        return -1;
+    }
+#if ME_UPDATER_COMPRESS
+    decodeFree(dp);
+#endif
+    if (fp->status != 200 && fp->status != 206) {
+        fprintf(stderr, "Bad response status %d\n", fp->status);
+        return -1;
+    }
+    start = 0;
+    if (fp->status == 206 && (range = fetchHeader(fp, "Content-Range")) != NULL) {
+        //  Content-Range: bytes start-end/total
+        start = (size_t) strtoll(&range[strcspn(range, "0123456789")], NULL, 10);
+        ufree(range);
+    }
+    if (fp->status != 206 || start != dp->offset) {
+        //  The server is sending the complete image, so start over
+        if (dp->stream && dp->offset) {
+            //  Data already streamed cannot be recalled
+            return -1;
+        }
+        dp->offset = 0;
+        digestFree(&dp->block);
+        digestFree(&dp->mark);
+        if (digestReset(&dp->digest) < 0 || (!dp->stream && ftruncate(dp->fd, 0) < 0)) {
+            return -1;
+        }
+    }
+    //  An encoding that cannot be copied when memory is exhausted must fail rather than be ignored
+    if ((encoding = fetchHeader(fp, "Content-Encoding")) == NULL && fetchHeaderFind(fp, "Content-Encoding", &len)) {
+        return -1;
+    }
+    if (encoding && strcasecmp(encoding, "identity") != 0) {
+#if ME_UPDATER_COMPRESS
+        if (decodeOpen(dp, encoding) < 0) {
+            ufree(encoding);
+            return -1;
+        }
+        /*
+            The entity tag identifies the compressed representation, which cannot be used to
+            resume the uncompressed image
+         */
+        dp->etag[0] = '\0';
+#else
+        fprintf(stderr, "Unsupported content encoding %s\n", encoding);
+        ufree(encoding);
+        return -1;
+#endif
+
+    } else if ((range = fetchHeader(fp, "ETag")) != NULL) {
+        snprintf(dp->etag, sizeof(dp->etag), "%s", range);
+        ufree(range);
+    }
+    ufree(encoding);
+    return 0;
+}
+
+/*
+    Complete a download with the result "rc". On success, the resume sidecar is removed and the
+    image checksum is returned in "sum". On failure, progress is recorded so a later run can resume.
+    A download whose manifest signature does not verify fails.
+ */
+static int downloadClose(Download *dp, int rc, char sum[EVP_MAX_MD_SIZE * 2 + 1])
+{
+    char buf[UBSIZE];
+
+    //  Complete the pipeline stages before the image and digest are finished
+    if (rc < 0) {
+        blockRewind(dp);
+    }
+    if (pipeClose(dp) < 0) {
+        rc = -1;
+    }
+#if ME_UPDATER_COMPRESS
+    decodeFree(dp);
+#endif
+    ufree(dp->buf);
+    dp->buf = NULL;
+    digestFree(&dp->block);
+    digestFree(&dp->mark);
+    if (dp->stream) {
+        if (rc < 0) {
+            digestFree(&dp->digest);
+            return -1;
+        }
+    } else {
+        close(dp->fd);
+        if (rc < 0) {
+            //  Record progress so a subsequent run can resume
+            if (dp->offset && !dp->patch) {
+                saveResume(dp);
+            }
+            digestFree(&dp->digest);
+            return -1;
+        }
+        unlink(resumePath(dp->path, buf, sizeof(buf)));
+    }
+    if (digestFinal(&dp->digest, sum) < 0) {
+        return -1;
+    }
+    if (downloadAuthentic(dp) < 0) {
+        if (!dp->stream) {
+            unlink(dp->path);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Test if the manifest signature of a download verifies. The signature is normally verified by
+    the pipeline hash stage while the image is received.
+ */
+static int downloadAuthentic(Download *dp)
+{
+    if (dp->authentic == 0) {
+        dp->authentic = signatureVerify(dp->manifest->checksum, dp->manifest->signature) == 0 ? 1 : -1;
+    }
+    return dp->authentic > 0 ? 0 : -1;
+}
+
+#if ME_UPDATER_DELTA
+/*
+    Test if a patch can be applied. An interrupted full download is resumed in preference to a
+    patch, and the base image must match the image the patch was created from.
+ */
+static int patchable(cchar *path, cchar *base, cchar *baseChecksum, int alg)
+{
+    char buf[UBSIZE], sum[EVP_MAX_MD_SIZE * 2 + 1];
+
+    if (access(resumePath(path, buf, sizeof(buf)), F_OK) == 0) {
+        return 0;
+    }
+    if (hashFile(base, alg, sum) < 0 || strcmp(sum, baseChecksum) != 0) {
+        printf("Current image %s does not match the update patch\n", base);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+    Download a binary patch and apply it to the base image as it is received to produce the new
+    image at "path". The new image is verified against the update checksum.
+ */
+static int downloadPatch(cchar *url, cchar *base, cchar *path, Manifest *mp, char sum[EVP_MAX_MD_SIZE * 2 + 1])
+{
+    Download  dl, *dp;
+    Patch     patch, *pp;
+    Fetch     *fp;
+    long long start;
+    int       rc;
+
+    dp = &dl;
+    pp = &patch;
+    if (downloadOpen(dp, path, mp, -1) < 0) {
+        return -1;
+    }
+    dp->patch = 1;
+    if (patchOpen(pp, base, dp) < 0) {
+        downloadClose(dp, -1, sum);
+        return -1;
+    }
+    rc = -1;
+    printf("Downloading update patch to %s\n", path);
+    shapeWait(NULL, 0);
+    if ((fp = fetch("GET", (char*) url, "Accept: */*\r\n", NULL)) != NULL) {
+        start = uticks();
+        rc = fetchPatch(fp, pp);
+        metricsAdd(&updater->metrics.transfer, uticks() - start);
+        fetchFree(fp);
+    }
+    patchClose(pp);
+    if (downloadClose(dp, rc, sum) < 0) {
+        return -1;
+    }
+    if (strcmp(sum, mp->checksum) != 0) {
+        fprintf(stderr, "Patched image checksum does not match\n%s vs\n%s\n", sum, mp->checksum);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Read a patch response body and apply it as it is received
+ */
+static int fetchPatch(Fetch *fp, Patch *pp)
+{
+    Download *dp;
+    char     buf[UBSIZE * 4];
+    ssize_t  bytes;
+    size_t   len;
+
+    dp = pp->dp;
+    if (fp->status != 200) {
+        fprintf(stderr, "Bad response status %d\n", fp->status);
+        return -1;
+    }
+    dp->fill = 0;
+    dp->limit = dp->bufsize;
+    dp->dropped = 0;
+
+    len = 0;
+    while (!fp->complete) {
+        if ((bytes = fetchBody(fp, buf, shapeWait(fp, sizeof(buf)))) <= 0) {
+            break;
+        }
+        shapeUsed(bytes);
+        len += bytes;
+        if (patchData(pp, (uchar*) buf, bytes) < 0) {
+            return -1;
+        }
+    }
+    if (flushDownload(dp) < 0) {
+        return -1;
+    }
+    if (!fp->complete) {
+        fprintf(stderr, "Incomplete patch, received %d bytes\n", (int) len);
+        return -1;
+    }
+    if (!pp->end || pp->diff || pp->extra || (long long) dp->offset != pp->newSize) {
+        fprintf(stderr, "Bad update patch\n");
+        return -1;
+    }
+    return downloadBlocks(dp);
+}
+
+/*
+    Prepare to apply a patch to the base image
+ */
+static int patchOpen(Patch *pp, cchar *base, Download *dp)
+{
+    memset(pp, 0, sizeof(Patch));
+    pp->dp = dp;
+    if ((pp->baseFd = open(base, O_RDONLY)) < 0) {
+        fprintf(stderr, "Cannot open base image %s\n", base);
+        return -1;
+    }
+    if ((pp->baseSize = lseek(pp->baseFd, 0, SEEK_END)) < 0 ||
+        (pp->base = ualloc(dp->bufsize)) == NULL || (pp->out = ualloc(PATCH_BUFSIZE)) == NULL) {
+        patchClose(pp);
+        return -1;
+    }
+    pp->bz.bzalloc = bzAlloc;
+    pp->bz.bzfree = zFree;
+    if (BZ2_bzDecompressInit(&pp->bz, 0, 0) != BZ_OK) {
+        fprintf(stderr, "Cannot initialize patch decompression\n");
+        patchClose(pp);
+        return -1;
+    }
+    pp->bzInit = 1;
+    return 0;
+}
+
+/*
+    Release the patch decompressor and base image
+ */
+static void patchClose(Patch *pp)
+{
+    if (pp->bzInit) {
+        BZ2_bzDecompressEnd(&pp->bz);
+        pp->bzInit = 0;
+    }
+    if (pp->baseFd >= 0) {
+        close(pp->baseFd);
+        pp->baseFd = -1;
+    }
+    ufree(pp->base);
+    ufree(pp->out);
+    pp->base = pp->out = NULL;
+}
+
+/*
+    Process received patch data. The uncompressed header is followed by the compressed patch.
+ */
+static int patchData(Patch *pp, uchar *data, size_t len)
+{
+    size_t n;
+    int    rc;
+
+    if (pp->headerLen < PATCH_HEADER) {
+        n = min(len, PATCH_HEADER - pp->headerLen);
+        memcpy(&pp->header[pp->headerLen], data, n);
+        pp->headerLen += n;
+        data += n;
+        len -= n;
+        if (pp->headerLen < PATCH_HEADER) {
+            return 0;
+        }
+        pp->newSize = patchOffset(&pp->header[16]);
+        if (memcmp(pp->header, PATCH_MAGIC, 16) != 0 || pp->newSize < 0) {
+            fprintf(stderr, "Bad update patch header\n");
+            return -1;
+        }
+    }
+    pp->bz.next_in = (char*) data;
+    pp->bz.avail_in = (uint) len;
+    do {
+        if (pp->end) {
+            //  Trailing data after the compressed stream is ignored
+            break;
+        }
+        pp->bz.next_out = pp->out;
+        pp->bz.avail_out = PATCH_BUFSIZE;
+        rc = BZ2_bzDecompress(&pp->bz);
+        if (rc != BZ_OK && rc != BZ_STREAM_END) {
+            fprintf(stderr, "Cannot decompress update patch\n");
+            return -1;
+        }
+        if (patchApply(pp, (uchar*) pp->out, PATCH_BUFSIZE - pp->bz.avail_out) < 0) {
+            return -1;
+        }
+        pp->end = rc == BZ_STREAM_END;
+    } while (pp->bz.avail_in > 0 || pp->bz.avail_out == 0);
+    return 0;
+}
+
+/*
+    Apply decompressed patch data. The new image is produced in the download write buffer.
+ */
+static int patchApply(Patch *pp, uchar *data, size_t len)
+{
+    Download *dp;
+    size_t   i, n;
+
+    dp = pp->dp;
+    while (len > 0) {
+        if (pp->diff == 0 && pp->extra == 0) {
+            n = min(len, sizeof(pp->ctrl) - pp->ctrlLen);
+            memcpy(&pp->ctrl[pp->ctrlLen], data, n);
+            pp->ctrlLen += n;
+            data += n;
+            len -= n;
+            if (pp->ctrlLen < sizeof(pp->ctrl)) {
+                break;
+            }
+            pp->ctrlLen = 0;
+            pp->diff = patchOffset(&pp->ctrl[0]);
+            pp->extra = patchOffset(&pp->ctrl[8]);
+            pp->seek = patchOffset(&pp->ctrl[16]);
+            if (pp->diff < 0 || pp->extra < 0 ||
+                (long long) (dp->offset + dp->fill) + pp->diff + pp->extra > pp->newSize) {
+                fprintf(stderr, "Bad update patch control\n");
+                return -1;
+            }
+            if (pp->diff == 0 && pp->extra == 0) {
+                pp->basePos += pp->seek;
+            }
+            continue;
+        }
+        n = min(len, dp->limit - dp->fill);
+        if (pp->diff) {
+            n = (size_t) min((long long) n, pp->diff);
+            if (patchBase(pp, n) < 0) {
+                return -1;
+            }
+            for (i = 0; i < n; i++) {
+                dp->buf[dp->fill + i] = data[i] + pp->base[i];
+            }
+            pp->basePos += n;
+            pp->diff -= n;
+            if (pp->diff == 0 && pp->extra == 0) {
+                pp->basePos += pp->seek;
+            }
+        } else {
+            n = (size_t) min((long long) n, pp->extra);
+            memcpy(&dp->buf[dp->fill], data, n);
+            pp->extra -= n;
+            if (pp->extra == 0) {
+                pp->basePos += pp->seek;
+            }
+        }
+        dp->fill += n;
+        data += n;
+        len -= n;
+        if (dp->fill == dp->limit && flushDownload(dp) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Read "len" bytes of the base image at the base position. Bytes outside the image are zero.
+ */
+static int patchBase(Patch *pp, size_t len)
+{
+    long long start, end;
+
+    memset(pp->base, 0, len);
+    start = pp->basePos > 0 ? pp->basePos : 0;
+    end = min(pp->basePos + (long long) len, pp->baseSize);
+    if (start < end && pread(pp->baseFd, &pp->base[start - pp->basePos], end - start, start) != end - start) {
+        fprintf(stderr, "Cannot read base image\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Decode a patch offset. Offsets are 64-bit little-endian sign and magnitude.
+ */
+static long long patchOffset(uchar *buf)
+{
+    long long value;
+    int       i;
+
+    value = buf[7] & 0x7F;
+    for (i = 6; i >= 0; i--) {
+        value = value * 256 + buf[i];
+    }
+    return (buf[7] & 0x80) ? -value : value;
+}
+
+/*
+    Compute the checksum of a file as a hex string. The file is read in download buffer sized blocks.
+ */
+static int hashFile(cchar *path, int alg, char sum[EVP_MAX_MD_SIZE * 2 + 1])
+{
+    Digest  digest;
+    char    *buf;
+    ssize_t bytes;
+    int     fd, rc;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return -1;
+    }
+    if ((buf = ualloc(DOWNLOAD_BUFSIZE)) == NULL || digestInit(&digest, alg) < 0) {
+        ufree(buf);
+        close(fd);
+        return -1;
+    }
+    rc = 0;
+    while ((bytes = read(fd, buf, DOWNLOAD_BUFSIZE)) != 0) {
+        if (bytes < 0 || digestUpdate(&digest, buf, bytes) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+    if (rc == 0) {
+        rc = digestFinal(&digest, sum);
+    } else {
+        digestFree(&digest);
+    }
+    ufree(buf);
+    close(fd);
+    return rc;
+}
+
+#endif /* ME_UPDATER_DELTA */
+
+#if ME_UPDATER_CACHE
+/*
+    Get the path of a cache entry for an image in the cache directory "dir". Checksums are hex
+    digests, which also prevents a checksum from naming a file outside the cache.
+ */
+static int cachePath(cchar *dir, cchar *checksum, cchar *ext, char *buf, size_t bufsize)
+{
+    cchar *cp;
+
+    if (!dir || !*checksum || strlen(checksum) > EVP_MAX_MD_SIZE * 2) {
+        return -1;
+    }
+    for (cp = checksum; *cp; cp++) {
+        if (!isxdigit((uchar) *cp)) {
+            return -1;
+        }
+    }
+    snprintf(buf, bufsize, "%s/%s%s", dir, checksum, ext);
+    return 0;
+}
+
+/*
+    Find the entry for an image in the cache directory "dir". The entry records the image size,
+    modification time and digest, so it is trusted without rehashing the image. The image path is
+    returned in "image". Returns 1 if the entry is valid, 0 if there is no entry and -1 if the entry
+    no longer matches its image.
+ */
+static int cacheFind(cchar *dir, cchar *checksum, char *image, size_t size)
+{
+    FILE        *file;
+    struct stat info;
+    char        meta[UBSIZE], sum[EVP_MAX_MD_SIZE * 2 + 1];
+    long long   length, mtime;
+    int         count;
+
+    if (cachePath(dir, checksum, "", image, size) < 0 || cachePath(dir, checksum, CACHE_EXT, meta, sizeof(meta)) < 0) {
+        return 0;
+    }
+    if ((file = fopen(meta, "r")) == NULL) {
+        return 0;
+    }
+    count = fscanf(file, "%lld %lld %128s", &length, &mtime, sum);
+    fclose(file);
+    if (count != 3 || strcmp(sum, checksum) != 0 || stat(image, &info) < 0 ||
+        (long long) info.st_size != length || (long long) info.st_mtime != mtime) {
+        return -1;
+    }
+    return 1;
+}
+
+/*
+    Fetch an image from the cache to "path". An entry that no longer matches its image is removed.
+    The image is linked to "path" or, if not possible, copied.
+ */
+static int cacheLookup(cchar *checksum, cchar *path)
+{
+    char image[UBSIZE], meta[UBSIZE], buf[UBSIZE];
+    int  rc;
+
+    if ((rc = cacheFind(updater->options.cache, checksum, image, sizeof(image))) <= 0) {
+        if (rc < 0 && cachePath(updater->options.cache, checksum, CACHE_EXT, meta, sizeof(meta)) == 0) {
+            printf("Removing stale cached image %s\n", image);
+            unlink(image);
+            unlink(meta);
+        }
+        return -1;
+    }
+    //  Remove any prior image or partial download so they cannot be written through the link
+    unlink(path);
+    unlink(resumePath(path, buf, sizeof(buf)));
+    if (link(image, path) < 0 && copyFile(image, path) < 0) {
+        fprintf(stderr, "Cannot copy cached image %s\n", image);
+        return -1;
+    }
+    //  The entry modification time records the last use
+    cachePath(updater->options.cache, checksum, CACHE_EXT, meta, sizeof(meta));
+    utime(meta, NULL);
+    printf("Using cached update image %s\n", image);
+    return 0;
+}
+
+/*
+    Save a verified image to the cache and evict the least recently used images over the size cap
+ */
+static void cacheSave(cchar *path, cchar *checksum)
+{
+    FILE        *file;
+    struct stat info;
+    char        image[UBSIZE], meta[UBSIZE];
+
+    if (cachePath(updater->options.cache, checksum, "", image, sizeof(image)) < 0 ||
+        cachePath(updater->options.cache, checksum, CACHE_EXT, meta, sizeof(meta)) < 0) {
+        return;
+    }
+    if (mkdir(updater->options.cache, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create image cache %s\n", updater->options.cache);
+        return;
+    }
+    unlink(meta);
+    unlink(image);
+    if ((link(path, image) < 0 && copyFile(path, image) < 0) || stat(image, &info) < 0) {
+        fprintf(stderr, "Cannot cache image %s\n", image);
+        unlink(image);
+        return;
+    }
+    if ((file = fopen(meta, "w")) == NULL) {
+        unlink(image);
+        return;
+    }
+    fprintf(file, "%lld %lld %s\n", (long long) info.st_size, (long long) info.st_mtime, checksum);
+    if (fclose(file) != 0) {
+        unlink(meta);
+        unlink(image);
+        return;
+    }
+    cachePrune(checksum);
+}
+
+/*
+    Evict the least recently used cache entries until the cache is within its size cap. The entry
+    for "keep" is retained.
+ */
+static void cachePrune(cchar *keep)
+{
+    DIR           *dir;
+    struct dirent *dp;
+    struct stat   info;
+    CacheEntry    *entries, *ep;
+    char          path[UBSIZE];
+    long long     limit, total;
+    size_t        len;
+    int           count, i, max;
+
+    if ((dir = opendir(updater->options.cache)) == NULL) {
+        return;
+    }
+    entries = NULL;
+    count = max = 0;
+    total = 0;
+    while ((dp = readdir(dir)) != NULL) {
+        len = strlen(dp->d_name);
+        if (len <= strlen(CACHE_EXT) || len - strlen(CACHE_EXT) >= sizeof(entries->checksum) ||
+            strcmp(&dp->d_name[len - strlen(CACHE_EXT)], CACHE_EXT) != 0) {
+            continue;
+        }
+        if (count == max) {
+            max = max ? max * 2 : 16;
+            if ((ep = urealloc(entries, max * sizeof(CacheEntry))) == NULL) {
+                break;
+            }
+            entries = ep;
+        }
+        ep = &entries[count];
+        snprintf(ep->checksum, sizeof(ep->checksum), "%.*s", (int) (len - strlen(CACHE_EXT)), dp->d_name);
+        snprintf(path, sizeof(path), "%s/%s", updater->options.cache, dp->d_name);
+        if (stat(path, &info) < 0) {
+            continue;
+        }
+        ep->used = info.st_mtime;
+        snprintf(path, sizeof(path), "%s/%s", updater->options.cache, ep->checksum);
+        if (stat(path, &info) < 0) {
+            continue;
+        }
+        ep->size = info.st_size;
+        total += ep->size;
+        count++;
+    }
+    closedir(dir);
+
+    limit = (long long) (updater->options.cacheSize > 0 ? updater->options.cacheSize : CACHE_SIZE) * 1024 * 1024;
+    if (total > limit) {
+        qsort(entries, count, sizeof(CacheEntry), cacheCompare);
+        for (i = 0; i < count && total > limit; i++) {
+            ep = &entries[i];
+            if (strcmp(ep->checksum, keep) == 0) {
+                continue;
+            }
+            if (updater->verbose) {
+                printf("Evicting cached image %s\n", ep->checksum);
+            }
+            snprintf(path, sizeof(path), "%s/%s%s", updater->options.cache, ep->checksum, CACHE_EXT);
+            unlink(path);
+            snprintf(path, sizeof(path), "%s/%s", updater->options.cache, ep->checksum);
+            unlink(path);
+            total -= ep->size;
+        }
+    }
+    ufree(entries);
+}
+
+/*
+    Order cache entries by last use, oldest first
+ */
+static int cacheCompare(const void *a, const void *b)
+{
+    const CacheEntry *ea, *eb;
+
+    ea = a;
+    eb = b;
+    return ea->used < eb->used ? -1 : ea->used > eb->used;
+}
+
+/*
+    Copy a file
+ */
+static int copyFile(cchar *from, cchar *to)
+{
+    char    buf[UBSIZE * 4];
+    ssize_t bytes;
+    int     in, out, rc;
+
+    if ((in = open(from, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if ((out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+        close(in);
+        return -1;
+    }
+    rc = 0;
+    while ((bytes = read(in, buf, sizeof(buf))) != 0) {
+        if (bytes < 0 || write(out, buf, bytes) != bytes) {
+            rc = -1;
+            break;
+        }
+    }
+    close(in);
+    if (close(out) < 0 || rc < 0) {
+        unlink(to);
+        return -1;
+    }
+    return 0;
+}
+
+#else
+/*
+    Without the image cache, images are always downloaded
+ */
+static int cacheLookup(cchar *checksum, cchar *path)
+{
+    return -1;
+}
+
+static void cacheSave(cchar *path, cchar *checksum)
+{
+}
+#endif /* ME_UPDATER_CACHE */
+
+#if ME_UPDATER_PEER
+/*
+    Find LAN peers with the image "checksum" in their cache. A query is sent to the peer multicast
+    group and the answers received within PEER_WAIT are returned in "pp" as "address:port" hosts.
+ */
+static int peerFind(cchar *checksum, Peers *pp)
+{
+    struct sockaddr_in addr, from;
+    struct pollfd      fds;
+    socklen_t          len;
+    long long          deadline;
+    ssize_t            bytes;
+    uchar              ttl;
+    char               buf[UBSIZE], sum[EVP_MAX_MD_SIZE * 2 + 1], host[INET_ADDRSTRLEN];
+    int                fd, i, port, wait;
+
+    memset(pp, 0, sizeof(Peers));
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        return 0;
+    }
+    //  Peers are only sought on the local network
+    ttl = 1;
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(peerPort());
+    inet_pton(AF_INET, PEER_GROUP, &addr.sin_addr);
+    snprintf(buf, sizeof(buf), "%s %s", PEER_QUERY, checksum);
+    if (sendto(fd, buf, strlen(buf), 0, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return 0;
+    }
+    deadline = ticks() + PEER_WAIT;
+    while (pp->count < PEER_MAX && (wait = (int) (deadline - ticks())) > 0) {
+        fds.fd = fd;
+        fds.events = POLLIN;
+        if (poll(&fds, 1, wait) <= 0) {
+            continue;
+        }
+        len = sizeof(from);
+        if ((bytes = recvfrom(fd, buf, sizeof(buf) - 1, 0, (struct sockaddr*) &from, &len)) <= 0) {
+            continue;
+        }
+        buf[bytes] = '\0';
+        if (strncmp(buf, PEER_ANSWER " ", sizeof(PEER_ANSWER)) != 0 ||
+            sscanf(&buf[sizeof(PEER_ANSWER)], "%128s %d", sum, &port) != 2 || strcmp(sum, checksum) != 0 ||
+            port <= 0 || port > 65535 || !inet_ntop(AF_INET, &from.sin_addr, host, sizeof(host))) {
+            continue;
+        }
+        snprintf(buf, sizeof(buf), "%s:%d", host, port);
+        for (i = 0; i < pp->count && strcmp(pp->hosts[i], buf) != 0; i++) {}
+        if (i == pp->count) {
+            snprintf(pp->hosts[pp->count++], sizeof(pp->hosts[0]), "%s", buf);
+        }
+    }
+    close(fd);
+    if (pp->count) {
+        printf("Found %d LAN peer%s with the update\n", pp->count, pp->count == 1 ? "" : "s");
+    }
+    return pp->count;
+}
+
+/*
+    Return the port for peer discovery and the peer image service
+ */
+static int peerPort(void)
+{
+    return updater->options.peerPort > 0 ? updater->options.peerPort : PEER_PORT;
+}
+
+/*
+    Start serving the images in the cache to LAN peers. Queries for an image are answered if the
+    cache has a valid entry for it, and the image is served over TLS with a self-signed certificate
+    created for the service. Peers verify images with the update checksum, so the certificate is
+    not verified. If the port is in use, images are not served. The service is process wide and
+    is owned by the first context to start it. Other contexts download from peers but do not serve.
+ */
+static int peerStart(void)
+{
+    PeerServer         *sp;
+    struct ip_mreq     group;
+    struct sockaddr_in addr;
+    int                on;
+
+    sp = &peerServer;
+    if (sp->running) {
+        if (sp->owner != updater) {
+            printf("Peer service is owned by another updater context\n");
+            return 0;
+        }
+        if (sp->port == peerPort() && strcmp(sp->cache, updater->options.cache) == 0) {
+            return 0;
+        }
+        peerStop();
+    }
+    fetchSetup();
+    if (!sp->ctx && peerContext(sp) < 0) {
+        return -1;
+    }
+    snprintf(sp->cache, sizeof(sp->cache), "%s", updater->options.cache);
+    sp->port = peerPort();
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(sp->port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    on = 1;
+    sp->udp = socket(AF_INET, SOCK_DGRAM, 0);
+    sp->listen = socket(AF_INET, SOCK_STREAM, 0);
+    if (sp->udp < 0 || sp->listen < 0 ||
+        setsockopt(sp->udp, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        setsockopt(sp->listen, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        bind(sp->udp, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        bind(sp->listen, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(sp->listen, PEER_CLIENTS) < 0) {
+        fprintf(stderr, "Cannot serve updates to peers on port %d\n", sp->port);
+        peerClose(sp);
+        return 0;
+    }
+    inet_pton(AF_INET, PEER_GROUP, &group.imr_multiaddr);
+    group.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(sp->udp, IPPROTO_IP, IP_ADD_MEMBERSHIP, &group, sizeof(group)) < 0) {
+        fprintf(stderr, "Cannot join the peer group %s\n", PEER_GROUP);
+        peerClose(sp);
+        return 0;
+    }
+    sp->stop = 0;
+    sp->owner = updater;
+    if (pthread_create(&sp->thread, NULL, peerServe, sp) != 0) {
+        fprintf(stderr, "Cannot create peer thread\n");
+        sp->owner = NULL;
+        peerClose(sp);
+        return -1;
+    }
+    sp->running = 1;
+    return 0;
+}
+
+/*
+    Stop serving images to peers. Transfers in progress are completed before returning as the
+    connection threads use the owner's context and the TLS context.
+ */
+static void peerStop(void)
+{
+    PeerServer *sp;
+
+    sp = &peerServer;
+    if (sp->running) {
+        sp->stop = 1;
+        pthread_join(sp->thread, NULL);
+        sp->running = 0;
+    }
+    while (atomic_load(&sp->clients) > 0) {
+        poll(NULL, 0, 10);
+    }
+    sp->owner = NULL;
+    peerClose(sp);
+    SSL_CTX_free(sp->ctx);
+    sp->ctx = NULL;
+}
+
+static void peerClose(PeerServer *sp)
+{
+    if (sp->udp >= 0) {
+        close(sp->udp);
+    }
+    if (sp->listen >= 0) {
+        close(sp->listen);
+    }
+    sp->udp = sp->listen = -1;
+}
+
+/*
+    Create the TLS context for the peer image service with a self-signed certificate
+ */
+static int peerContext(PeerServer *sp)
+{
+    EVP_PKEY  *key;
+    X509      *cert;
+    X509_NAME *name;
+    int       rc;
+
+    if ((key = EVP_EC_gen("P-256")) == NULL) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    if ((cert = X509_new()) == NULL) {
+        EVP_PKEY_free(key);
+        return -1;
+    }
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), (long) 3650 * 24 * 3600);
+    X509_set_pubkey(cert, key);
+    name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (uchar*) "updater-peer", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    rc = -1;
+    if (X509_sign(cert, key, EVP_sha256()) != 0 && (sp->ctx = SSL_CTX_new(TLS_server_method())) != NULL) {
+        if (SSL_CTX_use_certificate(sp->ctx, cert) == 1 && SSL_CTX_use_PrivateKey(sp->ctx, key) == 1) {
+            rc = 0;
+        } else {
+            SSL_CTX_free(sp->ctx);
+            sp->ctx = NULL;
+        }
+    }
+    if (rc < 0) {
+        ERR_print_errors_fp(stderr);
+    }
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return rc;
+}
+
+/*
+    Answer peer queries and accept image connections until stopped. Each connection is served by
+    its own thread, up to PEER_CLIENTS at a time. Further connections are refused so the peer
+    tries elsewhere.
+ */
+static void *peerServe(void *arg)
+{
+    PeerServer         *sp;
+    PeerClient         *cp;
+    struct pollfd      fds[2];
+    struct sockaddr_in from;
+    socklen_t          len;
+    pthread_t          thread;
+    ssize_t            bytes;
+    char               buf[UBSIZE], image[UBSIZE], sum[EVP_MAX_MD_SIZE * 2 + 1];
+    int                fd;
+
+    sp = arg;
+    updater = sp->owner;
+    while (!sp->stop) {
+        fds[0].fd = sp->udp;
+        fds[1].fd = sp->listen;
+        fds[0].events = fds[1].events = POLLIN;
+        //  Wake periodically to check for a stop request
+        if (poll(fds, 2, PEER_WAIT) <= 0) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            len = sizeof(from);
+            if ((bytes = recvfrom(sp->udp, buf, sizeof(buf) - 1, 0, (struct sockaddr*) &from, &len)) > 0) {
+                buf[bytes] = '\0';
+                if (strncmp(buf, PEER_QUERY " ", sizeof(PEER_QUERY)) == 0 &&
+                    sscanf(&buf[sizeof(PEER_QUERY)], "%128s", sum) == 1 &&
+                    cacheFind(sp->cache, sum, image, sizeof(image)) == 1) {
+                    snprintf(buf, sizeof(buf), "%s %s %d", PEER_ANSWER, sum, sp->port);
+                    sendto(sp->udp, buf, strlen(buf), 0, (struct sockaddr*) &from, len);
+                }
+            }
+        }
+        if ((fds[1].revents & POLLIN) && (fd = accept(sp->listen, NULL, NULL)) >= 0) {
+            if (atomic_load(&sp->clients) >= PEER_CLIENTS || (cp = ualloc(sizeof(PeerClient))) == NULL) {
+                close(fd);
+                continue;
+            }
+            cp->server = sp;
+            cp->fd = fd;
+            snprintf(cp->cache, sizeof(cp->cache), "%s", sp->cache);
+            atomic_fetch_add(&sp->clients, 1);
+            if (pthread_create(&thread, NULL, peerClient, cp) != 0) {
+                atomic_fetch_sub(&sp->clients, 1);
+                close(fd);
+                ufree(cp);
+                continue;
+            }
+            pthread_detach(thread);
+        }
+    }
+    return NULL;
+}
+
+/*
+    Serve an image request from a peer. The request is "GET /checksum" with an optional range.
+    The connection is closed after the response.
+ */
+static void *peerClient(void *arg)
+{
+    PeerServer *sp;
+    PeerClient *cp;
+    SSL        *ssl;
+    char       *buf;
+    size_t     len;
+    int        bytes;
+
+    cp = arg;
+    updater = cp->server->owner;
+    buf = NULL;
+    timeoutSocket(cp->fd, timeoutRead());
+    if ((ssl = SSL_new(cp->server->ctx)) != NULL) {
+        SSL_set_fd(ssl, cp->fd);
+        if (SSL_accept(ssl) == 1 && (buf = ualloc(PEER_BUFSIZE)) != NULL) {
+            for (len = 0; len < UBSIZE - 1; len += bytes) {
+                if ((bytes = SSL_read(ssl, &buf[len], (int) (UBSIZE - 1 - len))) <= 0) {
+                    break;
+                }
+                buf[len + bytes] = '\0';
+                if (strstr(buf, "\r\n\r\n")) {
+                    peerReply(cp, ssl, buf);
+                    break;
+                }
+            }
+        }
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+    }
+    ufree(buf);
+    close(cp->fd);
+    sp = cp->server;
+    ufree(cp);
+    //  Last, as peerStop may then free the owner context
+    atomic_fetch_sub(&sp->clients, 1);
+    return NULL;
+}
+
+/*
+    Send the response to a peer image request in "buf". The buffer is reused to send the image.
+ */
+static int peerReply(PeerClient *cp, SSL *ssl, char *buf)
+{
+    struct stat info;
+    char        image[UBSIZE], sum[EVP_MAX_MD_SIZE * 2 + 1], *range;
+    long long   end, start;
+    ssize_t     bytes;
+    size_t      pos;
+    int         fd;
+
+    if (sscanf(buf, "GET /%128[0-9a-fA-F] HTTP/1.1", sum) != 1 ||
+        cacheFind(cp->cache, sum, image, sizeof(image)) != 1 || (fd = open(image, O_RDONLY)) < 0) {
+        return peerStatus(ssl, "404 Not Found");
+    }
+    if (fstat(fd, &info) < 0) {
+        close(fd);
+        return peerStatus(ssl, "404 Not Found");
+    }
+    start = 0;
+    end = (long long) info.st_size - 1;
+    if ((range = strstr(buf, "\r\nRange: bytes=")) != NULL) {
+        range += 15;
+        start = strtoll(range, &range, 10);
+        if (*range == '-' && isdigit((uchar) range[1])) {
+            end = min(end, strtoll(&range[1], NULL, 10));
+        }
+        if (start < 0 || start > end) {
+            close(fd);
+            return peerStatus(ssl, "416 Range Not Satisfiable");
+        }
+        snprintf(buf, PEER_BUFSIZE, "HTTP/1.1 206 Partial Content\r\nContent-Length: %lld\r\n"
+                 "Content-Range: bytes %lld-%lld/%lld\r\nConnection: close\r\n\r\n",
+                 end - start + 1, start, end, (long long) info.st_size);
+    } else {
+        snprintf(buf, PEER_BUFSIZE, "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\nConnection: close\r\n\r\n",
+                 (long long) info.st_size);
+    }
+    if (SSL_write(ssl, buf, (int) strlen(buf)) <= 0) {
+        close(fd);
+        return -1;
+    }
+    for (pos = (size_t) start; pos <= (size_t) end; pos += bytes) {
+        if ((bytes = pread(fd, buf, (size_t) min(PEER_BUFSIZE, end + 1 - (long long) pos), pos)) <= 0 ||
+            SSL_write(ssl, buf, (int) bytes) <= 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static int peerStatus(SSL *ssl, cchar *status)
+{
+    char buf[128];
+
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+    return SSL_write(ssl, buf, (int) strlen(buf)) > 0 ? 0 : -1;
+}
+#endif /* ME_UPDATER_PEER */
+
+#if ME_UPDATER_PARALLEL
+/*
+    Download the remainder of the image using parallel range requests, each on its own connection
+    and thread, written at its offset into a preallocated file. While the workers run, the image
+    digest is computed over the contiguous range of bytes completed so far. With a block manifest,
+    ranges end on block boundaries and each worker verifies its blocks as they are received.
+    On failure, the download offset is set to the end of the contiguous range so the download can
+    be resumed.
+ */
+static int downloadRanges(cchar *url, Download *dp)
+{
+    Fetch     *fp;
+    Range     *ranges, *rp;
+    char      headers[256], *header, *cp;
+    size_t    base, block, pos, size, start, total, avail;
+    ssize_t   bytes;
+    long long begin;
+    int       count, i, started;
+
+    /*
+        Probe for range support and the total image size
+     */
+    snprintf(headers, sizeof(headers), "Accept: */*\r\nRange: bytes=%lld-%lld\r\n%s%s%s",
+             (long long) dp->offset, (long long) dp->offset,
+             dp->etag[0] ? "If-Range: " : "", dp->etag, dp->etag[0] ? "\r\n" : "");
+    if ((fp = fetch("GET", (char*) url, headers, NULL)) == NULL) {
+        return -1;
+    }
+    start = total = 0;
+    if (fp->status == 206 && (header = fetchHeader(fp, "Content-Range")) != NULL) {
+        //  Content-Range: bytes start-end/total
+        start = (size_t) strtoll(&header[strcspn(header, "0123456789")], NULL, 10);
+        if ((cp = strchr(header, '/')) != NULL) {
+            total = (size_t) strtoll(&cp[1], NULL, 10);
+        }
+        ufree(header);
+    }
+    if ((header = fetchHeader(fp, "ETag")) != NULL) {
+        snprintf(dp->etag, sizeof(dp->etag), "%s", header);
+        ufree(header);
+    }
+    if (fp->status == 206) {
+        ufree(fetchString(fp));
+    }
+    fetchFree(fp);
+
+    if (start != dp->offset || total <= dp->offset) {
+        return -1;
+    }
+    block = dp->manifest->blockSize ? dp->manifest->blockSize : 1;
+    if (dp->manifest->blockSize && (total + block - 1) / block != dp->manifest->blockCount) {
+        fprintf(stderr, "Image size does not match the block manifest\n");
+        return -1;
+    }
+    count = (int) min((size_t) updater->options.parallel, (total - dp->offset) / RANGE_MIN);
+    base = dp->offset - dp->offset % block;
+    if (count < 2 || (size = (total - base) / count / block * block) == 0) {
+        return -1;
+    }
+#if __linux__
+    if (posix_fallocate(dp->fd, 0, total) != 0) {
+        fprintf(stderr, "Cannot allocate %lld bytes for the image\n", (long long) total);
+        return -1;
+    }
+#else
+    if (ftruncate(dp->fd, total) < 0) {
+        fprintf(stderr, "Cannot allocate %lld bytes for the image\n", (long long) total);
+        return -1;
+    }
+#endif
+    if ((ranges = ucalloc(count, sizeof(Range))) == NULL) {
+        return -1;
+    }
+    printf("Downloading update to %s using %d connections\n", dp->path, count);
+    begin = uticks();
+    pthread_mutex_init(&dp->lock, NULL);
+    pthread_cond_init(&dp->cond, NULL);
+    atomic_store(&dp->abort, 0);
+
+    for (started = 0; started < count; started++) {
+        rp = &ranges[started];
+        rp->dp = dp;
+        rp->url = url;
+        rp->start = started ? base + started * size : dp->offset;
+        rp->end = (started == count - 1) ? total : base + (started + 1) * size;
+        if (pthread_create(&rp->thread, NULL, rangeWorker, rp) != 0) {
+            break;
+        }
+    }
+    /*
+        Digest each range in order as it is written. The bytes are read back from the page cache.
+     */
+    pos = dp->offset;
+    for (i = 0; i < started; i++) {
+        rp = &ranges[i];
+        while (pos < rp->end) {
+            pthread_mutex_lock(&dp->lock);
+            while (rp->start + rp->written <= pos && !rp->done) {
+                pthread_cond_wait(&dp->cond, &dp->lock);
+            }
+            avail = rp->start + rp->written;
+            pthread_mutex_unlock(&dp->lock);
+            if (avail <= pos) {
+                break;
+            }
+            for (; pos < avail; pos += bytes) {
+                if ((bytes = pread(dp->fd, dp->buf, min(dp->bufsize, avail - pos), pos)) <= 0 ||
+                    digestUpdate(&dp->digest, dp->buf, bytes) < 0) {
+                    break;
+                }
+            }
+            if (pos < avail) {
+                break;
+            }
+        }
+        if (pos < rp->end) {
+            break;
+        }
+    }
+    pthread_mutex_lock(&dp->lock);
+    atomic_store(&dp->abort, 1);
+    pthread_mutex_unlock(&dp->lock);
+
+    for (i = 0; i < started; i++) {
+        pthread_join(ranges[i].thread, NULL);
+    }
+    pthread_cond_destroy(&dp->cond);
+    pthread_mutex_destroy(&dp->lock);
+    ufree(ranges);
+    metricsAdd(&updater->metrics.transfer, uticks() - begin);
+
+    dp->offset = pos;
+    if (pos < total) {
+        printf("Parallel download incomplete at %d bytes\n", (int) pos);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Parallel download worker. Fetch one range of the image, resuming the range if interrupted.
+    With a block manifest, the range progress is advanced as each block verifies and a block that
+    does not verify is fetched again.
+ */
+static void *rangeWorker(void *arg)
+{
+    Range    *rp;
+    Download *dp;
+    Fetch    *fp;
+    Digest   block;
+    char     *buf, headers[256], *range;
+    size_t   offset, pos, start;
+    ssize_t  bytes;
+    int      attempt;
+
+    rp = arg;
+    dp = rp->dp;
+    updater = dp->updater;
+    memset(&block, 0, sizeof(Digest));
+    block.fd = -1;
+    if ((buf = ualloc(dp->bufsize)) == NULL) {
+        pthread_mutex_lock(&dp->lock);
+        rp->done = 1;
+        pthread_cond_broadcast(&dp->cond);
+        pthread_mutex_unlock(&dp->lock);
+        return NULL;
+    }
+    for (attempt = 0; attempt <= retryCount() && rp->start + rp->written < rp->end; attempt++) {
+        if (atomic_load(&dp->abort)) {
+            break;
+        }
+        if (attempt > 0) {
+            retryWait(attempt - 1);
+            metricsAdd(&updater->metrics.retries, 1);
+        }
+        offset = rp->start + rp->written;
+        snprintf(headers, sizeof(headers), "Accept: */*\r\nRange: bytes=%lld-%lld\r\n%s%s%s",
+                 (long long) offset, (long long) rp->end - 1,
+                 dp->etag[0] ? "If-Range: " : "", dp->etag, dp->etag[0] ? "\r\n" : "");
+        if ((fp = fetch("GET", (char*) rp->url, headers, NULL)) == NULL) {
+            continue;
+        }
+        start = (size_t) -1;
+        if (fp->status == 206 && (range = fetchHeader(fp, "Content-Range")) != NULL) {
+            start = (size_t) strtoll(&range[strcspn(range, "0123456789")], NULL, 10);
+            ufree(range);
+        }
+        if (start != offset || (fp->framing == FRAME_LENGTH && fp->contentLength != rp->end - offset)) {
+            //  The image has changed or the server is not honoring the range
+            fetchFree(fp);
+            break;
+        }
+        pos = offset;
+        if (dp->manifest->blockSize) {
+            //  Hash the start of a partial block saved before the range
+            for (pos = offset - offset % dp->manifest->blockSize; pos < offset; pos += bytes) {
+                if ((bytes = pread(dp->fd, buf, min(dp->bufsize, offset - pos), pos)) <= 0 ||
+                    rangeBlocks(rp, &block, buf, bytes, pos) < 0) {
+                    break;
+                }
+            }
+            if (pos < offset) {
+                fetchFree(fp);
+                break;
+            }
+        }
+        while (pos < rp->end && !atomic_load(&dp->abort)) {
+            if ((bytes = fetchBody(fp, buf, shapeWait(fp, min(dp->bufsize, rp->end - pos)))) <= 0) {
+                break;
+            }
+            shapeUsed(bytes);
+            metricsAdd(&updater->metrics.writes, 1);
+            if (pwrite(dp->fd, buf, bytes, pos) != bytes) {
+                fprintf(stderr, "Cannot save response");
+                atomic_store(&dp->abort, 1);
+                break;
+            }
+            if (dp->manifest->blockSize) {
+                if (rangeBlocks(rp, &block, buf, bytes, pos) < 0) {
+                    break;
+                }
+            } else {
+                pthread_mutex_lock(&dp->lock);
+                rp->written += bytes;
+                pthread_cond_broadcast(&dp->cond);
+                pthread_mutex_unlock(&dp->lock);
+            }
+            pos += bytes;
+        }
+        fetchFree(fp);
+    }
+    digestFree(&block);
+    ufree(buf);
+    pthread_mutex_lock(&dp->lock);
+    rp->done = 1;
+    pthread_cond_broadcast(&dp->cond);
+    pthread_mutex_unlock(&dp->lock);
+    return NULL;
+}
+
+/*
+    Add "len" bytes of a range at "offset" to the digest of the current block. The range progress
+    is advanced as each block completes and verifies. Returns -1 if a block does not verify.
+ */
+static int rangeBlocks(Range *rp, Digest *dg, cchar *buf, size_t len, size_t offset)
+{
+    Download *dp;
+    Manifest *mp;
+    size_t   at, bytes, end, pos;
+
+    dp = rp->dp;
+    mp = dp->manifest;
+    for (pos = 0; pos < len; pos += bytes) {
+        at = offset + pos;
+        if (at % mp->blockSize == 0) {
+            digestFree(dg);
+            if (digestInit(dg, DIGEST_SHA256) < 0) {
+                return -1;
+            }
+        }
+        bytes = min(len - pos, mp->blockSize - at % mp->blockSize);
+        if (digestUpdate(dg, &buf[pos], bytes) < 0) {
+            return -1;
+        }
+        //  Ranges end on a block boundary or at the end of the image
+        end = at + bytes;
+        if (end % mp->blockSize == 0 || end == rp->end) {
+            if (blockVerify(mp, dg, at / mp->blockSize) < 0) {
+                return -1;
+            }
+            pthread_mutex_lock(&dp->lock);
+            rp->written = end - rp->start;
+            pthread_cond_broadcast(&dp->cond);
+            pthread_mutex_unlock(&dp->lock);
+        }
+    }
+    return 0;
+}
+#endif /* ME_UPDATER_PARALLEL */
+
+/*
+    Return a response body to the download file. Data is read directly into the aligned write
+    buffer which is flushed in whole blocks. The resume sidecar is checkpointed periodically.
+ */
+static int fetchFile(Fetch *fp, Download *dp)
+{
+    ssize_t   bytes;
+    size_t    room;
+    long long start;
+    char      *buf;
+    int       rc, splice;
+
+    start = uticks();
+    if (downloadBody(fp, dp) < 0) {
+        return -1;
+    }
+    /*
+        Read until the end of the body. Each full buffer is added to the digest and written
+        before reading more.
+     */
+    splice = downloadSpliceable(fp, dp);
+    while (!fp->complete) {
+        buf = downloadInput(fp, dp, &room);
+        room = shapeWait(fp, room);
+        if (splice && (bytes = downloadSplice(fp, dp, room)) != UPDATE_WANT_COPY) {
+            if (bytes <= 0) {
+                if (bytes < 0) {
+                    return -1;
+                }
+                break;
+            }
+            shapeUsed(bytes);
+            continue;
+        }
+        if ((bytes = fetchBody(fp, buf, room)) <= 0) {
+            break;
+        }
+        shapeUsed(bytes);
+        if (downloadData(fp, dp, bytes) < 0) {
+            return -1;
+        }
+    }
+    rc = downloadEnd(fp, dp);
+    metricsAdd(&updater->metrics.transfer, uticks() - start);
+    return rc;
+}
+
+/*
+    Start receiving a response body into the write buffer
+ */
+static int downloadBody(Fetch *fp, Download *dp)
+{
+    printf("Downloading update to %s\n", dp->stream ? "apply script" : dp->path);
+    dp->fill = 0;
+    dp->limit = dp->bufsize - (dp->offset % DOWNLOAD_ALIGN);
+    dp->dropped = dp->offset;
+    dp->received = 0;
+    return 0;
+}
+
+/*
+    Return the buffer to read response data into and the number of bytes that can be read.
+    Uncompressed data is read directly into the write buffer.
+ */
+static char *downloadInput(Fetch *fp, Download *dp, size_t *room)
+{
+    char *buf;
+
+#if ME_UPDATER_COMPRESS
+    if (dp->decoder) {
+        buf = dp->decoder->in;
+        *room = sizeof(dp->decoder->in);
+    } else
+#endif
+    {
+        buf = &dp->buf[dp->fill];
+        *room = dp->limit - dp->fill;
+    }
+    return buf;
+}
+
+/*
+    Account for "bytes" read into the buffer from downloadInput. Compressed data is decoded into
+    the write buffer. A full buffer is flushed to the image.
+ */
+static int downloadData(Fetch *fp, Download *dp, size_t bytes)
+{
+    dp->received += bytes;
+#if ME_UPDATER_COMPRESS
+    if (dp->decoder) {
+        if (decodeData(dp, dp->decoder->in, bytes) < 0) {
+            return -1;
+        }
+    } else
+#endif
+    {
+        dp->fill += bytes;
+        if (dp->fill == dp->limit && flushDownload(dp) < 0) {
+            return -1;
+        }
+    }
+    downloadCheckpoint(fp, dp);
+    return 0;
+}
+
+/*
+    Checkpoint the download progress in the resume sidecar periodically
+ */
+static void downloadCheckpoint(Fetch *fp, Download *dp)
+{
+#if ME_UPDATER_RESUME
+    if (!dp->stream && !dp->patch && (dp->offset - dp->saved) >= RESUME_INTERVAL &&
+        !fp->complete) {
+        saveResume(dp);
+    }
+#endif
+}
+
+/*
+    Test if a response body can be received directly into the image file. This requires kernel TLS
+    and a transport that can receive into a file. The body must be saved unmodified, so compressed,
+    chunked, patched, streamed and pipelined downloads read the body through the write buffer.
+ */
+static int downloadSpliceable(Fetch *fp, Download *dp)
+{
+    if (!updater->options.ktls || !fp->transport->recvFile || fp->framing != FRAME_LENGTH) {
+        return 0;
+    }
+    if (dp->stream || dp->patch || updater->options.direct || updater->options.dropCache) {
+        return 0;
+    }
+#if ME_UPDATER_COMPRESS
+    if (dp->decoder) {
+        return 0;
+    }
+#endif
+#if ME_UPDATER_PIPELINE
+    if (dp->pipeline) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+/*
+    Receive up to "room" bytes of the response body directly into the image file. The data is then
+    digested from the page cache. Returns the bytes received, 0 if the connection is closed, -1 on
+    errors or UPDATE_WANT_COPY if the data must be read through the write buffer.
+ */
+static ssize_t downloadSplice(Fetch *fp, Download *dp, size_t room)
+{
+    ssize_t bytes;
+
+    if (dp->fill || fp->rxStart < fp->rxEnd) {
+        return UPDATE_WANT_COPY;
+    }
+    if ((bytes = fetchReadFile(fp, dp->fd, dp->offset, fetchWant(fp, min(room, dp->bufsize)))) <= 0) {
+        return bytes;
+    }
+    metricsAdd(&updater->metrics.writes, 1);
+    if (pread(dp->fd, dp->buf, (size_t) bytes, dp->offset) != bytes) {
+        fprintf(stderr, "Cannot read response from %s\n", dp->path);
+        return -1;
+    }
+    if (fetchFrame(fp, dp->buf, (size_t) bytes) < 0 || downloadDigest(dp, dp->buf, (size_t) bytes, dp->offset) < 0) {
+        return -1;
+    }
+    dp->received += bytes;
+    dp->offset += bytes;
+    dp->limit = dp->bufsize - (dp->offset % DOWNLOAD_ALIGN);
+    downloadCheckpoint(fp, dp);
+    return bytes;
+}
+
+/*
+    Finish receiving a response body. Returns -1 if the body is incomplete.
+ */
+static int downloadEnd(Fetch *fp, Download *dp)
+{
+    //  Save the remainder, including any partial data before an interruption
+    if (flushDownload(dp) < 0 || pipeDrain(dp) < 0) {
+        return -1;
+    }
+    if (!fp->complete) {
+        fprintf(stderr, "Incomplete download, received %d bytes\n", (int) dp->received);
+        return -1;
+    }
+#if ME_UPDATER_COMPRESS
+    if (dp->decoder && !dp->decoder->end) {
+        fprintf(stderr, "Incomplete compressed download\n");
+        return -1;
+    }
+#endif
+    return downloadBlocks(dp);
+}
+
+/*
+    Wait until response data may be received and return the number of bytes that may be read, up
+    to "room". Downloads are held while paused by the application or outside the download window.
+    With a rate limit, data is received at the shaped rate from a token bucket shared by all the
+    download connections. The bytes read are charged to the bucket by shapeUsed.
+ */
+static size_t shapeWait(Fetch *fp, size_t room)
+{
+    Shaper    *sp;
+    long long now;
+    double    burst;
+    int       delay, notified;
+
+    sp = &updater->shaper;
+    for (notified = 0; (delay = shapeWindow()) > 0 || shapePaused; notified = 1) {
+        if (!notified) {
+            if (shapePaused) {
+                printf("Download paused\n");
+            } else {
+                printf("Waiting %d minutes for the download window\n", (delay + 59) / 60);
+            }
+            fflush(stdout);
+        }
+        //  Poll so a resume from a signal handler is seen promptly
+        sleep(1);
+    }
+    if (!updater->options.rate && !updater->options.adaptive) {
+        return room;
+    }
+    pthread_mutex_lock(&sp->lock);
+    now = ticks();
+    if (sp->rate == 0) {
+        sp->rate = updater->options.rate ? updater->options.rate * 1024.0 : SHAPE_START;
+        sp->tokens = 0;
+        sp->last = sp->sample = now;
+        sp->baseRtt = 0;
+    }
+    if (updater->options.adaptive && fp && now - sp->sample >= SHAPE_SAMPLE) {
+        shapeAdapt(sp, fp->fd, now);
+    }
+    //  Allow bursts of up to 100 msec of data
+    burst = max(sp->rate / 10, SHAPE_BLOCK);
+    while (1) {
+        sp->tokens = min(sp->tokens + (now - sp->last) * sp->rate / 1000, burst);
+        sp->last = now;
+        if (sp->tokens > 0) {
+            break;
+        }
+        sp->limited = 1;
+        delay = (int) (-sp->tokens * 1000 / sp->rate) + 1;
+        pthread_mutex_unlock(&sp->lock);
+        usleep(delay * 1000);
+        pthread_mutex_lock(&sp->lock);
+        now = ticks();
+    }
+    room = min(room, (size_t) burst);
+    pthread_mutex_unlock(&sp->lock);
+    return room;
+}
+
+/*
+    Charge received bytes to the rate limit bucket. The bucket may go into debt which is repaid
+    before more data is received.
+ */
+static void shapeUsed(size_t bytes)
+{
+    if (updater->options.rate || updater->options.adaptive) {
+        pthread_mutex_lock(&updater->shaper.lock);
+        updater->shaper.tokens -= bytes;
+        pthread_mutex_unlock(&updater->shaper.lock);
+    }
+}
+
+/*
+    Adapt the download rate to the network queuing delay (LEDBAT, RFC 6817). The delay is the
+    connection round trip time less the lowest round trip time observed. The rate grows while the
+    delay is below the target, and falls as the delay exceeds it, so the download yields to other
+    traffic sharing the link. The rate is bounded by any configured rate limit. Round trip times
+    are sampled from the kernel TCP state, so this is only supported where TCP_INFO is available.
+ */
+static void shapeAdapt(Shaper *sp, int fd, long long now)
+{
+#if defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t       len;
+    double          delay, offTarget, rtt;
+
+    len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 || info.tcpi_rtt == 0) {
+        return;
+    }
+    rtt = info.tcpi_rtt / 1000.0;
+    if (sp->baseRtt == 0 || rtt < sp->baseRtt || now - sp->baseTime > SHAPE_BASE_PERIOD) {
+        //  The base delay is refreshed periodically in case the route has changed
+        sp->baseRtt = rtt;
+        sp->baseTime = now;
+    }
+    delay = rtt - sp->baseRtt;
+    offTarget = (SHAPE_TARGET - delay) / SHAPE_TARGET;
+    offTarget = max(min(offTarget, 1.0), -1.0);
+    if (offTarget < 0 || sp->limited) {
+        //  Only grow the rate if the download is being held back by it
+        sp->rate += sp->rate * SHAPE_GAIN * offTarget;
+    }
+    sp->rate = max(sp->rate, SHAPE_MIN);
+    if (updater->options.rate) {
+        sp->rate = min(sp->rate, updater->options.rate * 1024.0);
+    }
+    if (updater->verbose) {
+        printf("Download delay %.1f msec, rate %d KB/sec\n", delay, (int) (sp->rate / 1024));
+    }
+#endif
+    sp->limited = 0;
+    sp->sample = now;
+}
+
+/*
+    Return the seconds until the download window opens. Returns zero if there is no window or it is
+    open now.
+ */
+static int shapeWindow(void)
+{
+    struct tm tm;
+    time_t    now;
+    int       end, minute, start;
+
+    if (updater->shaper.windowStart < 0) {
+        return 0;
+    }
+    now = time(NULL);
+    localtime_r(&now, &tm);
+    minute = tm.tm_hour * 60 + tm.tm_min;
+    start = updater->shaper.windowStart;
+    end = updater->shaper.windowEnd;
+    //  The window may span midnight
+    if (start == end || (start < end && minute >= start && minute < end) ||
+        (start > end && (minute >= start || minute < end))) {
+        return 0;
+    }
+    return (start - minute + 24 * 60) % (24 * 60) * 60 - tm.tm_sec;
+}
+
+#if ME_UPDATER_COMPRESS
+/*
+    Create a decoder for a compressed response. Decoders run in bounded memory.
+ */
+static int decodeOpen(Download *dp, cchar *encoding)
+{
+    Decoder *dc;
+
+    if ((dc = ualloc(sizeof(Decoder))) == NULL) {
+        return -1;
+    }
+    memset(dc, 0, sizeof(Decoder));
+    if (strcasecmp(encoding, "gzip") == 0) {
+        dc->encoding = DECODE_GZIP;
+        dc->zs.zalloc = zAlloc;
+        dc->zs.zfree = zFree;
+        //  Accept the gzip wrapper
+        if (inflateInit2(&dc->zs, 16 + MAX_WBITS) != Z_OK) {
+            ufree(dc);
+            return -1;
+        }
+#if HAS_ZSTD
+    } else if (strcasecmp(encoding, "zstd") == 0) {
+        dc->encoding = DECODE_ZSTD;
+        if ((dc->zds = ZSTD_createDStream()) == NULL) {
+            ufree(dc);
+            return -1;
+        }
+        ZSTD_DCtx_setParameter(dc->zds, ZSTD_d_windowLogMax, DECODE_WINDOW_LOG);
+#endif
+    } else {
+        fprintf(stderr, "Unsupported content encoding %s\n", encoding);
+        ufree(dc);
+        return -1;
+    }
+    dp->decoder = dc;
+    return 0;
+}
+
+static void decodeFree(Download *dp)
+{
+    Decoder *dc;
+
+    if ((dc = dp->decoder) == NULL) {
+        return;
+    }
+    if (dc->encoding == DECODE_GZIP) {
+        inflateEnd(&dc->zs);
+#if HAS_ZSTD
+    } else if (dc->encoding == DECODE_ZSTD) {
+        ZSTD_freeDStream(dc->zds);
+#endif
+    }
+    ufree(dc);
+    dp->decoder = NULL;
+}
+
+/*
+    Decode compressed response data into the write buffer, flushing each full buffer
+ */
+static int decodeData(Download *dp, char *data, size_t len)
+{
+    Decoder *dc;
+    int     rc;
+
+    dc = dp->decoder;
+    if (dc->encoding == DECODE_GZIP) {
+        dc->zs.next_in = (uchar*) data;
+        dc->zs.avail_in = (uint) len;
+        while (!dc->end) {
+            dc->zs.next_out = (uchar*) &dp->buf[dp->fill];
+            dc->zs.avail_out = (uint) (dp->limit - dp->fill);
+            rc = inflate(&dc->zs, Z_NO_FLUSH);
+            if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+                fprintf(stderr, "Cannot decompress download\n");
+                return -1;
+            }
+            dc->end = rc == Z_STREAM_END;
+            dp->fill = dp->limit - dc->zs.avail_out;
+            if (dp->fill == dp->limit) {
+                if (flushDownload(dp) < 0) {
+                    return -1;
+                }
+            } else if (dc->zs.avail_in == 0) {
+                break;
+            }
+        }
+#if HAS_ZSTD
+    } else if (dc->encoding == DECODE_ZSTD) {
+        ZSTD_inBuffer  in = { data, len, 0 };
+        ZSTD_outBuffer out;
+        size_t         result;
+
+        while (1) {
+            out.dst = &dp->buf[dp->fill];
+            out.size = dp->limit - dp->fill;
+            out.pos = 0;
+            result = ZSTD_decompressStream(dc->zds, &out, &in);
+            if (ZSTD_isError(result)) {
+                fprintf(stderr, "Cannot decompress download: %s\n", ZSTD_getErrorName(result));
+                return -1;
+            }
+            //  A zero result means a frame is complete. Further frames may follow.
+            dc->end = result == 0;
+            dp->fill += out.pos;
+            if (dp->fill == dp->limit) {
+                if (flushDownload(dp) < 0) {
+                    return -1;
+                }
+            } else if (in.pos == in.size) {
+                break;
+            }
+        }
+#endif
+    }
+    return 0;
+}
+#endif /* ME_UPDATER_COMPRESS */
+
+/*
+    Add the buffered download data to the digest and write it to the image file. With a pipeline,
+    the buffer is queued for the hash and write stages and an empty buffer taken in exchange.
+ */
+static int flushDownload(Download *dp)
+{
+    if (dp->fill == 0) {
+        return 0;
+    }
+#if ME_UPDATER_PIPELINE
+    if (dp->pipeline) {
+        if (pipeSubmit(dp) < 0) {
+            return -1;
+        }
+    } else
+#endif
+    {
+        if (downloadDigest(dp, dp->buf, dp->fill, dp->offset) < 0) {
+            return -1;
+        }
+        if (downloadWrite(dp, dp->buf, dp->fill, dp->offset) < 0) {
+            return -1;
+        }
+    }
+    dp->offset += dp->fill;
+    dp->fill = 0;
+    dp->limit = dp->stream ? dp->bufsize : dp->bufsize - (dp->offset % DOWNLOAD_ALIGN);
+    return 0;
+}
+
+/*
+    Write "len" bytes of the image at "offset" to the image file or apply script. With direct I/O,
+    aligned blocks bypass the page cache. Otherwise, written data may optionally be released from
+    the page cache so the image does not displace the application working set.
+ */
+static int downloadWrite(Download *dp, char *buf, size_t len, size_t offset)
+{
+    ssize_t bytes;
+    size_t  start;
+
+    if (dp->stream) {
+        for (start = 0; start < len; start += bytes) {
+            metricsAdd(&updater->metrics.writes, 1);
+            if ((bytes = write(dp->fd, &buf[start], len - start)) < 0) {
+                if (errno == EINTR) {
+                    bytes = 0;
+                    continue;
+                }
+                fprintf(stderr, "Cannot stream update to the apply script\n");
+                return -1;
+            }
+        }
+        return 0;
+    }
+#if defined(O_DIRECT)
+    if (updater->options.direct) {
+        int direct = (offset % DOWNLOAD_ALIGN) == 0 && (len % DOWNLOAD_ALIGN) == 0;
+        if (direct != dp->direct) {
+            //  The final partial block must be written through the page cache
+            fcntl(dp->fd, F_SETFL, (fcntl(dp->fd, F_GETFL) & ~O_DIRECT) | (direct ? O_DIRECT : 0));
+            dp->direct = direct;
+        }
+    }
+#elif defined(F_NOCACHE)
+    if (updater->options.direct && !dp->direct) {
+        fcntl(dp->fd, F_NOCACHE, 1);
+        dp->direct = 1;
+    }
+#endif
+    metricsAdd(&updater->metrics.writes, 1);
+    if (pwrite(dp->fd, buf, len, offset) != (ssize_t) len) {
+        fprintf(stderr, "Cannot save response");
+        return -1;
+    }
+#if defined(POSIX_FADV_DONTNEED)
+    if (updater->options.dropCache && !dp->direct) {
+        /*
+            Start writeback of this block, then wait for the prior blocks to reach storage so they
+            can be released from the page cache
+         */
+    #if __linux__
+        sync_file_range(dp->fd, offset, len, SYNC_FILE_RANGE_WRITE);
+        if (offset > dp->dropped) {
+            sync_file_range(dp->fd, dp->dropped, offset - dp->dropped,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        }
+    #else
+        fdatasync(dp->fd);
+    #endif
+        posix_fadvise(dp->fd, dp->dropped, offset - dp->dropped, POSIX_FADV_DONTNEED);
+        dp->dropped = offset;
+    }
+#endif
+    return 0;
+}
+
+/*
+    Add "len" bytes of the image at "offset" to the image digest. With a block manifest, each
+    block is also hashed and verified as it completes. The image digest is marked at the start of
+    each block so a block that does not verify can be rewound. Returns -1 if a block is rejected.
+ */
+static int downloadDigest(Download *dp, cchar *buf, size_t len, size_t offset)
+{
+    Manifest *mp;
+    size_t   at, bytes, pos;
+
+    mp = dp->manifest;
+    if (mp->blockSize == 0) {
+        if (digestUpdate(&dp->digest, buf, len) < 0) {
+            fprintf(stderr, "DigestUpdate error\n");
+            return -1;
+        }
+        return 0;
+    }
+    for (pos = 0; pos < len; pos += bytes) {
+        at = offset + pos;
+        if (at % mp->blockSize == 0) {
+            //  Data already streamed cannot be recalled, so the stream is not marked
+            digestFree(&dp->block);
+            if (!dp->stream && digestCopy(&dp->mark, &dp->digest) < 0) {
+                return -1;
+            }
+            if (digestInit(&dp->block, DIGEST_SHA256) < 0) {
+                return -1;
+            }
+        }
+        bytes = min(len - pos, mp->blockSize - at % mp->blockSize);
+        if (digestUpdate(&dp->digest, &buf[pos], bytes) < 0 || digestUpdate(&dp->block, &buf[pos], bytes) < 0) {
+            fprintf(stderr, "DigestUpdate error\n");
+            return -1;
+        }
+        if ((at + bytes) % mp->blockSize == 0 && blockVerify(mp, &dp->block, at / mp->blockSize) < 0) {
+            dp->rejected = (long long) (at - at % mp->blockSize);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Verify the final block of a complete image and that the image has all the manifest blocks
+ */
+static int downloadBlocks(Download *dp)
+{
+    Manifest *mp;
+
+    mp = dp->manifest;
+    if (mp->blockSize == 0) {
+        return 0;
+    }
+    if (pipeDrain(dp) < 0) {
+        return -1;
+    }
+    if (dp->offset % mp->blockSize && blockVerify(mp, &dp->block, dp->offset / mp->blockSize) < 0) {
+        dp->rejected = (long long) (dp->offset - dp->offset % mp->blockSize);
+        return -1;
+    }
+    if ((dp->offset + mp->blockSize - 1) / mp->blockSize != mp->blockCount) {
+        fprintf(stderr, "Image size does not match the block manifest\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Complete the digest of block "index" and compare with the block manifest. The digest is freed.
+ */
+static int blockVerify(Manifest *mp, Digest *dg, size_t index)
+{
+    char sum[EVP_MAX_MD_SIZE * 2 + 1];
+
+    if (digestFinal(dg, sum) < 0) {
+        return -1;
+    }
+    if (index >= mp->blockCount || strcasecmp(sum, mp->hashes[index].value) != 0) {
+        fprintf(stderr, "Block %d of the image does not verify\n", (int) index);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Rewind a download to the start of a rejected block so it can be fetched again. The image
+    digest is restored from the mark taken at the start of the block and the image truncated.
+    Returns -1 if there is no rejected block or it cannot be fetched again.
+ */
+static int blockRewind(Download *dp)
+{
+    if (dp->rejected < 0) {
+        return -1;
+    }
+    //  Wait for the pipeline stages to release the buffers after the rejected block
+    pipeDrain(dp);
+    if (dp->stream || dp->patch) {
+        return -1;
+    }
+    digestFree(&dp->digest);
+    dp->digest = dp->mark;
+    dp->mark.mdctx = NULL;
+    dp->mark.fd = -1;
+    dp->offset = (size_t) dp->rejected;
+    dp->saved = min(dp->saved, dp->offset);
+    dp->dropped = min(dp->dropped, dp->offset);
+    dp->rejected = -1;
+    if (ftruncate(dp->fd, dp->offset) < 0) {
+        return -1;
+    }
+#if ME_UPDATER_PIPELINE
+    if (dp->pipeline) {
+        atomic_store(&dp->pipeline->error, 0);
+    }
+#endif
+    dp->refetch = 1;
+    return 0;
+}
+
+#if ME_UPDATER_PIPELINE
+/*
+    Start the download pipeline. The hash and write stages run on their own threads. The write
+    buffer is exchanged with the ring buffers as it fills, so the reader and the stages each work
+    on different buffers.
+ */
+static int pipeOpen(Download *dp)
+{
+    Pipeline *pp;
+    int      i;
+
+    if ((pp = ucalloc(1, sizeof(Pipeline))) == NULL) {
+        fprintf(stderr, "Cannot allocate download pipeline\n");
+        return -1;
+    }
+    atomic_init(&pp->queued, 0);
+    atomic_init(&pp->hashed, 0);
+    atomic_init(&pp->written, 0);
+    atomic_init(&pp->seq, 0);
+    atomic_init(&pp->waiters, 0);
+    atomic_init(&pp->error, 0);
+    atomic_init(&pp->stop, 0);
+    pthread_mutex_init(&pp->lock, NULL);
+    pthread_cond_init(&pp->cond, NULL);
+    pp->count = min(updater->options.pipeline, PIPE_MAX);
+    dp->pipeline = pp;
+
+    for (i = 0; i < pp->count; i++) {
+        if ((pp->ring[i].buf = ualign(dp->bufsize, DOWNLOAD_ALIGN)) == NULL) {
+            fprintf(stderr, "Cannot allocate %d byte download buffer\n", (int) dp->bufsize);
+            pipeClose(dp);
+            return -1;
+        }
+    }
+    if (pthread_create(&pp->hasher, NULL, pipeHasher, dp) != 0) {
+        fprintf(stderr, "Cannot start download pipeline\n");
+        pipeClose(dp);
+        return -1;
+    }
+    if (pthread_create(&pp->writer, NULL, pipeWriter, dp) != 0) {
+        fprintf(stderr, "Cannot start download pipeline\n");
+        atomic_store(&pp->stop, 1);
+        pipeWake(pp);
+        pthread_join(pp->hasher, NULL);
+        pp->hasher = 0;
+        pipeClose(dp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Stop the download pipeline once the queued buffers are processed. Returns -1 if a stage failed.
+ */
+static int pipeClose(Download *dp)
+{
+    Pipeline *pp;
+    int      i, rc;
+
+    if ((pp = dp->pipeline) == NULL) {
+        return 0;
+    }
+    atomic_store(&pp->stop, 1);
+    pipeWake(pp);
+    if (pp->hasher) {
+        pthread_join(pp->hasher, NULL);
+    }
+    if (pp->writer) {
+        pthread_join(pp->writer, NULL);
+    }
+    rc = atomic_load(&pp->error) ? -1 : 0;
+    for (i = 0; i < pp->count; i++) {
+        ufree(pp->ring[i].buf);
+    }
+    pthread_mutex_destroy(&pp->lock);
+    pthread_cond_destroy(&pp->cond);
+    ufree(pp);
+    dp->pipeline = NULL;
+    return rc;
+}
+
+/*
+    Queue the write buffer for the hash and write stages. The buffer is exchanged for the oldest
+    ring buffer, waiting for the slower stage to release it if required.
+ */
+static int pipeSubmit(Download *dp)
+{
+    Pipeline   *pp;
+    PipeBuffer *bp;
+    char       *buf;
+    size_t     hashed, queued, written;
+    uint       seq;
+
+    pp = dp->pipeline;
+    queued = atomic_load(&pp->queued);
+    while (1) {
+        seq = atomic_load(&pp->seq);
+        hashed = atomic_load(&pp->hashed);
+        written = atomic_load(&pp->written);
+        if (queued - min(hashed, written) < (size_t) pp->count) {
+            break;
+        }
+        pipeWait(pp, seq);
+    }
+    if (atomic_load(&pp->error)) {
+        return -1;
+    }
+    bp = &pp->ring[queued % pp->count];
+    buf = bp->buf;
+    bp->buf = dp->buf;
+    bp->len = dp->fill;
+    bp->offset = dp->offset;
+    dp->buf = buf;
+    atomic_store(&pp->queued, queued + 1);
+    pipeWake(pp);
+    return 0;
+}
+
+/*
+    Wait until the queued buffers have been hashed and written. Returns -1 if a stage failed.
+ */
+static int pipeDrain(Download *dp)
+{
+    Pipeline *pp;
+    size_t   queued;
+    uint     seq;
+
+    if ((pp = dp->pipeline) == NULL) {
+        return 0;
+    }
+    queued = atomic_load(&pp->queued);
+    while (1) {
+        seq = atomic_load(&pp->seq);
+        if (atomic_load(&pp->hashed) == queued && atomic_load(&pp->written) == queued) {
+            break;
+        }
+        pipeWait(pp, seq);
+    }
+    return atomic_load(&pp->error) ? -1 : 0;
+}
+
+/*
+    Hash and verify stage. The manifest signature is verified first, while the image is received.
+ */
+static void *pipeHasher(void *arg)
+{
+    Download *dp;
+
+    dp = arg;
+    updater = dp->updater;
+    if (updater->signKey) {
+        dp->authentic = signatureVerify(dp->manifest->checksum, dp->manifest->signature) == 0 ? 1 : -1;
+    }
+    pipeRun(dp, &dp->pipeline->hashed, pipeDigest);
+    return NULL;
+}
+
+/*
+    Write stage
+ */
+static void *pipeWriter(void *arg)
+{
+    Download *dp;
+
+    dp = arg;
+    updater = dp->updater;
+    pipeRun(dp, &dp->pipeline->written, pipeWrite);
+    return NULL;
+}
+
+static int pipeDigest(Download *dp, PipeBuffer *bp)
+{
+    return downloadDigest(dp, bp->buf, bp->len, bp->offset);
+}
+
+static int pipeWrite(Download *dp, PipeBuffer *bp)
+{
+    return downloadWrite(dp, bp->buf, bp->len, bp->offset);
+}
+
+/*
+    Run a pipeline stage. Each queued buffer is processed in order and the "done" counter advanced
+    to release it. After a failure, buffers are released without processing so the reader is not
+    blocked. The stage exits when stopped and the ring is empty.
+ */
+static void pipeRun(Download *dp, atomic_size_t *done, int (*stage)(Download *dp, PipeBuffer *bp))
+{
+    Pipeline *pp;
+    size_t   next;
+    uint     seq;
+
+    pp = dp->pipeline;
+    for (next = atomic_load(done); ; next++) {
+        while (1) {
+            seq = atomic_load(&pp->seq);
+            if (atomic_load(&pp->queued) > next) {
+                break;
+            }
+            if (atomic_load(&pp->stop)) {
+                return;
+            }
+            pipeWait(pp, seq);
+        }
+        if (!atomic_load(&pp->error) && stage(dp, &pp->ring[next % pp->count]) < 0) {
+            atomic_store(&pp->error, 1);
+        }
+        atomic_store(done, next + 1);
+        pipeWake(pp);
+    }
+}
+
+/*
+    Sleep until the pipeline counters change from the "seq" sample. The sample is taken before
+    testing the counters, so a change made after the test is not missed.
+ */
+static void pipeWait(Pipeline *pp, uint seq)
+{
+    pthread_mutex_lock(&pp->lock);
+    atomic_fetch_add(&pp->waiters, 1);
+    while (atomic_load(&pp->seq) == seq) {
+        pthread_cond_wait(&pp->cond, &pp->lock);
+    }
+    atomic_fetch_sub(&pp->waiters, 1);
+    pthread_mutex_unlock(&pp->lock);
+}
+
+/*
+    Signal a change of the pipeline counters. The lock is only taken if a thread is sleeping.
+ */
+static void pipeWake(Pipeline *pp)
+{
+    atomic_fetch_add(&pp->seq, 1);
+    if (atomic_load(&pp->waiters)) {
+        pthread_mutex_lock(&pp->lock);
+        pthread_cond_broadcast(&pp->cond);
+        pthread_mutex_unlock(&pp->lock);
+    }
+}
+
+#else
+/*
+    Without the pipeline, downloads are always hashed and written inline
+ */
+static int pipeClose(Download *dp)
+{
+    return 0;
+}
+
+static int pipeDrain(Download *dp)
+{
+    return 0;
+}
+#endif /* ME_UPDATER_PIPELINE */
+
+/*
+    Return the path of the resume sidecar for an image path
+ */
+static char *resumePath(cchar *path, char *buf, size_t bufsize)
+{
+    snprintf(buf, bufsize, "%s%s", path, RESUME_EXT);
+    return buf;
+}
+
+#if ME_UPDATER_RESUME
+/*
+    Read the resume sidecar of a partial download. The sidecar records the bytes saved, the
+    checksum of the complete image and its entity tag. A partial for a different image is ignored.
+ */
+static int readResume(Download *dp)
+{
+    FILE        *file;
+    struct stat info;
+    char        path[UBSIZE], checksum[EVP_MAX_MD_SIZE * 2 + 1], etag[sizeof(dp->etag)];
+    long long   offset;
+
+    if ((file = fopen(resumePath(dp->path, path, sizeof(path)), "r")) == NULL) {
+        return -1;
+    }
+    if (fscanf(file, "%lld %128s %79s", &offset, checksum, etag) != 3 ||
+        strcmp(checksum, dp->manifest->checksum) != 0 || stat(dp->path, &info) < 0 || info.st_size < offset) {
+        fclose(file);
+        unlink(path);
+        return -1;
+    }
+    fclose(file);
+    dp->offset = dp->saved = (size_t) offset;
+    if (strcmp(etag, "-") != 0) {
+        snprintf(dp->etag, sizeof(dp->etag), "%s", etag);
+    }
+    return 0;
+}
 
 /*
-    Allocate a Fetch control structure. This primarily sets up an OpenSSL context.
+    Checkpoint the bytes saved to the resume sidecar. The image is synced first so the recorded
+    bytes are durable.
  */
-static Fetch *fetchAlloc(int fd)
+static int saveResume(Download *dp)
 {
-    Fetch            *fp;
-    const SSL_METHOD *method;
+    FILE *file;
+    char path[UBSIZE];
 
-    fp = malloc(sizeof(Fetch));
-    memset(fp, 0, sizeof(Fetch));
+    if (pipeDrain(dp) < 0) {
+        return -1;
+    }
+    fsync(dp->fd);
+    if ((file = fopen(resumePath(dp->path, path, sizeof(path)), "w")) == NULL) {
+        return -1;
+    }
+    fprintf(file, "%lld %s %s\n", (long long) dp->offset, dp->manifest->checksum, dp->etag[0] ? dp->etag : "-");
+    fclose(file);
+    dp->saved = dp->offset;
+    return 0;
+}
 
-    method = TLS_client_method();
-    fp->ctx = SSL_CTX_new(method);
-    if (!fp->ctx) {
-        perror("Unable to create SSL context");
-        ERR_print_errors_fp(stderr);
+#else
+/*
+    Without resume, an interrupted download starts over in the next run. Downloads interrupted
+    within a run are still resumed.
+ */
+static int readResume(Download *dp)
+{
+    return -1;
+}
+
+static int saveResume(Download *dp)
+{
+    return 0;
+}
+#endif
+
+/*
+    Return a response HTTP header. Returns NULL if the header is absent or memory is exhausted.
+    Caller must free.
+ */
+static char *fetchHeader(Fetch *fp, cchar *key)
+{
+    cchar  *start;
+    char   *value;
+    size_t len;
+
+    value = 0;
+    if ((start = fetchHeaderFind(fp, key, &len)) != NULL && (value = ualloc(len + 1)) != NULL) {
+        memcpy(value, start, len);
+        value[len] = '\0';
+    }
+    return value;
+}
+
+/*
+    Find a response HTTP header. Header names are matched without regard to case at the start of
+    each header line. Returns a reference to the value in the response, trimmed to "len" bytes.
+ */
+static cchar *fetchHeaderFind(Fetch *fp, cchar *key, size_t *len)
+{
+    cchar  *end, *line, *value;
+    size_t klen;
+
+    if (!fp->response || (line = strstr(fp->response, "\r\n")) == NULL) {
         return NULL;
     }
-    fp->ssl = SSL_new(fp->ctx);
-    fp->fd = fd;
-    SSL_set_fd(fp->ssl, fd);
-    if (SSL_connect(fp->ssl) != 1) {
-        ERR_print_errors_fp(stderr);
+    klen = strlen(key);
+    //  Skip the status line. The response retains the terminator of the last header line.
+    for (line += 2; (end = strstr(line, "\r\n")) != NULL; line = end + 2) {
+        if (strncasecmp(line, key, klen) == 0 && line[klen] == ':') {
+            for (value = &line[klen + 1]; value < end && isspace((uchar) *value); value++) {}
+            while (end > value && isspace((uchar) end[-1])) {
+                end--;
+            }
+            *len = (size_t) (end - value);
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Read response data. Returns the bytes read, 0 if the peer closed the connection, -1 on errors
+    and timeouts or, on a non-blocking connection, UPDATE_WANT_READ or UPDATE_WANT_WRITE.
+ */
+static ssize_t fetchRead(Fetch *fp, char *buf, size_t buflen)
+{
+    ssize_t bytes;
+
+    fp->reads++;
+    if ((bytes = fp->transport->read(fp->tls, buf, buflen)) < 0) {
+        if (bytes != UPDATE_WANT_READ && bytes != UPDATE_WANT_WRITE) {
+            return -1;
+        }
+        if (!(fcntl(fp->fd, F_GETFL) & O_NONBLOCK)) {
+            //  A blocking socket is only not ready when the read timeout expired
+            fprintf(stderr, "Timeout receiving from %s\n", fp->host);
+            return -1;
+        }
+        return bytes;
+    }
+    fp->bytes += bytes;
+    return bytes;
+}
+
+/*
+    Read response data directly into a file at "offset" with the transport. Returns the bytes read,
+    0 if the peer closed the connection, -1 on errors or UPDATE_WANT_COPY if the data must be read
+    with fetchRead.
+ */
+static ssize_t fetchReadFile(Fetch *fp, int fd, size_t offset, size_t len)
+{
+    ssize_t bytes;
+
+    fp->reads++;
+    if ((bytes = fp->transport->recvFile(fp->tls, fd, (off_t) offset, len)) < 0) {
+        return bytes == UPDATE_WANT_COPY ? bytes : -1;
+    }
+    fp->bytes += bytes;
+    return bytes;
+}
+
+/*
+    Write request data
+ */
+static size_t fetchWrite(Fetch *fp, char *buf, size_t buflen)
+{
+    ssize_t bytes;
+
+    if ((bytes = fp->transport->write(fp->tls, buf, buflen)) <= 0) {
+        return -1;
+    }
+    return (size_t) bytes;
+}
+
+/*
+    Allocate a Fetch control structure and connect via TLS. The handshake must complete within the
+    connect timeout.
+ */
+static Fetch *fetchAlloc(int fd, cchar *host)
+{
+    Fetch     *fp;
+    long long start;
+    int       rc;
+
+    if ((fp = fetchCreate(fd, host)) == NULL) {
+        return NULL;
+    }
+    start = uticks();
+    timeoutSocket(fd, timeoutConnect());
+    if ((rc = fp->transport->handshake(fp->tls)) != 1) {
+        if (rc == UPDATE_WANT_READ || rc == UPDATE_WANT_WRITE) {
+            fprintf(stderr, "Timeout in TLS handshake with %s\n", host);
+        }
+        fp->transport->close(fp->tls);
+        ufree(fp);
+        return NULL;
+    }
+    timeoutSocket(fd, timeoutRead());
+    metricsAdd(&updater->metrics.tls, uticks() - start);
+    if (updater->verbose && fp->transport->resumed && fp->transport->resumed(fp->tls)) {
+        printf("Resumed TLS session with %s\n", host);
+    }
+    return fp;
+}
+
+/*
+    Allocate a Fetch control structure and prepare a TLS connection on the socket with the selected
+    transport. Any cached session for the host is resumed. The caller performs the handshake.
+ */
+static Fetch *fetchCreate(int fd, cchar *host)
+{
+    Fetch *fp;
+    Conn  *cp;
+    char  name[256];
+
+    fetchSetup();
+    if ((fp = ualloc(sizeof(Fetch))) == NULL) {
         return NULL;
     }
+    memset(fp, 0, sizeof(Fetch));
+    snprintf(fp->host, sizeof(fp->host), "%s", host);
+    fp->transport = fetchTransport();
+
+    //  The transport is given the host name without any port
+    snprintf(name, sizeof(name), "%.*s", (int) strcspn(host, ":"), host);
+    pthread_mutex_lock(&updater->fetchLock);
+    cp = poolLookup(host, 0);
+    fp->tls = fp->transport->open(fd, name, cp && cp->transport == fp->transport ? cp->session : NULL);
+    pthread_mutex_unlock(&updater->fetchLock);
+    if (fp->tls == NULL) {
+        ufree(fp);
+        return NULL;
+    }
+    fp->fd = fd;
+    //  Blocking reads and writes fail if the server stalls
+    timeoutSocket(fd, timeoutRead());
     return fp;
 }
 
 /*
-    Deallocate a Fetch control structure.
+    One time setup before the first connection. Writing to a connection the peer has closed must
+    fail with EPIPE, not terminate.
+ */
+static void fetchSetup(void)
+{
+    pthread_once(&fetchOnce, fetchSignals);
+}
+
+static void fetchSignals(void)
+{
+    struct sigaction sa;
+
+    if (sigaction(SIGPIPE, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+        signal(SIGPIPE, SIG_IGN);
+    }
+}
+
+/*
+    Deallocate a Fetch control structure. If the response was fully consumed, the connection is
+    returned to the pool for reuse. The TLS session is saved for resumption.
  */
 static void fetchFree(Fetch *fp)
 {
+    const UpdateTransport *tp;
+    void                  *session;
+    Conn                  *cp;
+
     if (!fp) {
         return;
     }
-    if (fp->ssl) {
-        SSL_free(fp->ssl);
-        fp->ssl = NULL;
-    }
-    if (fp->ctx) {
-        SSL_CTX_free(fp->ctx);
-        fp->ctx = NULL;
+    pthread_mutex_lock(&updater->metricsLock);
+    updater->metrics.reads += fp->reads;
+    updater->metrics.bytes += fp->bytes;
+    pthread_mutex_unlock(&updater->metricsLock);
+    fp->reads = fp->bytes = 0;
+
+    if (fp->tls) {
+        tp = fp->transport;
+        pthread_mutex_lock(&updater->fetchLock);
+        if (fp->complete && tp->session && (session = tp->session(fp->tls)) != NULL) {
+            cp = poolLookup(fp->host, 1);
+            if (cp->session) {
+                cp->transport->freeSession(cp->session);
+            }
+            cp->session = session;
+            cp->transport = tp;
+        }
+        if (fp->complete && fp->keepAlive && fp->rxStart == fp->rxEnd) {
+            //  Only pool a connection with no unconsumed response data
+            cp = poolLookup(fp->host, 1);
+            if (cp->tls) {
+                fetchClose(cp->transport, cp->tls, cp->fd);
+            }
+            if (cp->session && cp->transport != tp) {
+                //  A session is only resumed by the transport that created it
+                cp->transport->freeSession(cp->session);
+                cp->session = NULL;
+            }
+            cp->transport = tp;
+            cp->tls = fp->tls;
+            cp->fd = fp->fd;
+            fp->tls = NULL;
+            fp->fd = -1;
+        } else {
+            fetchClose(tp, fp->tls, fp->fd);
+            fp->tls = NULL;
+            fp->fd = -1;
+        }
+        pthread_mutex_unlock(&updater->fetchLock);
     }
     if (fp->fd >= 0) {
         close(fp->fd);
         fp->fd = -1;
     }
     if (fp->response) {
-        free(fp->response);
+        ufree(fp->response);
         fp->response = NULL;
     }
-    if (fp->firstBody) {
-        free(fp->firstBody);
-        fp->firstBody = NULL;
+    ufree(fp);
+}
+
+/*
+    Prepare an OpenSSL client connection on a socket. The host is sent for SNI. The server certificate
+    is not verified. The TLS context is created on first use and kept for the life of the updater
+    context. Calls are serialized by the fetch lock.
+ */
+static void *opensslOpen(int fd, cchar *host, void *session)
+{
+    Tls *tp;
+
+    if (!updater->sslCtx) {
+        if ((updater->sslCtx = SSL_CTX_new(TLS_client_method())) == NULL) {
+            perror("Unable to create SSL context");
+            ERR_print_errors_fp(stderr);
+            return NULL;
+        }
+        SSL_CTX_set_session_cache_mode(updater->sslCtx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        //  Read ahead so each socket read can return several TLS records
+        SSL_CTX_set_read_ahead(updater->sslCtx, 1);
+        //  Non-blocking writes may complete partially and be retried from a different buffer address
+        SSL_CTX_set_mode(updater->sslCtx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    }
+    if ((tp = ualloc(sizeof(Tls))) == NULL) {
+        return NULL;
+    }
+    tp->pipe[0] = tp->pipe[1] = -1;
+    if ((tp->ssl = SSL_new(updater->sslCtx)) == NULL) {
+        ERR_print_errors_fp(stderr);
+        ufree(tp);
+        return NULL;
+    }
+    if (updater->options.ktls) {
+        /*
+            Records read ahead into the TLS buffer prevent the kernel taking over decryption, so
+            read ahead is disabled with kernel TLS
+         */
+        SSL_set_options(tp->ssl, SSL_OP_ENABLE_KTLS);
+        SSL_set_read_ahead(tp->ssl, 0);
+    }
+    SSL_set_tlsext_host_name(tp->ssl, host);
+    if (session) {
+        SSL_set_session(tp->ssl, session);
+    }
+    SSL_set_fd(tp->ssl, fd);
+    return tp;
+}
+
+static int opensslHandshake(void *tls)
+{
+    Tls *tp;
+
+    tp = tls;
+    return opensslResult(tp, SSL_connect(tp->ssl));
+}
+
+static ssize_t opensslRead(void *tls, char *buf, size_t len)
+{
+    Tls *tp;
+    int bytes;
+
+    tp = tls;
+    if ((bytes = SSL_read(tp->ssl, buf, (int) min(len, INT_MAX))) > 0) {
+        return bytes;
+    }
+    return opensslResult(tp, bytes);
+}
+
+static ssize_t opensslWrite(void *tls, cchar *buf, size_t len)
+{
+    Tls *tp;
+    int bytes;
+
+    tp = tls;
+    if ((bytes = SSL_write(tp->ssl, buf, (int) min(len, INT_MAX))) > 0) {
+        return bytes;
+    }
+    return opensslResult(tp, bytes);
+}
+
+/*
+    Map an OpenSSL result to a transport result. A result of zero when the connection is closed
+    without a TLS close notify is treated as closed, as servers may end a body that way.
+ */
+static int opensslResult(Tls *tp, int rc)
+{
+    if (rc > 0) {
+        return rc;
+    }
+    switch (SSL_get_error(tp->ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+        return UPDATE_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return UPDATE_WANT_WRITE;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    default:
+        if (rc == 0) {
+            ERR_clear_error();
+            return 0;
+        }
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+}
+
+/*
+    Close a connection. A quiet shutdown marks the connection as cleanly closed so the TLS session
+    remains resumable, without writing to a socket the peer may have already closed.
+ */
+static void opensslClose(void *tls)
+{
+    Tls *tp;
+
+    tp = tls;
+    SSL_set_quiet_shutdown(tp->ssl, 1);
+    SSL_shutdown(tp->ssl);
+    SSL_free(tp->ssl);
+    if (tp->pipe[0] >= 0) {
+        close(tp->pipe[0]);
+        close(tp->pipe[1]);
     }
-    free(fp);
+    ufree(tp);
+}
+
+static int opensslResumed(void *tls)
+{
+    return SSL_session_reused(((Tls*) tls)->ssl);
+}
+
+static void *opensslSession(void *tls)
+{
+    return SSL_get1_session(((Tls*) tls)->ssl);
+}
+
+static void opensslFreeSession(void *session)
+{
+    SSL_SESSION_free(session);
 }
 
 /*
-    Trivial routine to lookup a key value in a json formatted string.
-    This is NOT a generic JSON parser and does NOT handle use other than required by the Updater API.
-    Caller must free result.
+    Receive data into a file without copying it through user space. Once the kernel has taken over
+    TLS decryption, the socket data is spliced into the file through a pipe. Records other than
+    application data, such as session tickets, and data already buffered by OpenSSL must be
+    read with SSL_read.
  */
-static char *json(cchar *json, cchar *key)
+static ssize_t opensslRecvFile(void *tls, int fd, off_t offset, size_t len)
 {
-    char *end, keybuf[80], *keyPos, *start;
-    int  quoted;
+#if __linux__
+    Tls     *tp;
+    loff_t  pos;
+    ssize_t bytes, moved, n;
 
-    snprintf(keybuf, sizeof(keybuf), "%s\":", key);
-    keyPos = strstr(json, keybuf);
-    if (keyPos) {
-        keyPos += strlen(key) + 2;  // assuming format is "key":<space>
-        quoted = (*keyPos == '"') ? 1 : 0;
-        start = quoted ? keyPos + 1 : keyPos;
-        end = start;
-        while (*end && ((quoted && *end != '"') || (!quoted && *end != ',' && *end != '}'))) {
-            end++;
+    tp = tls;
+    if (!BIO_get_ktls_recv(SSL_get_rbio(tp->ssl)) || SSL_pending(tp->ssl) > 0) {
+        return UPDATE_WANT_COPY;
+    }
+    if (tp->pipe[0] < 0 && pipe2(tp->pipe, O_CLOEXEC) < 0) {
+        return UPDATE_WANT_COPY;
+    }
+    if ((bytes = splice(SSL_get_fd(tp->ssl), NULL, tp->pipe[1], NULL, len, SPLICE_F_MOVE)) < 0) {
+        if (errno == EAGAIN) {
+            return UPDATE_WANT_READ;
         }
-        int  size = end - start;
-        char *value = (char*) malloc(size + 1);
-        if (value) {
-            strncpy(value, start, size);
-            value[size] = '\0';
-            return value;
+        return errno == EINVAL ? UPDATE_WANT_COPY : -1;
+    }
+    pos = offset;
+    for (n = 0; n < bytes; n += moved) {
+        //  The spliced data is only in the pipe, so the connection is unusable if it cannot be written
+        if ((moved = splice(tp->pipe[0], NULL, fd, &pos, (size_t) (bytes - n), SPLICE_F_MOVE)) <= 0) {
+            perror("Cannot write image");
+            return -1;
         }
     }
-    return NULL;
+    return bytes;
+#else
+    return UPDATE_WANT_COPY;
+#endif
 }
 
 /*
-    Calculate a SHA-256 checksum for a file
+    Minimal single-pass JSON tokenizer. This indexes the text once into a token array so fields
+    can be looked up without rescanning or allocating per field. Strings and primitives are NUL
+    terminated in-situ and string escapes are decoded in place. Returns the number of tokens,
+    which is zero for empty text.
  */
-static int getFileSum(cchar *path, char sum[EVP_MAX_MD_SIZE])
+static int jsonParse(Json *jp, char *text)
 {
-    FILE          *file;
-    EVP_MD_CTX    *mdctx;
-    unsigned char buf[UBSIZE], hash[EVP_MAX_MD_SIZE];
-    unsigned int  len;
-    size_t        bytes;
+    JsonToken *tp;
+    char      *cp, *end, *start;
+    int       stack[32], depth, i, type;
 
-    file = fopen(path, "rb");
-    if (!file) {
-        fprintf(stderr, "Cannot open %s\n", path);
-        return -1;
+    memset(jp, 0, sizeof(Json));
+    depth = 0;
+
+    for (cp = text; *cp; ) {
+        if (isspace((uchar) *cp) || *cp == ',' || *cp == ':') {
+            cp++;
+            continue;
+        }
+        if (*cp == '}' || *cp == ']') {
+            if (depth == 0) {
+                jsonFree(jp);
+                return -1;
+            }
+            tp = &jp->tokens[stack[--depth]];
+            if (tp->type != ((*cp == '}') ? JSON_OBJECT : JSON_ARRAY)) {
+                jsonFree(jp);
+                return -1;
+            }
+            tp->len = cp - tp->value + 1;
+            tp->next = jp->count;
+            cp++;
+            continue;
+        }
+        if (jp->count >= jp->max) {
+            jp->max = jp->max ? jp->max * 2 : JSON_TOKENS;
+            if ((tp = urealloc(jp->tokens, jp->max * sizeof(JsonToken))) == NULL) {
+                jsonFree(jp);
+                return -1;
+            }
+            jp->tokens = tp;
+        }
+        if (depth > 0) {
+            jp->tokens[stack[depth - 1]].size++;
+        } else if (jp->count > 0) {
+            //  Only one top level value
+            jsonFree(jp);
+            return -1;
+        }
+        tp = &jp->tokens[jp->count];
+        tp->next = ++jp->count;
+        tp->size = 0;
+
+        if (*cp == '{' || *cp == '[') {
+            if (depth >= (int) (sizeof(stack) / sizeof(int))) {
+                jsonFree(jp);
+                return -1;
+            }
+            tp->type = (*cp == '{') ? JSON_OBJECT : JSON_ARRAY;
+            tp->value = cp++;
+            stack[depth++] = jp->count - 1;
+
+        } else if (*cp == '"') {
+            start = ++cp;
+            if ((end = jsonString(start, &cp)) == NULL) {
+                jsonFree(jp);
+                return -1;
+            }
+            tp->type = JSON_STRING;
+            tp->value = start;
+            tp->len = end - start;
+
+        } else {
+            for (start = cp; *cp && !isspace((uchar) *cp) && !strchr(",:]}", *cp); cp++) {}
+            tp->type = JSON_PRIMITIVE;
+            tp->value = start;
+            tp->len = cp - start;
+        }
     }
-    mdctx = EVP_MD_CTX_new();
-    if (!mdctx) {
-        fprintf(stderr, "Failed to create EVP_MD_CTX");
-        fclose(file);
+    if (depth > 0) {
+        jsonFree(jp);
         return -1;
     }
-    if (EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL) != 1) {
-        fprintf(stderr, "DigestInit error\n");
-        EVP_MD_CTX_free(mdctx);
-        fclose(file);
-        return -1;
+    //  Members of an object are counted as key and value tokens
+    for (i = 0; i < jp->count; i++) {
+        if (jp->tokens[i].type == JSON_OBJECT) {
+            if (jp->tokens[i].size % 2) {
+                jsonFree(jp);
+                return -1;
+            }
+            jp->tokens[i].size /= 2;
+        }
     }
-    while ((bytes = fread(buf, 1, sizeof(buf), file)) > 0) {
-        if (EVP_DigestUpdate(mdctx, buf, bytes) != 1) {
-            fprintf(stderr, "DigestUpdate error\n");
-            EVP_MD_CTX_free(mdctx);
-            fclose(file);
-            return -1;
+    /*
+        Terminate values now that all delimiters have been seen
+     */
+    for (i = 0; i < jp->count; i++) {
+        type = jp->tokens[i].type;
+        if (type == JSON_STRING || type == JSON_PRIMITIVE) {
+            jp->tokens[i].value[jp->tokens[i].len] = '\0';
         }
     }
-    if (EVP_DigestFinal_ex(mdctx, hash, &len) != 1) {
-        fprintf(stderr, "DigestFinal error\n");
-        EVP_MD_CTX_free(mdctx);
-        fclose(file);
+    return jp->count;
+}
+
+/*
+    Scan a JSON string starting after the opening quote and decode escapes in place.
+    Returns a reference to the end of the decoded string and sets "endp" after the closing quote.
+ */
+static char *jsonString(char *start, char **endp)
+{
+    char *cp, *dp;
+    uint c, lo;
+    int  i;
+
+    for (cp = dp = start; *cp && *cp != '"'; ) {
+        if (*cp != '\\') {
+            *dp++ = *cp++;
+            continue;
+        }
+        switch (*++cp) {
+        case 'b': *dp++ = '\b'; break;
+        case 'f': *dp++ = '\f'; break;
+        case 'n': *dp++ = '\n'; break;
+        case 'r': *dp++ = '\r'; break;
+        case 't': *dp++ = '\t'; break;
+        case '"': case '\\': case '/': *dp++ = *cp; break;
+        case 'u':
+            for (c = 0, i = 1; i <= 4; i++) {
+                if (!isxdigit((uchar) cp[i])) {
+                    return NULL;
+                }
+                c = c * 16 + (isdigit((uchar) cp[i]) ? cp[i] - '0' : (tolower((uchar) cp[i]) - 'a' + 10));
+            }
+            cp += 4;
+            if (c >= 0xD800 && c <= 0xDBFF && cp[1] == '\\' && cp[2] == 'u') {
+                //  Surrogate pair
+                for (lo = 0, i = 3; i <= 6; i++) {
+                    if (!isxdigit((uchar) cp[i])) {
+                        return NULL;
+                    }
+                    lo = lo * 16 + (isdigit((uchar) cp[i]) ? cp[i] - '0' : (tolower((uchar) cp[i]) - 'a' + 10));
+                }
+                if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                    c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+                    cp += 6;
+                }
+            }
+            //  Encode as UTF-8. The encoding is never longer than the escape.
+            if (c < 0x80) {
+                *dp++ = (char) c;
+            } else if (c < 0x800) {
+                *dp++ = (char) (0xC0 | (c >> 6));
+                *dp++ = (char) (0x80 | (c & 0x3F));
+            } else if (c < 0x10000) {
+                *dp++ = (char) (0xE0 | (c >> 12));
+                *dp++ = (char) (0x80 | ((c >> 6) & 0x3F));
+                *dp++ = (char) (0x80 | (c & 0x3F));
+            } else {
+                *dp++ = (char) (0xF0 | (c >> 18));
+                *dp++ = (char) (0x80 | ((c >> 12) & 0x3F));
+                *dp++ = (char) (0x80 | ((c >> 6) & 0x3F));
+                *dp++ = (char) (0x80 | (c & 0x3F));
+            }
+            break;
+        default:
+            return NULL;
+        }
+        cp++;
+    }
+    if (*cp != '"') {
+        return NULL;
+    }
+    *endp = cp + 1;
+    return dp;
+}
+
+/*
+    Return the token index of the value for "key" in the object token "parent". Returns -1 if not found.
+ */
+static int jsonLookup(Json *jp, int parent, cchar *key)
+{
+    JsonToken *tokens;
+    int       i;
+
+    tokens = jp->tokens;
+    if (parent < 0 || parent >= jp->count || tokens[parent].type != JSON_OBJECT) {
         return -1;
     }
-    EVP_MD_CTX_free(mdctx);
-    fclose(file);
+    for (i = parent + 1; i < tokens[parent].next; i = tokens[i + 1].next) {
+        if (tokens[i].type == JSON_STRING && strcmp(tokens[i].value, key) == 0) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
 
-    for (int i = 0; i < len; i++) {
-        sprintf(&sum[i * 2], "%02x", hash[i]);
+/*
+    Return the string or primitive value for "key" in the object token "parent".
+    The result refers to the parsed text and must not be freed. Returns NULL if not found.
+ */
+static char *jsonGet(Json *jp, int parent, cchar *key)
+{
+    int index;
+
+    if ((index = jsonLookup(jp, parent, key)) < 0) {
+        return NULL;
     }
-    return 0;
+    if (jp->tokens[index].type == JSON_OBJECT || jp->tokens[index].type == JSON_ARRAY) {
+        return NULL;
+    }
+    return jp->tokens[index].value;
+}
+
+/*
+    Free the JSON token index. The parsed text is owned by the caller.
+ */
+static void jsonFree(Json *jp)
+{
+    ufree(jp->tokens);
+    jp->tokens = NULL;
+    jp->count = jp->max = 0;
 }
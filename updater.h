@@ -2,10 +2,201 @@
     updater.h - Check for software upgrades
  */
 
+#include <sys/types.h>
+
 #ifndef HAS_CCHAR
 typedef const char cchar;
 #endif
 
+/*
+    Build profile. Each feature is included by default. Define a feature as 0, for example
+    -DME_UPDATER_DELTA=0, to omit its code from the build for small targets.
+ */
+#ifndef ME_UPDATER_ASYNC
+    #define ME_UPDATER_ASYNC 1      ///< Non-blocking update API: updateStart, updatePoll, updateFd and updateFree
+#endif
+#ifndef ME_UPDATER_BATCH
+    #define ME_UPDATER_BATCH 1      ///< Gateway batch updates: updateBatch
+#endif
+#ifndef ME_UPDATER_CACHE
+    #define ME_UPDATER_CACHE 1      ///< Image cache: the cache and cacheSize options
+#endif
+#ifndef ME_UPDATER_COMPRESS
+    #define ME_UPDATER_COMPRESS 1   ///< Compressed image downloads (gzip, and zstd with HAS_ZSTD). Requires zlib.
+#endif
+#ifndef ME_UPDATER_DELTA
+    #define ME_UPDATER_DELTA 1      ///< Delta updates: the base option. Requires libbz2.
+#endif
+#ifndef ME_UPDATER_PARALLEL
+    #define ME_UPDATER_PARALLEL 1   ///< Parallel range downloads: the parallel option
+#endif
+#ifndef ME_UPDATER_PEER
+    #define ME_UPDATER_PEER 1       ///< LAN peer distribution of cached images: the peers option. Requires the cache.
+#endif
+#ifndef ME_UPDATER_PIPELINE
+    #define ME_UPDATER_PIPELINE 1   ///< Threaded hash and write pipeline: the pipeline option
+#endif
+#ifndef ME_UPDATER_QUEUE
+    #define ME_UPDATER_QUEUE 1      ///< Durable update report queue: the reports option
+#endif
+#ifndef ME_UPDATER_RESUME
+    #define ME_UPDATER_RESUME 1     ///< Resume interrupted downloads in a later run from the partial image sidecar
+#endif
+#if !ME_UPDATER_CACHE
+    #undef ME_UPDATER_PEER
+    #define ME_UPDATER_PEER 0
+#endif
+
+#define UPDATE_WANT_READ  -2     ///< Transport result: wait for the socket to be readable
+#define UPDATE_WANT_WRITE -3     ///< Transport result: wait for the socket to be writable
+#define UPDATE_WANT_COPY  -4     ///< Transport result: the data must be received with read instead of recvFile
+
+/**
+    TLS transport
+    @description A transport provides the TLS client for all update connections so a TLS stack other
+        than OpenSSL, such as mbedTLS, wolfSSL or BearSSL, can be used. The connection and session
+        handles are opaque to the updater. The updater connects and closes the sockets. Routines given
+        a non-blocking socket return UPDATE_WANT_READ or UPDATE_WANT_WRITE if it is not ready. Errors
+        are reported by the transport and returned as -1. Calls to open are serialized.
+ */
+typedef struct UpdateTransport {
+    cchar *name;            ///< Transport name
+    void *(*open)(int fd, cchar *host, void *session);
+                            ///< Prepare a client connection on a connected socket with the host name for SNI.
+                            ///< The updater does not verify server certificates, so a transport that requires
+                            ///< verification must perform it. Resume the session if not NULL. Returns NULL
+                            ///< on errors.
+    int (*handshake)(void *tls);
+                            ///< Perform the handshake. Returns 1 when complete.
+    ssize_t (*read)(void *tls, char *buf, size_t len);
+                            ///< Read decrypted data. Returns the bytes read or 0 if the peer closed the connection.
+    ssize_t (*write)(void *tls, cchar *buf, size_t len);
+                            ///< Write data. Returns the bytes written, which may be fewer than requested.
+    void (*close)(void *tls);
+                            ///< Shut down and free a connection. The session remains resumable.
+    int (*resumed)(void *tls);
+                            ///< Optional. Test if the handshake resumed a session.
+    void *(*session)(void *tls);
+                            ///< Optional. Return a new reference to the session of a connection for resumption.
+    void (*freeSession)(void *session);
+                            ///< Release a session reference. Required if session is set.
+    ssize_t (*recvFile)(void *tls, int fd, off_t offset, size_t len);
+                            ///< Optional. Receive up to len bytes directly into the file at the offset without
+                            ///< copying through user space, for example with kernel TLS and splice. Returns the
+                            ///< bytes received, 0 if the peer closed the connection or UPDATE_WANT_COPY if the
+                            ///< data must be read instead.
+} UpdateTransport;
+
+/**
+    Update tuning options
+    @description Fields left zero use the defaults.
+ */
+typedef struct UpdateOptions {
+    int parallel;       ///< Number of concurrent range downloads for large images. Zero or one for a single stream.
+    int bufferSize;     ///< Download buffer size. Received data is written in blocks of this size. Default 64K.
+    int direct;         ///< Write the image using direct I/O to bypass the page cache.
+    int dropCache;      ///< Release written image data from the page cache.
+    int stream;         ///< Stream the image to the apply script's standard input rather than saving it to a file.
+    cchar *base;        ///< Path of the current image. If set, delta updates are requested and applied against this image.
+                        ///< The string must remain valid while updates are performed.
+    cchar *cache;       ///< Directory to cache verified images by checksum. An image offered again is not downloaded.
+                        ///< The string must remain valid while updates are performed.
+    int cacheSize;      ///< Maximum size of the image cache in megabytes. Least recently used images are evicted. Default 256.
+    int rate;           ///< Maximum download rate in KB/sec across all download connections. Zero for no limit.
+    int adaptive;       ///< Slow the download as network queuing delay grows to yield to other traffic (LEDBAT-style).
+    cchar *window;      ///< Daily download window of the form "HH:MM-HH:MM" in local time. Downloads wait outside it.
+    int metrics;        ///< Include the update metrics in the update report posted to the Builder.
+    cchar *digest;      ///< Checksum engine: "openssl" (default), "openssl:PROVIDER" to use an OpenSSL provider,
+                        ///< "kernel" for the Linux kernel crypto API, or "blake3" to request BLAKE3 checksums
+                        ///< from the Builder (requires a BLAKE3=1 build).
+    void *arena;        ///< Memory for all updater allocations. If set, the updater does not allocate from the heap and
+                        ///< requests that do not fit fail. OpenSSL TLS state remains on the heap. The memory must remain
+                        ///< valid while updates are performed. See the README for the footprint.
+    int arenaSize;      ///< Size of the arena in bytes. Minimum 64K.
+    int pipeline;       ///< Buffers in the download pipeline. If set, the image is hashed and written by separate threads
+                        ///< while it is received. Zero to hash and write inline. Maximum 16.
+    cchar *key;         ///< Path of a PEM Ed25519 or ECDSA public key. If set, updates must have a manifest signature
+                        ///< of the image checksum that verifies with this key.
+    int compact;        ///< Send compact update checks. A repeated check sends a hash of the device properties rather
+                        ///< than the properties.
+    const UpdateTransport *transport;
+                        ///< TLS transport. NULL for the built-in OpenSSL transport. Must remain valid while
+                        ///< updates are performed.
+    int ktls;           ///< Use kernel TLS with the OpenSSL transport where the kernel supports it. Image data is
+                        ///< then received directly into the image file.
+    int timeout;        ///< Seconds to wait for the response headers and for each read of a response body before the
+                        ///< request is abandoned. Zero for the default of 30 seconds.
+    int connectTimeout; ///< Seconds to wait for a connection and for its TLS handshake. Zero for the default of 10.
+    int retries;        ///< Times to retry a failing update check or image download with exponential backoff. An
+                        ///< interrupted download resumes where it stopped. Zero for the default of 3, -1 for none.
+    cchar *mirrors;     ///< Comma separated list of fallback hosts for image downloads, tried in order when the image
+                        ///< host fails. The image path is the same on each. The string must remain valid while
+                        ///< updates are performed.
+    int peers;          ///< Share verified images in the cache with devices on the LAN and download images from LAN
+                        ///< peers before the image host. Requires the cache option. Images are verified as usual.
+                        ///< The peer service is process wide. Only the first context to set peers serves images,
+                        ///< until it clears the option or is freed. Other contexts still download from peers.
+    int peerPort;       ///< UDP port for peer discovery and TCP port to serve images to peers. Default 7447.
+    cchar *reports;     ///< Path of a durable queue of update reports. If set, the result of an update is queued
+                        ///< before it is posted and reports that cannot be posted are retried by later updates.
+                        ///< The string must remain valid while updates are performed.
+} UpdateOptions;
+
+/**
+    Update metrics
+    @description Times are in microseconds and are summed over all requests and connections of the update.
+ */
+typedef struct UpdateMetrics {
+    long long dns;          ///< Time resolving host names
+    long long connect;      ///< Time establishing TCP connections
+    long long tls;          ///< Time in TLS handshakes
+    long long firstByte;    ///< Time from sending requests until the responses start
+    long long transfer;     ///< Time receiving update images and patches
+    long long checksum;     ///< Time computing image checksums. This is included in the transfer time.
+    long long apply;        ///< Time waiting for the apply script
+    long long total;        ///< Time for the update
+    long long bytes;        ///< Bytes received
+    long long throughput;   ///< Receive rate during transfers in bytes per second
+    long long requests;     ///< HTTP requests issued
+    long long connections;  ///< New connections established
+    long long retries;      ///< Requests retried and downloads resumed
+    long long reads;        ///< Socket read calls
+    long long writes;       ///< Image write calls
+    long long memory;       ///< Peak arena memory in use during the update. Zero without an arena.
+} UpdateMetrics;
+
+#if ME_UPDATER_BATCH
+/**
+    Device of a batch update
+ */
+typedef struct UpdateDevice {
+    cchar *device;          ///< Unique device ID
+    cchar *version;         ///< Device firmware version
+    cchar *properties;      ///< Additional device properties of the form: "key:value, ...". May be NULL.
+    cchar *script;          ///< Script to apply the update to this device. Set to NULL to use the batch script.
+    int status;             ///< Set to zero if the device is current or was updated, and -1 if the update failed.
+} UpdateDevice;
+#endif
+
+#if ME_UPDATER_ASYNC
+/**
+    Non-blocking update handle
+ */
+typedef struct UpdateAsync UpdateAsync;
+#endif
+
+/**
+    Updater context
+    @description A context holds the update parameters, the options and all the state of its updates: the TLS
+        context, connection pool, DNS cache, check response cache, memory arena and metrics. Connections, TLS
+        sessions and resolved addresses are reused by later updates with the context. Updates with separate
+        contexts may run concurrently in different threads, but a context must be used by one thread at a time.
+        The update, updateBatch, updateStart and updateSetOptions APIs use a default context. Use updaterRun,
+        updaterBatch and updaterStart to update with another context. A non-blocking update keeps the context it
+        was started with, so updatePoll and updateFree may be called from any one thread at a time.
+ */
+typedef struct Updater Updater;
+
 /**
     Issue an update request to the Builder to determine if there is a software update
     @description If there is an update, download to the given path and invoke the script to apply
@@ -17,7 +208,177 @@ typedef const char cchar;
     @param properties String of additional device properties of the form: "key:value, ..."
     @param path File name to save the downloaded update. The script should remove after applying
     @param script Optional script to invoke to apply the update. The path to the update is supplied as the only argument.
+        In streaming mode, the path is "-" and the image is supplied on the script's standard input. When the image
+        is complete, the script can read "OK checksum" or "FAIL" from the descriptor in UPDATE_STATUS_FD.
     @param verbose Set to true to trace execution
  */
 int update(cchar *host, cchar *product, cchar *token, cchar *device, cchar *version, cchar *properties,
            cchar *path, cchar *script, int verbose);
+
+#if ME_UPDATER_BATCH
+/**
+    Update a batch of devices
+    @description This is intended for gateways managing many downstream devices. The update check requests
+        for the devices are pipelined over a shared connection. Each distinct image offered is downloaded and
+        verified once, then applied to each device offered it by invoking the script with the image path and
+        the device ID as arguments. The image is removed once applied to all its devices, so the script should
+        not remove it. The update status is posted for each device.
+    @param host Device cloud host address
+    @param product Product ID obtained from the Builder token list
+    @param token CloudAPI token obtained from the Builder token list
+    @param devices Array of devices to update. The status of each device is set on return.
+    @param count Number of devices
+    @param path File name to save the downloaded update. If several images are offered, ".N" is appended for each.
+    @param script Optional script to invoke to apply an update to a device.
+    @param verbose Set to true to trace execution
+    @return Zero if all devices are current or were updated. Otherwise -1.
+ */
+int updateBatch(cchar *host, cchar *product, cchar *token, UpdateDevice *devices, int count,
+                cchar *path, cchar *script, int verbose);
+#endif
+
+/**
+    Set options for subsequent update requests
+    @param options Update options. Set to NULL to restore the defaults.
+    @return Zero if successful, or -1 if the options are invalid.
+ */
+int updateSetOptions(const UpdateOptions *options);
+
+/**
+    Get the metrics of the last update
+    @description The metrics are reset when an update starts and may be read while it is in progress.
+    @param metrics Set to the update metrics
+ */
+void updateGetMetrics(UpdateMetrics *metrics);
+
+/**
+    Pause or resume update downloads
+    @description Downloads in progress are held while paused, for example while the application has latency
+        sensitive traffic. This routine may be called from another thread or from a signal handler.
+    @param pause Set to 1 to pause and 0 to resume
+ */
+void updatePause(int pause);
+
+#if ME_UPDATER_ASYNC
+/**
+    Start an update without blocking the caller
+    @description This is a non-blocking variant of update() for use in an event loop. The check, download,
+        apply and report steps proceed over non-blocking connections as updatePoll is invoked. Wait for the
+        descriptor returned by updateFd to be ready, then call updatePoll. Host names are resolved in a helper
+        thread. The apply script is run as a child process and its exit is awaited via updateFd. The base,
+        parallel, stream, rate, adaptive and window options are not supported and are ignored, as is updatePause.
+    @param host Device cloud host address
+    @param product Product ID obtained from the Builder token list
+    @param token CloudAPI token obtained from the Builder token list
+    @param device Unique device ID
+    @param version Device firmware version
+    @param properties String of additional device properties of the form: "key:value, ..."
+    @param path File name to save the downloaded update. The script should remove after applying
+    @param script Optional script to invoke to apply the update. The path to the update is supplied as the only argument.
+    @param verbose Set to true to trace execution
+    @return An update handle or NULL if the update cannot be started. Free with updateFree.
+ */
+UpdateAsync *updateStart(cchar *host, cchar *product, cchar *token, cchar *device, cchar *version,
+                         cchar *properties, cchar *path, cchar *script, int verbose);
+
+/**
+    Advance an update without blocking
+    @param up Update handle returned by updateStart
+    @return 1 if the update is in progress, 0 if it has completed successfully (or there is no update) and -1 on errors.
+ */
+int updatePoll(UpdateAsync *up);
+
+/**
+    Get the descriptor an update is waiting for
+    @description Wait for the events on the descriptor with poll, select or epoll before calling updatePoll.
+        If the returned events are zero, the update can proceed immediately and updatePoll should be called
+        again without waiting. The descriptor may change between calls to updatePoll.
+    @param up Update handle returned by updateStart
+    @param events Set to the POLLIN or POLLOUT events to wait for
+    @return The descriptor or -1 if the update has completed.
+ */
+int updateFd(UpdateAsync *up, int *events);
+
+/**
+    Free an update handle
+    @description An update in progress is abandoned. A partial download is retained to be resumed.
+    @param up Update handle returned by updateStart
+ */
+void updateFree(UpdateAsync *up);
+#endif
+
+/**
+    Allocate an updater context
+    @description Set the update parameters with updaterSetOption and the options with updaterSetOptions, then run
+        updates with updaterRun. The context is allocated from the heap.
+    @return A context or NULL if memory cannot be allocated. Free with updaterFree.
+ */
+Updater *updaterAlloc(void);
+
+/**
+    Set an update parameter of a context
+    @param up Updater context
+    @param name Parameter name: "host", "product", "token", "device", "version", "properties", "file", "script"
+        or "verbose". The parameters are those of update(). The "file" parameter is the update path.
+    @param value Parameter value. The value is copied. Set to NULL to clear the parameter. For "verbose", set to
+        "1" to trace execution.
+    @return Zero if successful, or -1 if the name is unknown or the value cannot be copied.
+ */
+int updaterSetOption(Updater *up, cchar *name, cchar *value);
+
+/**
+    Set the options of a context for subsequent updates
+    @param up Updater context
+    @param options Update options. Set to NULL to restore the defaults.
+    @return Zero if successful, or -1 if the options are invalid.
+ */
+int updaterSetOptions(Updater *up, const UpdateOptions *options);
+
+/**
+    Check for an update with a context and apply it
+    @description This is update() using the parameters and options of the context. The host, product, token,
+        device, version and file parameters are required.
+    @param up Updater context
+    @return Zero if successful, or -1 on errors.
+ */
+int updaterRun(Updater *up);
+
+#if ME_UPDATER_ASYNC
+/**
+    Start an update with a context without blocking the caller
+    @description This is updateStart() using the parameters and options of the context. The host, product,
+        token, device, version and file parameters are required. Advance the update with updatePoll and
+        free it with updateFree before freeing the context.
+    @param up Updater context
+    @return An update handle or NULL if the update cannot be started. Free with updateFree.
+ */
+UpdateAsync *updaterStart(Updater *up);
+#endif
+
+#if ME_UPDATER_BATCH
+/**
+    Update a batch of devices with a context
+    @description This is updateBatch() using the host, product, token, file, script and verbose parameters
+        and the options of the context.
+    @param up Updater context
+    @param devices Array of devices to update. The status of each device is set on return.
+    @param count Number of devices
+    @return Zero if all devices are current or were updated. Otherwise -1.
+ */
+int updaterBatch(Updater *up, UpdateDevice *devices, int count);
+#endif
+
+/**
+    Get the metrics of the last update run with a context
+    @param up Updater context
+    @param metrics Set to the update metrics
+ */
+void updaterGetMetrics(Updater *up, UpdateMetrics *metrics);
+
+/**
+    Free an updater context
+    @description Closes the pooled connections and releases all state of the context. The context must not be in
+        use by another thread.
+    @param up Updater context
+ */
+void updaterFree(Updater *up);
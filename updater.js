@@ -2,10 +2,11 @@
 /*
    updater.js - NodeJS version of the updater
 */
-import {exec} from 'child_process'
+import {spawn} from 'child_process'
 import fs from 'fs'
 import crypto from 'crypto'
-import {Readable} from 'stream'
+import http from 'http'
+import https from 'https'
 
 function usage() {
     console.log(
@@ -15,6 +16,7 @@ function usage() {
             "--file image/path   # Path to save the downloaded update
             "--host host.domain  # Device cloud endpoint from the Builder cloud edit panel
             "--product ProductID # ProductID from the Buidler token list
+            "--stream            # Stream the image to the --cmd script without saving
             "--token TokenID     # CloudAPI access token from the Builder token list
             "--version SemVer    # Current device firmware version
             "--verbose           # Trace execution
@@ -22,9 +24,24 @@ function usage() {
     process.exit(2)
 }
 
+const READ_TIMEOUT = 30             //  Seconds to wait for response headers and each body read
+const RESUME_EXT = '.resume'        //  Extension of the partial download sidecar
+const RESUME_INTERVAL = 1 << 20     //  Bytes between resume sidecar checkpoints
+const RETRY_COUNT = 3               //  Retries of a download attempt that makes no progress
+const RETRY_DELAY = 1000            //  Milliseconds before the first retry. Doubled for each retry.
+const STATUS_FD = 3                 //  Apply script descriptor for the streamed image verdict
+
+/*
+    Requests reuse connections to the device cloud and image hosts
+ */
+const agents = {
+    'http:': new http.Agent({keepAlive: true}),
+    'https:': new https.Agent({keepAlive: true}),
+}
+
 let file = '/tmp/update.bin'
 let properties = {}
-let cmd, device, host, product, token, version, verbose
+let cmd, device, host, product, stream, token, version, verbose
 
 async function main() {
     parseArgs()
@@ -40,18 +57,14 @@ async function main() {
     if (verbose) {
         console.log('Check for updates\n', body, '\n')
     }
-    let response = await fetch(`${host}/tok/provision/update`, {
-        method: 'POST',
-        headers: {
-            'Authorization': token,
-            'Content-Type': 'application/json',
-        },
-        body: JSON.stringify(body), 
-    })
-    if (!response.ok) {
+    let response = await request('POST', `${host}/tok/provision/update`, {
+        'Authorization': token,
+        'Content-Type': 'application/json',
+    }, JSON.stringify(body))
+    let data = await readBody(response)
+    if (response.statusCode != 200) {
         throw new Error('Cannot fetch update')
     }
-    let data = await response.text()
     if (verbose) {
         console.log('Update response\n', data, '\n')
     }
@@ -63,17 +76,23 @@ async function main() {
             Update available if "url" defined
         */
         if (data.url) {
-            //  Download update image to "path"
-            await download(data.url, file)
-
-            //  Verify checksum
-            let sum = await getChecksum(file)
-            if (sum != data.checksum) {
-                throw new Error('Update checksum does not match')
+            let success
+            if (stream) {
+                //  Stream the image to the apply script, which receives the verdict once complete
+                let script = applyStart(cmd)
+                let sum = await download(data.url, null, data.checksum, script.stdin).catch(() => null)
+                success = await applyFinish(script, sum == data.checksum ? sum : null)
+            } else {
+                //  Download update image to "path". The checksum is computed as the image is received.
+                let sum = await download(data.url, file, data.checksum)
+                if (sum != data.checksum) {
+                    throw new Error('Update checksum does not match')
+                }
+                if (cmd) {
+                    success = await applyUpdate(cmd, file)
+                }
             }
             if (cmd) {
-                let success = await applyUpdate(cmd, file)
-
                 //  Post update report
                 let body = {
                     success,
@@ -83,36 +102,62 @@ async function main() {
                 if (verbose) {
                     console.log(`Post update results ${success ? 'success' : 'failed'}`)
                 }
-                await fetch(`${host}/tok/provision/updateReport`, {
-                    method: 'POST',
-                    headers: {
-                        'Authorization': token,
-                        'Content-Type': 'application/json',
-                    },
-                    body: JSON.stringify(body), 
-                })
+                await readBody(await request('POST', `${host}/tok/provision/updateReport`, {
+                    'Authorization': token,
+                    'Content-Type': 'application/json',
+                }, JSON.stringify(body)))
             }
         }
     }
 }
 
 /*
-    Apply the update by running the external "cmd" script
+    Apply the update by running the external "cmd" script with the image path
  */
 async function applyUpdate(cmd, path) {
     if (verbose) {
         console.log(`Apply update ${path} using ${cmd}`)
     }
-    let status = await new Promise((resolve, reject) => {
-        exec(`bash ${cmd}`, (error) => {
-            if (error) {
-                resolve(false)
-            } else {
-                resolve(true)
-            }
-        })
+    let child = spawn('bash', [cmd, path], {stdio: 'inherit'})
+    return await new Promise((resolve) => {
+        child.on('error', () => resolve(false))
+        child.on('close', (code) => resolve(code == 0))
     })
-    return status
+}
+
+/*
+    Start the apply script to receive a streamed update image on its standard input. The path
+    argument is "-". Once the image is complete, the verdict is written to descriptor STATUS_FD
+    (also given by the UPDATE_STATUS_FD environment variable) as "OK checksum" or "FAIL".
+ */
+function applyStart(cmd) {
+    if (verbose) {
+        console.log(`Apply streamed update using ${cmd}`)
+    }
+    let stdio = ['pipe', 'inherit', 'inherit']
+    stdio[STATUS_FD] = 'pipe'
+    let child = spawn('bash', [cmd, '-'], {
+        env: Object.assign({}, process.env, {UPDATE_STATUS_FD: String(STATUS_FD)}),
+        stdio,
+    })
+    //  The script may exit without reading all of the image or the verdict
+    child.stdin.on('error', () => null)
+    child.stdio[STATUS_FD].on('error', () => null)
+    child.exited = new Promise((resolve) => {
+        child.on('error', () => resolve(false))
+        child.on('close', (code) => resolve(code == 0))
+    })
+    return child
+}
+
+/*
+    Complete a streamed update. Close the image stream, send the verdict and wait for the script
+    to exit. The "sum" is null if the image failed verification.
+ */
+async function applyFinish(child, sum) {
+    child.stdin.end()
+    child.stdio[STATUS_FD].end(sum ? `OK ${sum}\n` : 'FAIL\n')
+    return await child.exited
 }
 
 function parseArgs() {
@@ -136,6 +181,9 @@ function parseArgs() {
         } else if (arg == "--product") {
             product = args[++i]
 
+        } else if (arg == "--stream") {
+            stream = 1
+
         } else if (arg == "--token") {
             token = args[++i]
 
@@ -153,42 +201,176 @@ function parseArgs() {
         let [key, value] = args[i].split('=')
         properties[key.trim()] = value.trim()
     }
-    if (!file || !host || !product || !token || !device || !version) {
+    if (!file || !host || !product || !token || !device || !version || (stream && !cmd)) {
         usage()
     }
 }
 
 /*
-    Stream download the file from the given url to the path
+    Issue a request using the keep-alive agents. Resolves with the response once the headers are received.
  */
-async function download(url, path) {
-    let res = await fetch(url)
-    if (!res.ok) {
-        throw new Error(`Failed to fetch ${url}: ${res.statusText}`)
+function request(method, url, headers = {}, body = null) {
+    let uri = new URL(url)
+    if (body != null) {
+        headers['Content-Length'] = Buffer.byteLength(body)
     }
-    const stream = fs.createWriteStream(path)
-    Readable.fromWeb(res.body).pipe(stream)
-
-    return await new Promise((resolve, reject) => {
-        stream.on('error', reject)
-        stream.on('finish', resolve)
+    return new Promise((resolve, reject) => {
+        let req = (uri.protocol == 'http:' ? http : https).request(uri, {
+            agent: agents[uri.protocol],
+            headers,
+            method,
+        }, resolve)
+        req.setTimeout(READ_TIMEOUT * 1000, () => req.destroy(new Error(`Request to ${url} timed out`)))
+        req.on('error', reject)
+        req.end(body)
     })
 }
 
 /*
-    Get the checksum of the given file
+    Read a response body as text. The body must be consumed before the connection can be reused.
  */
-async function getChecksum(path) {
-    return new Promise((resolve, reject) => {
-        const hash = crypto.createHash('sha256')
-        const stream = fs.createReadStream(path)
-        stream.on('error', (err) => { reject(err) })
-        stream.on('data', (chunk) => { hash.update(chunk) })
-        stream.on('end', () => {
-            const sha256 = hash.digest('hex')
-            resolve(sha256)
-        })
-    })
+async function readBody(response) {
+    let chunks = []
+    for await (let chunk of response) {
+        chunks.push(chunk)
+    }
+    return Buffer.concat(chunks).toString()
 }
-        
-main()
\ No newline at end of file
+
+/*
+    Download the image at the url to the path, or to the "sink" stream when streaming, and return its
+    checksum. The data is hashed as it is received. An interrupted download resumes immediately from
+    where it stopped. Retries that make no progress are limited. When saving to a path, progress is
+    checkpointed in a resume sidecar so a later run can resume a partial image of the same checksum.
+ */
+async function download(url, path, checksum, sink = null) {
+    let hash = crypto.createHash('sha256')
+    let sidecar = path ? path + RESUME_EXT : null
+    let fd, etag, offset = 0, saved = 0
+
+    if (path) {
+        [offset, etag] = readResume(sidecar, path, checksum)
+        fd = fs.openSync(path, offset ? 'r+' : 'w')
+        if (offset) {
+            //  Restore the digest over the partial image
+            await hashFile(hash, path, offset)
+            fs.ftruncateSync(fd, offset)
+            saved = offset
+        }
+    }
+    try {
+        for (let retries = 0; ; ) {
+            let start = offset
+            try {
+                let headers = {}
+                if (offset) {
+                    headers['Range'] = `bytes=${offset}-`
+                    if (etag) {
+                        headers['If-Range'] = etag
+                    }
+                }
+                let response = await request('GET', url, headers)
+                if (response.statusCode == 200 && offset) {
+                    if (!path) {
+                        //  A streamed image cannot be restarted
+                        response.destroy()
+                        throw Object.assign(new Error(`Cannot resume ${url}`), {permanent: true})
+                    }
+                    //  The image changed or ranges are not supported, so start over
+                    hash = crypto.createHash('sha256')
+                    fs.ftruncateSync(fd, 0)
+                    offset = start = saved = 0
+                } else if (response.statusCode != 200 && response.statusCode != 206) {
+                    response.resume()
+                    throw new Error(`Failed to fetch ${url}: ${response.statusCode}`)
+                }
+                etag = response.headers['etag'] || etag
+                let length = response.headers['content-length']
+                length = length != null ? offset + Number(length) : null
+
+                for await (let chunk of response) {
+                    hash.update(chunk)
+                    if (sink) {
+                        if (!sink.write(chunk)) {
+                            await new Promise((resolve) => sink.once('drain', resolve))
+                        }
+                    } else {
+                        fs.writeSync(fd, chunk, 0, chunk.length, offset)
+                    }
+                    offset += chunk.length
+                    if (path && offset - saved >= RESUME_INTERVAL) {
+                        saved = saveResume(sidecar, fd, offset, checksum, etag)
+                    }
+                }
+                if (length != null && offset < length) {
+                    throw new Error(`Download of ${url} was cut short`)
+                }
+                break
+            } catch (err) {
+                if (err.permanent || (offset == start && ++retries > RETRY_COUNT)) {
+                    throw err
+                }
+                if (verbose) {
+                    console.log(`Resume download at ${offset}: ${err.message}`)
+                }
+                if (offset == start) {
+                    await new Promise((resolve) => setTimeout(resolve, RETRY_DELAY << (retries - 1)))
+                }
+            }
+        }
+    } catch (err) {
+        //  Record progress so a subsequent run can resume
+        if (path && offset) {
+            saveResume(sidecar, fd, offset, checksum, etag)
+        }
+        throw err
+    } finally {
+        if (fd != null) {
+            fs.closeSync(fd)
+        }
+    }
+    if (path) {
+        fs.rmSync(sidecar, {force: true})
+    }
+    return hash.digest('hex')
+}
+
+/*
+    Update the hash with the first "length" bytes of the file at the path
+ */
+async function hashFile(hash, path, length) {
+    for await (let chunk of fs.createReadStream(path, {end: length - 1})) {
+        hash.update(chunk)
+    }
+}
+
+/*
+    Read the resume sidecar of a partial download. The sidecar records the bytes saved, the checksum
+    of the complete image and its entity tag, as written by the C updater. A partial for a different
+    image is ignored. Returns the offset and etag.
+ */
+function readResume(sidecar, path, checksum) {
+    try {
+        let [offset, sum, etag] = fs.readFileSync(sidecar, 'utf8').trim().split(' ')
+        offset = Number(offset)
+        if (sum == checksum && offset > 0 && fs.statSync(path).size >= offset) {
+            return [offset, etag != '-' ? etag : null]
+        }
+    } catch (err) {
+        return [0, null]
+    }
+    fs.rmSync(sidecar, {force: true})
+    return [0, null]
+}
+
+/*
+    Checkpoint the bytes saved to the resume sidecar. The image is synced first so the recorded
+    bytes are durable. Returns the offset saved.
+ */
+function saveResume(sidecar, fd, offset, checksum, etag) {
+    fs.fsyncSync(fd)
+    fs.writeFileSync(sidecar, `${offset} ${checksum} ${etag || '-'}\n`)
+    return offset
+}
+
+main()